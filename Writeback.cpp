@@ -10,11 +10,37 @@
 
 #include <iostream>
 #include <cstdint>
+#include <cstddef>
 #include <fstream>
 #include <cstdio>
 #include <cmath>
+#include <ctime>
+#include <climits>
 #include <iomanip>
 #include <cstdlib>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <type_traits>
+#include <chrono>
+#include <sstream>
 using namespace std;
 
 struct FetchOut {
@@ -32,22 +58,20 @@ struct FetchOut {
 };
 
 
-enum OpcodeCategories {
+enum OpcodeCategories : uint8_t {
    LOAD, STORE, BRANCH, JALR,
    JAL, OP_IMM, OP, AUIPC, LUI,
    OP_IMM_32, OP_32, SYSTEM,
+   AMO, MISC_MEM,
    UNIMPL
     };
 
-const OpcodeCategories OPCODE_MAP[4][8] = {
-   // First row (inst[6:5] = 0b00)
-   { LOAD, UNIMPL, UNIMPL, UNIMPL, OP_IMM, AUIPC, OP_IMM_32, UNIMPL }, 
-   // Second row (inst[6:5] = 0b01)
-   { STORE, UNIMPL, UNIMPL, UNIMPL, OP, LUI, OP_32, UNIMPL },
-   // Third row (inst[6:5] = 0b10)
-   { UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL },
-   // Fourth row (inst[6:5] = 0b11)
-   { BRANCH, JALR, UNIMPL, JAL, SYSTEM, UNIMPL, UNIMPL, UNIMPL }
+const char *const CATEGORY_NAMES[] = {
+   "LOAD", "STORE", "BRANCH", "JALR",
+   "JAL", "OP_IMM", "OP", "AUIPC", "LUI",
+   "OP_IMM_32", "OP_32", "SYSTEM",
+   "AMO", "MISC_MEM",
+   "UNIMPL"
 };
 
     int64_t sign_extend(int64_t value, int8_t index) {
@@ -61,89 +85,329 @@ const OpcodeCategories OPCODE_MAP[4][8] = {
     }
 }
 
+//List of ALU commands
+enum AluCommands : uint8_t {
+   ALU_ADD,
+   ALU_SUB,
+   ALU_MUL,
+   ALU_DIV,
+   ALU_REM,
+   ALU_SLL,
+   ALU_SRL,
+   ALU_SRA,
+   ALU_AND,
+   ALU_OR,
+   ALU_XOR,
+   ALU_NOT
+};
+
+// The concrete instructions this machine supports. The fast execution mode
+// (Machine::run_fast) has one handler for each of these.
+enum InstKinds : uint8_t {
+   I_LUI, I_AUIPC, I_JAL, I_JALR,
+   I_BEQ, I_BNE, I_BLT, I_BGE, I_BLTU, I_BGEU,
+   I_LB, I_LH, I_LW, I_LD, I_LBU, I_LHU, I_LWU,
+   I_SB, I_SH, I_SW, I_SD,
+   I_ADDI, I_XORI, I_ORI, I_ANDI, I_SLLI, I_SRLI, I_SRAI,
+   I_ADDIW, I_SLLIW, I_SRLIW, I_SRAIW,
+   I_ADD, I_SUB, I_SLL, I_XOR, I_SRL, I_SRA, I_OR, I_AND,
+   I_MUL, I_DIV, I_REM,
+   I_ADDW, I_SUBW, I_SLLW, I_SRLW, I_SRAW,
+   I_MULW, I_DIVW, I_REMW,
+   I_ECALL,
+   I_CSRRW, I_CSRRS, I_CSRRC, I_CSRRWI, I_CSRRSI, I_CSRRCI,
+   I_SFENCE_VMA,
+   I_FENCE, I_FENCE_I,
+   I_LR_W, I_SC_W, I_AMOSWAP_W, I_AMOADD_W, I_AMOXOR_W, I_AMOAND_W, I_AMOOR_W,
+   I_AMOMIN_W, I_AMOMAX_W, I_AMOMINU_W, I_AMOMAXU_W,
+   I_LR_D, I_SC_D, I_AMOSWAP_D, I_AMOADD_D, I_AMOXOR_D, I_AMOAND_D, I_AMOOR_D,
+   I_AMOMIN_D, I_AMOMAX_D, I_AMOMINU_D, I_AMOMAXU_D,
+   I_INVALID,
+   NUM_INST_KINDS
+};
+
+// Where an instruction keeps its fields. FMT_SHIFT is an I-type whose
+// immediate is a 6-bit shift amount, with the funct bits above it (RV64
+// uses inst[25] for the shift amount). FMT_SHIFTW only has a 5-bit one.
+// FMT_SYSTEM is an I-type whose funct7 bits are part of the encoding, which
+// keeps ECALL apart from SFENCE.VMA. FMT_AMO is an R-type whose funct7 has
+// the aq and rl bits at the bottom, which aren't part of the encoding.
+enum InstFormats : uint8_t {
+   FMT_R, FMT_I, FMT_SHIFT, FMT_SHIFTW, FMT_S, FMT_B, FMT_U, FMT_J,
+   FMT_SYSTEM, FMT_AMO, FMT_NONE
+};
+
+// One instruction of the ISA. kind is what the semantics are keyed on: the
+// run_fast() handler table and the JIT both index by it.
+struct IsaEntry {
+   const char *name;
+   InstFormats format;
+   uint8_t opcode;        // inst[6:0]
+   uint8_t funct3;        // inst[14:12], if the format has it
+   uint8_t funct7;        // inst[31:25], if the format has it
+   OpcodeCategories op;
+   AluCommands cmd;
+   InstKinds kind;
+};
+
+// The whole ISA, in InstKinds order so that ISA[kind] is the entry for kind.
+// Everything decode needs comes from here; to add an instruction, add an
+// InstKinds value and a line here, and the static_asserts below check that
+// the decode table still tells it apart from the others.
+constexpr IsaEntry ISA[NUM_INST_KINDS] = {
+   { "LUI",    FMT_U,      0x37, 0, 0,    LUI,       ALU_ADD, I_LUI },
+   { "AUIPC",  FMT_U,      0x17, 0, 0,    AUIPC,     ALU_ADD, I_AUIPC },
+   { "JAL",    FMT_J,      0x6f, 0, 0,    JAL,       ALU_ADD, I_JAL },
+   { "JALR",   FMT_I,      0x67, 0, 0,    JALR,      ALU_ADD, I_JALR },
+   { "BEQ",    FMT_B,      0x63, 0, 0,    BRANCH,    ALU_SUB, I_BEQ },
+   { "BNE",    FMT_B,      0x63, 1, 0,    BRANCH,    ALU_SUB, I_BNE },
+   { "BLT",    FMT_B,      0x63, 4, 0,    BRANCH,    ALU_SUB, I_BLT },
+   { "BGE",    FMT_B,      0x63, 5, 0,    BRANCH,    ALU_SUB, I_BGE },
+   { "BLTU",   FMT_B,      0x63, 6, 0,    BRANCH,    ALU_SUB, I_BLTU },
+   { "BGEU",   FMT_B,      0x63, 7, 0,    BRANCH,    ALU_SUB, I_BGEU },
+   { "LB",     FMT_I,      0x03, 0, 0,    LOAD,      ALU_ADD, I_LB },
+   { "LH",     FMT_I,      0x03, 1, 0,    LOAD,      ALU_ADD, I_LH },
+   { "LW",     FMT_I,      0x03, 2, 0,    LOAD,      ALU_ADD, I_LW },
+   { "LD",     FMT_I,      0x03, 3, 0,    LOAD,      ALU_ADD, I_LD },
+   { "LBU",    FMT_I,      0x03, 4, 0,    LOAD,      ALU_ADD, I_LBU },
+   { "LHU",    FMT_I,      0x03, 5, 0,    LOAD,      ALU_ADD, I_LHU },
+   { "LWU",    FMT_I,      0x03, 6, 0,    LOAD,      ALU_ADD, I_LWU },
+   { "SB",     FMT_S,      0x23, 0, 0,    STORE,     ALU_ADD, I_SB },
+   { "SH",     FMT_S,      0x23, 1, 0,    STORE,     ALU_ADD, I_SH },
+   { "SW",     FMT_S,      0x23, 2, 0,    STORE,     ALU_ADD, I_SW },
+   { "SD",     FMT_S,      0x23, 3, 0,    STORE,     ALU_ADD, I_SD },
+   { "ADDI",   FMT_I,      0x13, 0, 0,    OP_IMM,    ALU_ADD, I_ADDI },
+   { "XORI",   FMT_I,      0x13, 4, 0,    OP_IMM,    ALU_XOR, I_XORI },
+   { "ORI",    FMT_I,      0x13, 6, 0,    OP_IMM,    ALU_OR,  I_ORI },
+   { "ANDI",   FMT_I,      0x13, 7, 0,    OP_IMM,    ALU_AND, I_ANDI },
+   { "SLLI",   FMT_SHIFT,  0x13, 1, 0x00, OP_IMM,    ALU_SLL, I_SLLI },
+   { "SRLI",   FMT_SHIFT,  0x13, 5, 0x00, OP_IMM,    ALU_SRL, I_SRLI },
+   { "SRAI",   FMT_SHIFT,  0x13, 5, 0x20, OP_IMM,    ALU_SRA, I_SRAI },
+   { "ADDIW",  FMT_I,      0x1b, 0, 0,    OP_IMM_32, ALU_ADD, I_ADDIW },
+   { "SLLIW",  FMT_SHIFTW, 0x1b, 1, 0x00, OP_IMM_32, ALU_SLL, I_SLLIW },
+   { "SRLIW",  FMT_SHIFTW, 0x1b, 5, 0x00, OP_IMM_32, ALU_SRL, I_SRLIW },
+   { "SRAIW",  FMT_SHIFTW, 0x1b, 5, 0x20, OP_IMM_32, ALU_SRA, I_SRAIW },
+   { "ADD",    FMT_R,      0x33, 0, 0x00, OP,        ALU_ADD, I_ADD },
+   { "SUB",    FMT_R,      0x33, 0, 0x20, OP,        ALU_SUB, I_SUB },
+   { "SLL",    FMT_R,      0x33, 1, 0x00, OP,        ALU_SLL, I_SLL },
+   { "XOR",    FMT_R,      0x33, 4, 0x00, OP,        ALU_XOR, I_XOR },
+   { "SRL",    FMT_R,      0x33, 5, 0x00, OP,        ALU_SRL, I_SRL },
+   { "SRA",    FMT_R,      0x33, 5, 0x20, OP,        ALU_SRA, I_SRA },
+   { "OR",     FMT_R,      0x33, 6, 0x00, OP,        ALU_OR,  I_OR },
+   { "AND",    FMT_R,      0x33, 7, 0x00, OP,        ALU_AND, I_AND },
+   { "MUL",    FMT_R,      0x33, 0, 0x01, OP,        ALU_MUL, I_MUL },
+   { "DIV",    FMT_R,      0x33, 4, 0x01, OP,        ALU_DIV, I_DIV },
+   { "REM",    FMT_R,      0x33, 6, 0x01, OP,        ALU_REM, I_REM },
+   { "ADDW",   FMT_R,      0x3b, 0, 0x00, OP_32,     ALU_ADD, I_ADDW },
+   { "SUBW",   FMT_R,      0x3b, 0, 0x20, OP_32,     ALU_SUB, I_SUBW },
+   { "SLLW",   FMT_R,      0x3b, 1, 0x00, OP_32,     ALU_SLL, I_SLLW },
+   { "SRLW",   FMT_R,      0x3b, 5, 0x00, OP_32,     ALU_SRL, I_SRLW },
+   { "SRAW",   FMT_R,      0x3b, 5, 0x20, OP_32,     ALU_SRA, I_SRAW },
+   { "MULW",   FMT_R,      0x3b, 0, 0x01, OP_32,     ALU_MUL, I_MULW },
+   { "DIVW",   FMT_R,      0x3b, 4, 0x01, OP_32,     ALU_DIV, I_DIVW },
+   { "REMW",   FMT_R,      0x3b, 6, 0x01, OP_32,     ALU_REM, I_REMW },
+   { "ECALL",  FMT_SYSTEM, 0x73, 0, 0,    SYSTEM,    ALU_ADD, I_ECALL },
+   { "CSRRW",  FMT_I,      0x73, 1, 0,    SYSTEM,    ALU_ADD, I_CSRRW },
+   { "CSRRS",  FMT_I,      0x73, 2, 0,    SYSTEM,    ALU_ADD, I_CSRRS },
+   { "CSRRC",  FMT_I,      0x73, 3, 0,    SYSTEM,    ALU_ADD, I_CSRRC },
+   { "CSRRWI", FMT_I,      0x73, 5, 0,    SYSTEM,    ALU_ADD, I_CSRRWI },
+   { "CSRRSI", FMT_I,      0x73, 6, 0,    SYSTEM,    ALU_ADD, I_CSRRSI },
+   { "CSRRCI", FMT_I,      0x73, 7, 0,    SYSTEM,    ALU_ADD, I_CSRRCI },
+   { "SFENCE.VMA", FMT_R,  0x73, 0, 0x09, SYSTEM,    ALU_ADD, I_SFENCE_VMA },
+   { "FENCE",  FMT_I,      0x0f, 0, 0,    MISC_MEM,  ALU_ADD, I_FENCE },
+   { "FENCE.I", FMT_I,     0x0f, 1, 0,    MISC_MEM,  ALU_ADD, I_FENCE_I },
+   { "LR.W",     FMT_AMO,    0x2f, 2, 0x08, AMO,       ALU_ADD, I_LR_W },
+   { "SC.W",     FMT_AMO,    0x2f, 2, 0x0c, AMO,       ALU_ADD, I_SC_W },
+   { "AMOSWAP.W",FMT_AMO,    0x2f, 2, 0x04, AMO,       ALU_ADD, I_AMOSWAP_W },
+   { "AMOADD.W", FMT_AMO,    0x2f, 2, 0x00, AMO,       ALU_ADD, I_AMOADD_W },
+   { "AMOXOR.W", FMT_AMO,    0x2f, 2, 0x10, AMO,       ALU_ADD, I_AMOXOR_W },
+   { "AMOAND.W", FMT_AMO,    0x2f, 2, 0x30, AMO,       ALU_ADD, I_AMOAND_W },
+   { "AMOOR.W",  FMT_AMO,    0x2f, 2, 0x20, AMO,       ALU_ADD, I_AMOOR_W },
+   { "AMOMIN.W", FMT_AMO,    0x2f, 2, 0x40, AMO,       ALU_ADD, I_AMOMIN_W },
+   { "AMOMAX.W", FMT_AMO,    0x2f, 2, 0x50, AMO,       ALU_ADD, I_AMOMAX_W },
+   { "AMOMINU.W",FMT_AMO,    0x2f, 2, 0x60, AMO,       ALU_ADD, I_AMOMINU_W },
+   { "AMOMAXU.W",FMT_AMO,    0x2f, 2, 0x70, AMO,       ALU_ADD, I_AMOMAXU_W },
+   { "LR.D",     FMT_AMO,    0x2f, 3, 0x08, AMO,       ALU_ADD, I_LR_D },
+   { "SC.D",     FMT_AMO,    0x2f, 3, 0x0c, AMO,       ALU_ADD, I_SC_D },
+   { "AMOSWAP.D",FMT_AMO,    0x2f, 3, 0x04, AMO,       ALU_ADD, I_AMOSWAP_D },
+   { "AMOADD.D", FMT_AMO,    0x2f, 3, 0x00, AMO,       ALU_ADD, I_AMOADD_D },
+   { "AMOXOR.D", FMT_AMO,    0x2f, 3, 0x10, AMO,       ALU_ADD, I_AMOXOR_D },
+   { "AMOAND.D", FMT_AMO,    0x2f, 3, 0x30, AMO,       ALU_ADD, I_AMOAND_D },
+   { "AMOOR.D",  FMT_AMO,    0x2f, 3, 0x20, AMO,       ALU_ADD, I_AMOOR_D },
+   { "AMOMIN.D", FMT_AMO,    0x2f, 3, 0x40, AMO,       ALU_ADD, I_AMOMIN_D },
+   { "AMOMAX.D", FMT_AMO,    0x2f, 3, 0x50, AMO,       ALU_ADD, I_AMOMAX_D },
+   { "AMOMINU.D",FMT_AMO,    0x2f, 3, 0x60, AMO,       ALU_ADD, I_AMOMINU_D },
+   { "AMOMAXU.D",FMT_AMO,    0x2f, 3, 0x70, AMO,       ALU_ADD, I_AMOMAXU_D },
+   { "NOT-IMPLEMENTED", FMT_NONE, 0, 0, 0, UNIMPL,  ALU_ADD, I_INVALID },
+};
+
+// Which bits of funct7 are part of the encoding for each format
+constexpr uint8_t funct7_mask(InstFormats format) {
+   switch (format) {
+      case FMT_R:      return 0x7f;
+      case FMT_SHIFT:  return 0x7e;
+      case FMT_SHIFTW: return 0x7f;
+      case FMT_SYSTEM: return 0x7f;
+      case FMT_AMO:    return 0x7c;
+      default:         return 0;
+   }
+}
+
+constexpr bool has_funct3(InstFormats format) {
+   return format != FMT_U && format != FMT_J && format != FMT_NONE;
+}
+
+// Does inst encode this entry? A FMT_SYSTEM instruction is the whole word:
+// EBREAK only differs from ECALL in its immediate, and neither has registers.
+constexpr bool isa_matches(const IsaEntry &entry, uint32_t inst) {
+   return entry.format != FMT_NONE &&
+          (inst & 0x7f) == entry.opcode &&
+          (!has_funct3(entry.format) || ((inst >> 12) & 7) == entry.funct3) &&
+          ((inst >> 25) & funct7_mask(entry.format)) == entry.funct7 &&
+          (entry.format != FMT_SYSTEM || (inst >> 7) == 0);
+}
+
+// The decode table is indexed by inst[6:2], funct3, and the funct7 bits
+// that tell instructions apart: inst[30] (SUB, SRA), inst[25] (M), and the
+// rest of the AMO funct5, inst[29:27] and inst[31].
+const int DECODE_INDEX_BITS = 14;
+
+constexpr uint32_t decode_index(uint32_t inst) {
+   return ((inst >> 2) & 0x1f) | ((inst >> 7) & 0xe0) |
+          ((inst >> 22) & 0x100) | ((inst >> 16) & 0x200) |
+          ((inst >> 17) & 0x1c00) | ((inst >> 18) & 0x2000);
+}
+
+struct DecodeTable {
+   InstKinds kind[1 << DECODE_INDEX_BITS];
+   int conflicts;   // Indexes that more than one entry could have come from
+};
+
+// Fill in the decode table from ISA. Every index gets the one entry that an
+// instruction with those bits could be, or I_INVALID. The other funct7 bits
+// still have to be checked with isa_matches().
+constexpr DecodeTable make_decode_table() {
+   DecodeTable table = {};
+   for (uint32_t index = 0; index < (1 << DECODE_INDEX_BITS); index++) {
+      table.kind[index] = I_INVALID;
+   }
+   for (int k = 0; k < NUM_INST_KINDS; k++) {
+      const IsaEntry &entry = ISA[k];
+      if (entry.format == FMT_NONE) {
+         continue;
+      }
+      // Only the indexes with the entry's inst[6:2] can be it
+      for (uint32_t high = 0; high < (1 << (DECODE_INDEX_BITS - 5)); high++) {
+         uint32_t index = ((entry.opcode >> 2) & 0x1f) | (high << 5);
+         uint32_t inst = 3 | ((index & 0x1f) << 2) | (((index >> 5) & 7) << 12) |
+                         (((index >> 8) & 1) << 30) | (((index >> 9) & 1) << 25) |
+                         (((index >> 10) & 7) << 27) | (((index >> 13) & 1) << 31);
+         uint8_t mask = funct7_mask(entry.format) & 0x7d;
+         bool match = (inst & 0x7f) == entry.opcode &&
+                      (!has_funct3(entry.format) || ((inst >> 12) & 7) == entry.funct3) &&
+                      ((inst >> 25) & mask) == (entry.funct7 & mask);
+         if (match) {
+            if (table.kind[index] != I_INVALID) {
+               table.conflicts++;
+            }
+            table.kind[index] = entry.kind;
+         }
+      }
+   }
+   return table;
+}
+
+constexpr DecodeTable DECODE_TABLE = make_decode_table();
+
+// Is every entry in InstKinds order, a 32-bit opcode, and reachable?
+constexpr bool isa_is_consistent() {
+   bool found[NUM_INST_KINDS] = {};
+   for (int index = 0; index < (1 << DECODE_INDEX_BITS); index++) {
+      found[DECODE_TABLE.kind[index]] = true;
+   }
+   for (int k = 0; k < NUM_INST_KINDS; k++) {
+      const IsaEntry &entry = ISA[k];
+      if (entry.kind != k) {
+         return false;
+      }
+      if (entry.format == FMT_NONE) {
+         continue;
+      }
+      if ((entry.opcode & 3) != 3 || (entry.funct7 & ~funct7_mask(entry.format)) != 0) {
+         return false;
+      }
+      if (!found[k]) {
+         return false;
+      }
+   }
+   return true;
+}
+
+// Decode an instruction word using only the tables, for the checks below
+constexpr InstKinds table_kind(uint32_t inst) {
+   return isa_matches(ISA[DECODE_TABLE.kind[decode_index(inst)]], inst)
+          ? DECODE_TABLE.kind[decode_index(inst)] : I_INVALID;
+}
+
+static_assert(isa_is_consistent(), "ISA entries must be in InstKinds order and decodable");
+static_assert(DECODE_TABLE.conflicts == 0, "two ISA entries share a decode table index");
+static_assert(table_kind(0x00000013) == I_ADDI, "addi x0, x0, 0");
+static_assert(table_kind(0x40b50533) == I_SUB, "sub a0, a0, a1");
+static_assert(table_kind(0x02b50533) == I_MUL, "mul a0, a0, a1");
+static_assert(table_kind(0x43f55513) == I_SRAI, "srai a0, a0, 63");
+static_assert(table_kind(0x4015551b) == I_SRAIW, "sraiw a0, a0, 1");
+static_assert(table_kind(0x0000006f) == I_JAL, "jal x0, 0");
+static_assert(table_kind(0x00000073) == I_ECALL, "ecall");
+static_assert(table_kind(0x00100073) == I_INVALID, "ebreak is not an ecall");
+static_assert(table_kind(0x00050073) == I_INVALID, "ecall with rs1 = a0");
+static_assert(table_kind(0x00000573) == I_INVALID, "ecall with rd = a0");
+static_assert(table_kind(0x18059573) == I_CSRRW, "csrrw a0, satp, a1");
+static_assert(table_kind(0x18006573) == I_CSRRSI, "csrrsi a0, satp, 0");
+static_assert(table_kind(0x12000073) == I_SFENCE_VMA, "sfence.vma");
+static_assert(table_kind(0x0000100f) == I_FENCE_I, "fence.i");
+static_assert(table_kind(0x0ff0000f) == I_FENCE, "fence");
+static_assert(table_kind(0x1005252f) == I_LR_W, "lr.w a0, (a0)");
+static_assert(table_kind(0x1ab5352f) == I_SC_D, "sc.d.aqrl a0, a1, (a0)");
+static_assert(table_kind(0x00b5352f) == I_AMOADD_D, "amoadd.d a0, a1, (a0)");
+static_assert(table_kind(0xe4b5252f) == I_AMOMAXU_W, "amomaxu.w.aq a0, a1, (a0)");
+static_assert(table_kind(0x08b5352f) == I_AMOSWAP_D, "amoswap.d a0, a1, (a0)");
+static_assert(table_kind(0x06b50533) == I_INVALID, "funct7 0x03 is not an instruction");
+static_assert(table_kind(0x00000000) == I_INVALID, "all zeros is not an instruction");
+
+// The decoded form of one instruction. The immediate is already sign extended and
+// the ALU command is already picked, but no register values are stored here:
+// execute() reads rs1/rs2 itself. That way a DecodeOut can be cached by PC.
 struct DecodeOut {
+   int64_t imm;       // Sign-extended immediate (the offset for BRANCH, STORE and JAL)
    OpcodeCategories op;
    uint8_t rd;
+   uint8_t rs1;
+   uint8_t rs2;
    uint8_t funct3;
    uint8_t funct7;
-   int64_t offset;    // Offsets for BRANCH and STORE
-   int64_t left_val;  // typically the value of rs1
-   int64_t right_val; // typically the value of rs2 or immediate
+   AluCommands cmd;   // ALU command resolved from op, funct3 and funct7
+   InstKinds kind;    // The concrete instruction (ADDI, LW, BNE, ...)
 
    friend ostream &operator<<(ostream &out, const DecodeOut &dec) {
        ostringstream sout;
-        sout << "Operation: ";
-        switch (dec.op) {
-            case LUI:
-                sout << "LUI";
-                break;
-            case AUIPC:
-                sout << "AUIPC";
-                break;
-            case LOAD:
-                sout << "LOAD";
-                break;
-            case STORE:
-                sout << "STORE";
-                break;
-            case OP_IMM:
-                sout << "OPIMM";
-                break;
-            case OP_IMM_32:
-                sout << "OPIMM32";
-                break;
-            case OP:
-                sout << "OP";
-                break;
-            case OP_32:
-                sout << "OP32";
-                break;
-            case BRANCH:
-                sout << "BRANCH";
-                break;
-            case JALR:
-                sout << "JALR";
-                break;
-            case JAL:
-                sout << "JAL";
-                break;
-            case SYSTEM:
-                sout << "SYSTEM";
-                break;
-            case UNIMPL:
-                sout << "NOT-IMPLEMENTED";
-                break;
-        }
+        sout << "Operation: " << ISA[dec.kind].name;
         sout << '\n';
         sout << "RD       : " << (uint32_t)dec.rd << '\n';
+        sout << "RS1      : " << (uint32_t)dec.rs1 << '\n';
+        sout << "RS2      : " << (uint32_t)dec.rs2 << '\n';
         sout << "funct3   : " << (uint32_t)dec.funct3 << '\n';
         sout << "funct7   : " << (uint32_t)dec.funct7 << '\n';
-        sout << "offset   : " << dec.offset << '\n';
-        sout << "left     : " << dec.left_val << '\n';
-        sout << "right    : " << dec.right_val;
+        sout << "ALU cmd  : " << (uint32_t)dec.cmd << '\n';
+        sout << "imm      : " << dec.imm;
         return out << sout.str();
    }
 };
 
-//List of ALU commands
-enum AluCommands {
-   ALU_ADD,
-   ALU_SUB,
-   ALU_MUL,
-   ALU_DIV,
-   ALU_REM,
-   ALU_SLL,
-   ALU_SRL,
-   ALU_SRA,
-   ALU_AND,
-   ALU_OR,
-   ALU_XOR,
-   ALU_NOT
-};
-
 struct ExecuteOut {
     int64_t result;
-    uint8_t n, z, c, v;
+    uint8_t n, z, c, v; // Only filled in by Machine::debug_execute_out()
+    uint8_t taken;      // For a BRANCH: is the branch taken?
+    int64_t store_val;  // The value of rs2 for a STORE, read by execute()
 
 
     friend ostream &operator<<(ostream &out, const ExecuteOut &eo) {
@@ -157,6 +421,28 @@ struct ExecuteOut {
     }
 };
 
+// RISC-V division never traps: dividing by zero gives -1 (the remainder is the
+// dividend), and the one overflowing case, INT64_MIN / -1, gives INT64_MIN.
+int64_t div64(int64_t left, int64_t right) {
+    if (right == 0) {
+        return -1;
+    }
+    if (right == -1) {
+        return static_cast<int64_t>(0 - static_cast<uint64_t>(left));
+    }
+    return left / right;
+}
+
+int64_t rem64(int64_t left, int64_t right) {
+    if (right == 0) {
+        return left;
+    }
+    if (right == -1) {
+        return 0;
+    }
+    return left % right;
+}
+
 //The ALU Commands taking a left and right value and producing a result
 ExecuteOut alu(AluCommands cmd, int64_t left, int64_t right) {
     ExecuteOut ret;
@@ -171,10 +457,10 @@ ExecuteOut alu(AluCommands cmd, int64_t left, int64_t right) {
             ret.result = left * right;
         break;
         case ALU_DIV:
-            ret.result = left / right;
+            ret.result = div64(left, right);
         break;
         case ALU_REM:
-            ret.result = left % right;
+            ret.result = rem64(left, right);
         break;
         case ALU_SLL:
              ret.result = left << right;
@@ -199,18 +485,51 @@ ExecuteOut alu(AluCommands cmd, int64_t left, int64_t right) {
         break;
     }
 
-    // Now that we have the result, determine the flags.
-    uint8_t sign_left = (left >> 63) & 1;
-    uint8_t sign_right = (right >> 63) & 1;
-    uint8_t sign_result = (ret.result >> 63) & 1;
-    ret.z = !ret.result;
-    ret.n = sign_result;
-    ret.v = (~sign_left & ~sign_right & sign_result) |
-             (sign_left & sign_right & ~sign_result);
-    ret.c = (ret.result > left) || (ret.result > right);
     return ret;
 }
 
+// The NZCV flags of an ALU operation. Nothing in the machine needs them (a
+// branch compares its registers directly, see branch_taken()), so alu()
+// leaves them out and only debug_execute_out() works them out.
+// C is the carry out of an ADD, and for a SUB it is "no borrow", that is
+// left >= right unsigned.
+void alu_flags(ExecuteOut &eo, AluCommands cmd, int64_t left, int64_t right) {
+    uint64_t uleft = left;
+    uint64_t uright = right;
+    uint64_t uresult = eo.result;
+    eo.z = (eo.result == 0);
+    eo.n = (uresult >> 63) & 1;
+    eo.c = 0;
+    eo.v = 0;
+    if (cmd == ALU_ADD) {
+        eo.c = uresult < uleft;
+        eo.v = ((~(uleft ^ uright) & (uleft ^ uresult)) >> 63) & 1;
+    }
+    else if (cmd == ALU_SUB) {
+        eo.c = uleft >= uright;
+        eo.v = (((uleft ^ uright) & (uleft ^ uresult)) >> 63) & 1;
+    }
+}
+
+// Does a branch with this funct3 go to its target?
+bool branch_taken(uint8_t funct3, int64_t left, int64_t right) {
+    switch (funct3) {
+        case 0b000: //BEQ
+            return left == right;
+        case 0b001: //BNE
+            return left != right;
+        case 0b100: //BLT
+            return left < right;
+        case 0b101: //BGE
+            return left >= right;
+        case 0b110: //BLTU
+            return static_cast<uint64_t>(left) < static_cast<uint64_t>(right);
+        case 0b111: //BGEU
+            return static_cast<uint64_t>(left) >= static_cast<uint64_t>(right);
+    }
+    return false;
+}
+
 //memory struct
 struct MemoryOut {
     int64_t value;
@@ -223,326 +542,6098 @@ struct MemoryOut {
 };
 
 
-const int MEM_SIZE = 1 << 18;
-const int NUM_REGS = 32;
-class Machine {
-   char *mMemory;   // The memory.
-   int mMemorySize; // The size of the memory (should be MEM_SIZE)
-   int64_t mPC;     // The program counter
-   int64_t mRegs[NUM_REGS]; // The register file
-   
+// One translated instruction in a Block: the run_fast() handler to jump to
+// and the decoded instruction it works on.
+struct BlockInst {
+    const void *handler;
+    DecodeOut dec;
+    uint8_t fusion;      // A FusionKinds if this starts a fused pair
+};
 
-   FetchOut mFO;    // Result of the fetch method.
+// Pairs of instructions that compilers emit together all the time. When a
+// block is translated these are found and run as one operation, leaving the
+// registers exactly as the two instructions would.
+enum FusionKinds : uint8_t {
+   FUSE_NONE,
+   FUSE_LI,          // LUI + ADDI/ADDIW of the same register (li)
+   FUSE_LA,          // AUIPC + ADDI of the same register (la)
+   FUSE_LOAD_GLOBAL, // AUIPC + LD through that register
+   FUSE_CALL,        // AUIPC + JALR through that register (call, tail)
+   FUSE_SUB_BRANCH,  // SUB + a branch that reads its result
+   FUSE_ADDI_BRANCH, // ADDI + a branch that reads its result (loop counters)
+   NUM_FUSIONS
+};
 
-   DecodeOut mDO;   // Result of the decode method.
+const char *const FUSION_NAMES[NUM_FUSIONS] = {
+   "none", "lui+addi", "auipc+addi", "auipc+ld", "auipc+jalr", "sub+branch", "addi+branch"
+};
 
-   ExecuteOut mEO;  // Result of the Execute method.
+const int NUM_BRANCH_KINDS = I_BGEU - I_BEQ + 1;
 
-   MemoryOut mMO;   // Result of the Memory method.
+// run_fast() has a handler for every InstKinds, followed by these
+enum ExtraHandlers {
+   H_FALLTHROUGH = NUM_INST_KINDS, // The end of a block that was cut short
+   H_FUSED_CONST,                  // FUSE_LI and FUSE_LA
+   H_FUSED_LOAD_GLOBAL,
+   H_FUSED_CALL,
+   H_SUB_BRANCH,                   // One for each branch kind, BEQ first
+   H_ADDI_BRANCH = H_SUB_BRANCH + NUM_BRANCH_KINDS,
+   NUM_HANDLERS = H_ADDI_BRANCH + NUM_BRANCH_KINDS
+};
 
-   // Read from the internal memory
-   // Usage:
-   // int myintval = memory_read<int>(0); // Read the first 4 bytes
-   // char mycharval = memory_read<char>(8); // Read byte index 8
-   template<typename T>
-   T memory_read(int64_t address) const {
-       return *reinterpret_cast<T*>(mMemory + address);
-   }
+// A basic block for the fast execution mode: a straight run of instructions
+// that ends at a BRANCH, JAL, JALR or ECALL. It is translated once, and its
+// successors are linked in the first time each exit is taken, so that moving
+// from one block to the next is a pointer load.
+struct Block {
+    int64_t pc;              // Guest PC of the first instruction
+    int64_t next_pc;         // Guest PC just after the last instruction
+    vector<BlockInst> insts; // The translated instructions, the exit is last
+    Block *taken;            // Successor when the exit branch or jump is taken
+    int64_t taken_pc;        // PC of taken (the last target for a JALR)
+    Block *fallthrough;      // Successor at next_pc
+    vector<Block *> callers; // Blocks whose taken or fallthrough is this one
+    uint8_t *native;         // x86-64 code for the block (JIT mode only)
+    vector<uint8_t *> stubs; // Exit stubs of compiled code chained to it
+    uint64_t runs;           // Times run_fast() went into it, and took the
+    uint64_t taken_runs;     // exit branch, since Machine::fold_stats()
+};
 
-   // Write to the internal memory
-   // Usage:
-   // memory_write<int>(0, 0xdeadbeef); // Set bytes 0, 1, 2, 3 to 0xdeadbeef
-   // memory_write<char>(8, 0xff);      // Set byte index 8 to 0xff
-   template<typename T>
-   void memory_write(int64_t address, T value) {
-       *reinterpret_cast<T*>(mMemory + address) = value;
-   }
+// A block ends at any instruction that can change the PC, and at anything the
+// machine can't run.
+bool is_block_exit(const DecodeOut &dec) {
+    return dec.op == BRANCH || dec.op == JAL || dec.op == JALR ||
+           dec.op == SYSTEM || dec.kind == I_FENCE_I || dec.kind == I_INVALID;
+}
 
-    //All of the decoders, using the table provided, the types are broken down
-    //into rd, funct3, funct7, rs1, rs2, and the immediate
-    void decode_r() {
-    mDO.rd        = (mFO.instruction >> 7) & 0x1f;
-    mDO.funct3    = (mFO.instruction >> 12) & 7;
-    mDO.left_val  = get_xreg(mFO.instruction >> 15); // get_xreg truncates for us
-    mDO.right_val = get_xreg(mFO.instruction >> 20);
-    mDO.funct7    = (mFO.instruction >> 25) & 0x7f;
-    }
+// Guest memory is handed out in pages of this size
+const int GUEST_PAGE_SHIFT = 12;
+const uint64_t GUEST_PAGE_SIZE = 1 << GUEST_PAGE_SHIFT;
+const uint64_t GUEST_PAGE_OFFSET = GUEST_PAGE_SIZE - 1;
+// Each leaf of the page table covers this many pages (4 MiB)
+const int LEAF_SHIFT = 10;
+// The CSRs the machine has: satp, and the read-only mhartid
+const int CSR_SATP = 0x180;
+const int CSR_MHARTID = 0xf14;
 
-    void decode_i() {
-    mDO.rd        = (mFO.instruction >> 7) & 0x1f;
-    mDO.funct3    = (mFO.instruction >> 12) & 7;
-    mDO.left_val  = get_xreg(mFO.instruction >> 15); // get_xreg truncates for us
-    mDO.right_val = sign_extend(((mFO.instruction >> 20) & 0xfff), 11);
-    }
+// Entries in each of GuestMemory's page caches (must be a power of two)
+const int PAGE_CACHE_SIZE = 64;
+// Entries in the ASID tagged TLB behind them (must be a power of two)
+const int TLB_SIZE = 256;
+// The RAM window (PhysicalMemory::open_window()) holds guest physical addresses
+// below 1 << RAM_WINDOW_SHIFT, which covers the ELF stack, with guard zones
+// of RAM_WINDOW_GUARD bytes on either side
+const int RAM_WINDOW_SHIFT = 39;
+const uint64_t RAM_WINDOW_SIZE = 1UL << RAM_WINDOW_SHIFT;
+const uint64_t RAM_WINDOW_GUARD = 1 << 16;
 
-    void decode_s() {
-    mDO.rd        = 0;
-    mDO.funct3    = (mFO.instruction >> 12) & 7;
-    mDO.left_val    = get_xreg(mFO.instruction >> 15); // get_xreg truncates for us, left_val is rs1 
-    mDO.offset   = get_xreg(mFO.instruction >> 20);  //this is rs2, named offset for ease
-    mDO.right_val  = sign_extend((((mFO.instruction >> 25) & 0x7f) << 5) |  //This is the actual offset
-                                (((mFO.instruction >> 7) & 0x1f) << 0), 11); //This is so that in execute, rs2 and offset can be added with ease
-    }
+// The satp CSR: MODE in bits 63:60, ASID in 59:44 and the root page table's
+// physical page number in 43:0. Only Bare (0) and Sv39 (8) are supported.
+const int SATP_MODE_SHIFT = 60;
+const int SATP_ASID_SHIFT = 44;
+const uint64_t SATP_PPN_MASK = (1UL << 44) - 1;
+const uint64_t SATP_SV39 = 8;
+// Sv39 page table entry bits
+enum PteBits : uint8_t {
+   PTE_V = 1, PTE_R = 2, PTE_W = 4, PTE_X = 8, PTE_U = 16, PTE_G = 32, PTE_A = 64, PTE_D = 128
+};
 
-    
-    void decode_b() {
-    mDO.rd        = 0;
-    mDO.funct3    = (mFO.instruction >> 12) & 7;
-    mDO.left_val  = get_xreg(mFO.instruction >> 15); // get_xreg truncates for us
-    mDO.right_val = get_xreg(mFO.instruction >> 20);
-    mDO.offset    = sign_extend((((mFO.instruction >> 31) & 1) << 12) |
-                                (((mFO.instruction >> 25) & 0x3f) << 5) |
-                                (((mFO.instruction >> 8) & 0xf) << 1) | 
-                                (((mFO.instruction >> 7) & 1) << 11), 12);
-    }
+enum PagePerms : uint8_t { PERM_R = 1, PERM_W = 2, PERM_X = 4 };
 
-    void decode_u() {
-    mDO.rd           = (mFO.instruction >> 7) & 0x1f;
-    mDO.right_val    = sign_extend((((mFO.instruction >> 12) & 0xfffff) << 12), 31);
+enum AccessKinds : uint8_t { ACCESS_READ, ACCESS_WRITE, ACCESS_EXEC, NUM_ACCESS_KINDS };
+// The permission each kind of access needs
+const uint8_t ACCESS_PERMS[NUM_ACCESS_KINDS] = { PERM_R, PERM_W, PERM_X };
+// And the PTE bit it needs under Sv39
+const uint8_t ACCESS_PTE_BITS[NUM_ACCESS_KINDS] = { PTE_R, PTE_W, PTE_X };
+const char *const ACCESS_NAMES[NUM_ACCESS_KINDS] = { "Load", "Store", "Fetch" };
+
+// Thrown by GuestMemory when the guest touches an address it may not. page
+// is true for a page fault (Sv39 said no), false for an access fault (the
+// physical address isn't mapped with that permission).
+struct GuestFault {
+    uint64_t address;
+    AccessKinds access;
+    bool page;
+};
+
+// One entry of a page cache: the guest virtual address of a page, and what
+// to add to a guest address in that page to get the host address.
+struct PageCacheEntry {
+    uint64_t tag;
+    uint64_t addend;
+};
+
+// One Sv39 translation of a 4 KiB page. A superpage is entered one 4 KiB
+// page at a time; level says how big the page it came from was.
+struct TlbEntry {
+    uint64_t vpn;     // Virtual page number (address >> 12, 27 bits)
+    uint64_t ppn;     // Physical page number
+    uint16_t asid;
+    uint8_t flags;    // PteBits of the leaf PTE, 0 if the entry is empty
+    uint8_t level;    // 0 for 4 KiB, 1 for 2 MiB, 2 for 1 GiB
+};
+
+// Every page that is mapped but hasn't been written reads from here
+const char ZERO_PAGE[GUEST_PAGE_SIZE] = {};
+
+// Host memory for guest pages that outlives the machines using it. A batch
+// worker runs one guest after another; each takes its pages from here and
+// gives them back when it is destroyed, so the worker stops going to the
+// host allocator once it has warmed up. Not thread-safe: a worker has its
+// own, and the PhysicalMemory using it only calls it under its lock.
+class PageArena {
+    vector<char *> mFree;
+
+public:
+    PageArena() = default;
+    ~PageArena() {
+        for (char *page : mFree) {
+            delete[] page;
+        }
     }
+    PageArena(const PageArena &) = delete;
+    PageArena &operator=(const PageArena &) = delete;
 
-    void decode_j() {
-    mDO.rd        = (mFO.instruction >> 7) & 0x1f; 
-    mDO.right_val    = sign_extend((((mFO.instruction >> 31) & 1) << 20) |
-                                (((mFO.instruction >> 21) & 0x3ff) << 1) |
-                                (((mFO.instruction >> 20) & 1) << 11) |
-                                (((mFO.instruction >> 12) & 0xff) << 12), 20);
+    // A zeroed page
+    char *take() {
+        if (mFree.empty()) {
+            return new char[GUEST_PAGE_SIZE]();
+        }
+        char *page = mFree.back();
+        mFree.pop_back();
+        memset(page, 0, GUEST_PAGE_SIZE);
+        return page;
     }
-    
+    void give(char *page) {
+        mFree.push_back(page);
+    }
+};
 
-public:
-   Machine(char *mem, int size) {
-      mMemory = mem;
-      mMemorySize = size;
-      set_pc(0);
-      set_xreg(2, mMemorySize);
-      set_xreg(0, 0);
-   }
+// Most harts a machine can have (one bit each in GuestPage::code)
+const int MAX_HARTS = 64;
 
-   int64_t get_pc() const {
-      return mPC;
-   }
-   void set_pc(int64_t to) {
-      mPC = to;
-   }
+struct GuestPage {
+    char *host;      // ZERO_PAGE (or the file) until the first write
+    uint8_t perms;   // PagePerms, 0 if the page isn't mapped
+    bool owned;      // host was allocated for this page
+    bool dirty;      // Written since the snapshot
+    bool logged;     // Written since the last checkpoint
+    uint64_t code;   // Bit h: hart h decoded instructions from this page
+    char *saved;     // What it held at the snapshot (ZERO_PAGE for zeros),
+                     // or nullptr if it hasn't been written since
+};
 
-    //truncates the value for us
-   int64_t get_xreg(int which) const {
-      which &= 0x1f; // Make sure the register number is 0 - 31
-      return mRegs[which];
-   }
-   void set_xreg(int which, int64_t value) {
-      which &= 0x1f;
-      mRegs[which] = value;
-   }
-    
-   void fetch() {
-      //read 4 bytes at a time
-    mFO.instruction = memory_read<uint32_t>(mPC);
-   }
-   FetchOut &debug_fetch_out() { 
-      return mFO; 
-   }
+// A range of guest memory as a checkpoint file records it
+struct CheckpointRegion {
+    uint64_t base;
+    uint64_t size;
+    uint64_t perms;
+};
 
-    void decode() {
-    uint8_t opcode_map_row = (mFO.instruction >> 5) & 3;
-    uint8_t opcode_map_col = (mFO.instruction >> 2) & 7;
-    uint8_t inst_size      = mFO.instruction & 3;
-    if (inst_size != 3) {
-        cerr << "[DECODE] Invalid instruction (not a 32-bit instruction).\n";
-        return;
+// The guest's physical memory, shared by the GuestMemory of every hart.
+// Address ranges are mapped with map(), and a page only gets host memory
+// the first time the guest writes to it. map_file() backs a range with a
+// private mapping of a file instead, so its pages come straight from the
+// host's page cache. Pages live in a two-level table: a hash of leaves by
+// address >> 22, each holding 1024 pages.
+//
+// open_window() reserves one big PROT_NONE host region, the RAM window, and
+// from then on every readable range that map() or map_file() is given below
+// RAM_WINDOW_SIZE is mapped at the same offset in it, so the JIT can reach
+// guest physical address a at window + a with no lookup at all. The host
+// protection of each window page is what compiled code may do there:
+// read-only if the guest can't write it or code was decoded from it, and
+// PROT_NONE if nothing is mapped. A compiled access that breaks those rules
+// (or runs off the end into a guard zone) takes a SIGSEGV, and the JIT's
+// handler resumes at that instruction's exit to the interpreter, which
+// redoes the access through GuestMemory.
+//
+// The window is a mapping of a memfd, which is mapped a second time, all
+// of it writable, as the alias. Window pages point into the alias, so the
+// host reads and writes them without ever changing a window protection,
+// and a hart's stores can't race another hart's protect(). Window pages of
+// map_file() and map_checkpoint() start out as private mappings of the file
+// instead, which the alias can't see. They point into the window and stay
+// read-only there until the first host write, which copies the page into
+// the memfd and maps that in its place (see unprotect()).
+//
+// Harts on other threads look pages up at the same time, so the table is
+// behind mLock. Nothing is unmapped while they run, so a GuestPage pointer
+// stays good once the lock is dropped.
+//
+// snapshot() makes the memory as it is the state restore() goes back to.
+// Every host write to guest memory goes through unprotect() first, so
+// that is where the first write to a page after the snapshot is noticed:
+// the page's contents are saved then, and it goes on the dirty list.
+// restore() copies back only the pages on that list. The saved copies stay
+// for the next time, so a guest that keeps writing the same pages costs
+// one copy per page per restore. Window pages are read-only until their
+// first write, so compiled stores fault into the interpreter for that.
+//
+// Checkpoints (see Machine::save_checkpoint()) log writes the same way,
+// without the copies: checkpoint_pages() says which pages the next
+// checkpoint needs, and start_log() begins the next interval.
+// map_checkpoint() makes pages of a checkpoint file the initial contents
+// of their guest pages, so they are read only when the guest uses them.
+class PhysicalMemory {
+    struct Leaf {
+        GuestPage pages[1 << LEAF_SHIFT];
+    };
+    struct Region {
+        uint64_t base;
+        uint64_t size;
+        uint8_t perms;
+        char *backing;   // What the pages start out as, or nullptr for zeros
+        bool file;       // backing is a mapping of a file
+    };
+
+    vector<Region> mRegions;
+    vector<pair<void *, size_t>> mFiles; // map_file() mappings, to munmap
+    unordered_map<uint64_t, Leaf *> mLeaves;
+    uint64_t mAllocated;          // Pages with host memory of their own
+    char *mWindow;                // The RAM window, or nullptr
+    char *mAlias;                 // The writable mapping of it
+    int mWindowFd;                // The memfd behind both
+    bool mShared;                 // More than one hart uses this memory
+    PageArena *mArena;            // Where owned pages come from, or nullptr
+    bool mTracking;               // There is a snapshot to restore
+    vector<GuestPage *> mDirty;   // Pages written since then
+    bool mLogging;                // Writes are logged for a checkpoint
+    vector<uint64_t> mLogged;     // Pages written since the last one
+    unordered_map<uint64_t, char *> mImage; // Pages map_checkpoint() gave contents
+    mutex mLock;                  // For mLeaves and the pages in it
+    mutex mProtectLock;           // For window protections
+
+    // Host memory for a page of its own, zeroed, and back again
+    char *new_page() {
+        mAllocated++;
+        return mArena ? mArena->take() : new char[GUEST_PAGE_SIZE]();
+    }
+    void free_page(char *host) {
+        mAllocated--;
+        if (mArena) {
+            mArena->give(host);
+        }
+        else {
+            delete[] host;
+        }
     }
 
-    mDO.op = OPCODE_MAP[opcode_map_row][opcode_map_col];
-    // Decode the rest of mDO based on the instruction type
-    switch (mDO.op) {
-    case LOAD:
-    case JALR:
-    case OP_IMM:
-    case OP_IMM_32:
-    case SYSTEM:
-        decode_i();
-    break;
-    case STORE:
-        decode_s();
-    break;
-    case BRANCH:
-        decode_b();
-    break;
-    case JAL:
-        decode_j();
-    break;
-    case AUIPC:
-    case LUI:
-        decode_u();
-    break;
-    case OP:
-    case OP_32:
-        decode_r();
-    break;
-    default:
-        cerr << "Invalid op type: " << mDO.op << '\n';
-    break;
+    // The region address is in (the last map() wins), or nullptr
+    const Region *find_region(uint64_t address) const {
+        for (size_t i = mRegions.size(); i-- > 0; ) {
+            if (address - mRegions[i].base < mRegions[i].size) {
+                return &mRegions[i];
+            }
         }
+        return nullptr;
     }
 
-    DecodeOut &debug_decode_out() { 
-      return mDO; 
-   }
+    // Forget the snapshot: every saved copy goes
+    void drop_snapshot() {
+        for (auto &entry : mLeaves) {
+            for (GuestPage &page : entry.second->pages) {
+                if (page.saved != ZERO_PAGE) {
+                    delete[] page.saved;
+                }
+                page.saved = nullptr;
+                page.dirty = false;
+            }
+        }
+        mDirty.clear();
+        mTracking = false;
+    }
 
-    // telling the ALU what to do for each instruction
-   void execute() {
-   AluCommands cmd;
-   // Most instructions will follow left/right
-   // but some won't, so we need these:
-   int64_t op_left = mDO.left_val;
-   int64_t op_right = mDO.right_val; 
-   
-   if (mDO.op == BRANCH) {
-      // A branch needs to subtract the operands
-      cmd = ALU_SUB;
-   }
-   else if (mDO.op == LOAD || mDO.op == STORE) {
-      // For loads and stores, we need to add the
-      // offset with the base register.
-      cmd = ALU_ADD;
-   }
-   else if (mDO.op == OP || mDO.op == OP_32) {
-      // We can't tell which ALU command to use until
-      // we read the funct3 and funct7
-      if (mDO.op == OP_32) {
-            op_left = sign_extend(op_left, 31);
-            op_right = sign_extend(op_right, 31);
-      }
-      switch (mDO.funct3) {
-         case 0b000: // ADD or SUB
-             if (mDO.funct7 == 0) {
-                cmd = ALU_ADD;
-             }
-             else if (mDO.funct7 == 32) {
-                cmd = ALU_SUB;
-             }
-             //MUL
-             else if (mDO.funct7 == 1){
-                cmd = ALU_MUL;
-             }
-         break;
-         // Finish the rest of the OP functions here.
-         case 0b001:
-         //SLL
-            cmd = ALU_SLL;
-         break;
-
-         case 0b100:
-         //XOR
-            if (mDO.funct7 == 0){
-                cmd = ALU_XOR;
-            }
-         //DIV
-            else if (mDO.funct7 == 1){
-                cmd = ALU_DIV;
-            }
-         break;
-
-         case 0b101:
-         //SRL
-            if (mDO.funct7 == 0) {
-                cmd = ALU_SRL;
-            }
-         //SRA
-            else if (mDO.funct7 == 32) {
-                cmd = ALU_SRA;
-            }
-         break;
-
-         case 0b110:
-         //OR
-            if (mDO.funct7 == 0){
-                cmd = ALU_OR;
-            }
-         //REM
-            else if (mDO.funct7 == 1){
-                cmd = ALU_REM;
+    // Make every window page read-only, so that compiled code can't write
+    // to one without us seeing it. The hidden ranges have to stay hidden,
+    // which they do if the regions are done in order.
+    void protect_window() {
+        if (!mWindow) {
+            return;
+        }
+        lock_guard<mutex> hold(mProtectLock);
+        for (const Region &region : mRegions) {
+            if (region_in_window(region)) {
+                mprotect(region.backing, region.size, PROT_READ);
             }
-            break;
-        
-         case 0b111:
-         //AND
-            cmd = ALU_AND;
-            break; 
-      }
+            else {
+                hide_from_window(region.base, region.size);
+            }
+        }
+    }
+    bool region_in_window(const Region &region) const {
+        return mWindow && reinterpret_cast<uintptr_t>(region.backing) -
+                          reinterpret_cast<uintptr_t>(mWindow) < RAM_WINDOW_SIZE;
+    }
+
+    // Add a region. Pages in it that already have table entries are dropped,
+    // so they come back from the new region the next time they are used.
+    // There is no going back to a snapshot from before this, and the next
+    // checkpoint has to be a full one.
+    void add_region(const Region &region) {
+        lock_guard<mutex> hold(mLock);
+        drop_snapshot();
+        mLogging = false;
+        mRegions.push_back(region);
+        for (auto &entry : mLeaves) {
+            uint64_t first = entry.first << (LEAF_SHIFT + GUEST_PAGE_SHIFT);
+            for (int i = 0; i < (1 << LEAF_SHIFT); i++) {
+                uint64_t address = first + (static_cast<uint64_t>(i) << GUEST_PAGE_SHIFT);
+                GuestPage &page = entry.second->pages[i];
+                if (page.perms && address - region.base < region.size) {
+                    if (page.owned) {
+                        free_page(page.host);
+                    }
+                    page.perms = 0;
+                }
+            }
+        }
+    }
+
+    // What compiled code may do to a window page. Writes have to come to us
+    // if it is read_only.
+    static int window_prot(uint8_t perms, bool read_only) {
+        return ((perms & PERM_W) && !read_only) ? PROT_READ | PROT_WRITE : PROT_READ;
+    }
+    // Can [base, base + size) with these permissions live in the window?
+    bool fits_window(uint64_t base, uint64_t size, uint8_t perms) const {
+        return mWindow && (perms & PERM_R) && !(base & GUEST_PAGE_OFFSET) &&
+               size <= RAM_WINDOW_SIZE && base <= RAM_WINDOW_SIZE - size;
+    }
+    // A range that doesn't live in the window must not be reachable through
+    // it either, so whatever was mapped there before goes
+    void hide_from_window(uint64_t base, uint64_t size) {
+        if (!mWindow || base >= RAM_WINDOW_SIZE) {
+            return;
+        }
+        uint64_t first = base & ~GUEST_PAGE_OFFSET;
+        uint64_t end = min(RAM_WINDOW_SIZE, base + size < base ? RAM_WINDOW_SIZE : base + size);
+        mmap(mWindow + first, end - first, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        discard(first, end - first);
+    }
+    // Give the memfd's pages for [base, base + size) back to the host, so
+    // they read as zeros again
+    void discard(uint64_t base, uint64_t size) {
+        fallocate(mWindowFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, base, size);
+    }
+    // Is page's host memory in the alias (rather than a file mapping in the
+    // window)?
+    bool in_alias(const GuestPage *page) const {
+        return mWindow && reinterpret_cast<uintptr_t>(page->host) -
+                          reinterpret_cast<uintptr_t>(mAlias) < RAM_WINDOW_SIZE;
+    }
+    // Where a window page is in the window
+    char *window_address(const GuestPage *page) const {
+        return in_alias(page) ? mWindow + (page->host - mAlias) : page->host;
+    }
+
+public:
+    explicit PhysicalMemory(PageArena *arena = nullptr) {
+        mAllocated = 0;
+        mWindow = nullptr;
+        mAlias = nullptr;
+        mWindowFd = -1;
+        mShared = false;
+        mArena = arena;
+        mTracking = false;
+        mLogging = false;
+    }
+    ~PhysicalMemory() {
+        drop_snapshot();
+        for (auto &entry : mLeaves) {
+            for (GuestPage &page : entry.second->pages) {
+                if (page.perms && page.owned) {
+                    free_page(page.host);
+                }
+            }
+            delete entry.second;
+        }
+        for (auto &file : mFiles) {
+            munmap(file.first, file.second);
+        }
+        if (mWindow) {
+            munmap(mWindow - RAM_WINDOW_GUARD, RAM_WINDOW_SIZE + 2 * RAM_WINDOW_GUARD);
+            munmap(mAlias, RAM_WINDOW_SIZE);
+            close(mWindowFd);
+        }
+    }
+    PhysicalMemory(const PhysicalMemory &) = delete;
+    PhysicalMemory &operator=(const PhysicalMemory &) = delete;
+
+    // Reserve the RAM window and its alias. This has to come before
+    // anything is mapped. Returns false if the host won't reserve that much
+    // address space or has no memfd_create().
+    bool open_window() {
+        if (!mRegions.empty()) {
+            return false;
+        }
+        int fd = memfd_create("ram-window", MFD_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        void *mem = MAP_FAILED;
+        void *alias = MAP_FAILED;
+        if (ftruncate(fd, RAM_WINDOW_SIZE) == 0) {
+            mem = mmap(nullptr, RAM_WINDOW_SIZE + 2 * RAM_WINDOW_GUARD, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            alias = mmap(nullptr, RAM_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_NORESERVE, fd, 0);
+        }
+        if (mem == MAP_FAILED || alias == MAP_FAILED) {
+            if (mem != MAP_FAILED) {
+                munmap(mem, RAM_WINDOW_SIZE + 2 * RAM_WINDOW_GUARD);
+            }
+            if (alias != MAP_FAILED) {
+                munmap(alias, RAM_WINDOW_SIZE);
+            }
+            close(fd);
+            return false;
+        }
+        mWindow = static_cast<char *>(mem) + RAM_WINDOW_GUARD;
+        mAlias = static_cast<char *>(alias);
+        mWindowFd = fd;
+        return true;
+    }
+    char *window() const {
+        return mWindow;
+    }
+
+    // Another hart is going to use this memory from now on
+    void share() {
+        mShared = true;
+    }
+    bool shared() const {
+        return mShared;
+    }
+
+    // Give the guest access to [base, base + size), replacing whatever was
+    // mapped there. Nothing is allocated until the guest writes there (in
+    // the window, the host does the same for us).
+    void map(uint64_t base, uint64_t size, uint8_t perms) {
+        char *backing = nullptr;
+        if (fits_window(base, size, perms)) {
+            discard(base, size);
+            void *host = mmap(mWindow + base, size, window_prot(perms, false),
+                              MAP_SHARED | MAP_NORESERVE | MAP_FIXED, mWindowFd, base);
+            if (host != MAP_FAILED) {
+                backing = static_cast<char *>(host);
+            }
+        }
+        if (!backing) {
+            hide_from_window(base, size);
+        }
+        add_region({ base, size, perms, backing, false });
+    }
+
+    // Map size bytes of the file fd, starting at offset, at base (both must
+    // be page aligned). The host mapping is MAP_PRIVATE, so nothing is read
+    // until the guest touches a page, pages are shared with anything else
+    // that has the file mapped, and the host copies a page only when the
+    // guest writes to it. Past the end of the file the last page reads as
+    // zeros. Returns false if the host can't map the file.
+    bool map_file(uint64_t base, int fd, uint64_t offset, uint64_t size, uint8_t perms) {
+        if ((base & GUEST_PAGE_OFFSET) || size == 0) {
+            return false;
+        }
+        uint64_t pages = (size + GUEST_PAGE_OFFSET) & ~GUEST_PAGE_OFFSET;
+        if (fits_window(base, pages, perms)) {
+            // Read-only until unprotect() moves a page into the memfd
+            discard(base, pages);
+            void *host = mmap(mWindow + base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, offset);
+            if (host != MAP_FAILED) {
+                add_region({ base, pages, perms, static_cast<char *>(host), true });
+                return true;
+            }
+        }
+        void *host = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+        if (host == MAP_FAILED) {
+            return false;
+        }
+        hide_from_window(base, pages);
+        mFiles.push_back(make_pair(host, size));
+        add_region({ base, pages, perms, static_cast<char *>(host), true });
+        return true;
+    }
+
+    // The page that holds address, or nullptr if it isn't mapped. Pages get
+    // their table entry the first time they are looked at.
+    GuestPage *find_page(uint64_t address) {
+        lock_guard<mutex> hold(mLock);
+        return find_page_locked(address);
+    }
+    GuestPage *find_page_locked(uint64_t address) {
+        uint64_t number = address >> GUEST_PAGE_SHIFT;
+        auto found = mLeaves.find(number >> LEAF_SHIFT);
+        Leaf *leaf = (found == mLeaves.end()) ? nullptr : found->second;
+        if (leaf && leaf->pages[number & ((1 << LEAF_SHIFT) - 1)].perms) {
+            return &leaf->pages[number & ((1 << LEAF_SHIFT) - 1)];
+        }
+        const Region *region = find_region(address);
+        if (!region) {
+            return nullptr;
+        }
+        if (!leaf) {
+            leaf = new Leaf();
+            mLeaves[number >> LEAF_SHIFT] = leaf;
+        }
+        GuestPage *page = &leaf->pages[number & ((1 << LEAF_SHIFT) - 1)];
+        uint64_t base = address & ~GUEST_PAGE_OFFSET;
+        auto image = mImage.find(base);
+        if (image != mImage.end()) {
+            page->host = image->second;
+        }
+        else if (region->backing) {
+            page->host = region->backing + (base - region->base);
+            // Memory the window has from the memfd is written through the alias
+            if (region_in_window(*region) && !region->file) {
+                page->host = mAlias + (page->host - mWindow);
+            }
+        }
+        else {
+            page->host = const_cast<char *>(ZERO_PAGE);
+        }
+        page->perms = region->perms;
+        page->code = 0;
+        page->owned = false;
+        page->dirty = false;
+        page->logged = false;
+        page->saved = nullptr;
+        return page;
+    }
+
+    // The page for an access to a physical address, or a GuestFault if it
+    // isn't allowed
+    GuestPage *access_page(uint64_t address, AccessKinds access) {
+        GuestPage *page = find_page(address);
+        if (!page || !(page->perms & ACCESS_PERMS[access])) {
+            throw GuestFault{address, access, false};
+        }
+        return page;
+    }
+
+    // Has any hart decoded code from page?
+    static bool any_code(const GuestPage *page) {
+        return __atomic_load_n(&page->code, __ATOMIC_RELAXED) != 0;
+    }
+    bool in_window(const GuestPage *page) const {
+        return in_alias(page) || (mWindow && reinterpret_cast<uintptr_t>(page->host) -
+                                             reinterpret_cast<uintptr_t>(mWindow) < RAM_WINDOW_SIZE);
+    }
+    // Must compiled code leave writes to page to us? (A file page in the
+    // window has to come to unprotect() before anything writes it.)
+    bool read_only(const GuestPage *page) const {
+        return any_code(page) || (mTracking && !page->dirty) || (mLogging && !page->logged) ||
+               (in_window(page) && !in_alias(page));
+    }
+    // Give a window page the protection window_prot() says it should have
+    void protect(const GuestPage *page) {
+        if (in_window(page)) {
+            lock_guard<mutex> hold(mProtectLock);
+            mprotect(window_address(page), GUEST_PAGE_SIZE, window_prot(page->perms, read_only(page)));
+        }
+    }
+    // Get page's host memory (for guest physical page base) ready for the
+    // host to write to it: note the write for the snapshot and the
+    // checkpoint log, give the page memory of its own if it still reads
+    // from ZERO_PAGE, and move a file page in the window into the memfd.
+    // A window page that stops being read_only() is protected again, so
+    // compiled stores stop coming to us for it.
+    void unprotect(GuestPage *page, uint64_t base) {
+        bool changed = false;
+        if (in_window(page) && !in_alias(page)) {
+            lock_guard<mutex> hold(mProtectLock);
+            // Another hart may have got here first
+            if (!in_alias(page)) {
+                char *window = page->host;
+                char *alias = mAlias + (window - mWindow);
+                memcpy(alias, window, GUEST_PAGE_SIZE);
+                mmap(window, GUEST_PAGE_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED, mWindowFd, window - mWindow);
+                __atomic_store_n(&page->host, alias, __ATOMIC_RELEASE);
+                changed = true;
+            }
+        }
+        if (mTracking && !page->dirty) {
+            lock_guard<mutex> hold(mLock);
+            if (!page->dirty) {
+                if (!page->saved) {
+                    page->saved = const_cast<char *>(ZERO_PAGE);
+                    if (page->host != ZERO_PAGE) {
+                        page->saved = new char[GUEST_PAGE_SIZE];
+                        memcpy(page->saved, page->host, GUEST_PAGE_SIZE);
+                    }
+                }
+                page->dirty = true;
+                mDirty.push_back(page);
+                changed = true;
+            }
+        }
+        if (mLogging && !page->logged) {
+            lock_guard<mutex> hold(mLock);
+            if (!page->logged) {
+                page->logged = true;
+                mLogged.push_back(base);
+                changed = true;
+            }
+        }
+        if (page->host == ZERO_PAGE) {
+            lock_guard<mutex> hold(mLock);
+            // Another hart may have got here first
+            if (page->host == ZERO_PAGE) {
+                char *host = new_page();
+                page->owned = true;
+                __atomic_store_n(&page->host, host, __ATOMIC_RELEASE);
+            }
+        }
+        if (changed) {
+            protect(page);
+        }
+    }
+
+    // Write size bytes at address the way a loader does, whatever the page
+    // permissions are. data == nullptr writes zeros.
+    void load(uint64_t address, const char *data, uint64_t size) {
+        while (size > 0) {
+            GuestPage *page = find_page(address);
+            if (!page) {
+                throw GuestFault{address, ACCESS_WRITE, false};
+            }
+            uint64_t base = address & ~GUEST_PAGE_OFFSET;
+            uint64_t n = min(size, GUEST_PAGE_SIZE - (address - base));
+            unprotect(page, base);
+            if (data) {
+                memcpy(page->host + (address - base), data, n);
+                data += n;
+            }
+            else {
+                memset(page->host + (address - base), 0, n);
+            }
+            address += n;
+            size -= n;
+        }
+    }
+
+    // Make memory as it is now what restore() goes back to
+    void snapshot() {
+        lock_guard<mutex> hold(mLock);
+        drop_snapshot();
+        mTracking = true;
+        protect_window();
+    }
+
+    // Put every page written since snapshot() back the way it was. Returns
+    // false if there is no snapshot. code is set if any of the pages had
+    // code decoded from it.
+    bool restore(bool &code) {
+        lock_guard<mutex> hold(mLock);
+        code = false;
+        if (!mTracking) {
+            return false;
+        }
+        for (GuestPage *page : mDirty) {
+            memcpy(page->host, page->saved, GUEST_PAGE_SIZE);
+            page->dirty = false;
+            code = code || any_code(page);
+            protect(page);
+        }
+        mDirty.clear();
+        return true;
+    }
+
+    // How many pages were written since the snapshot
+    size_t dirty_pages() const {
+        return mDirty.size();
+    }
+
+    // Is every write since the last start_log() logged?
+    bool logging() const {
+        return mLogging;
+    }
+    // Forget the logged writes and log from now on
+    void start_log() {
+        lock_guard<mutex> hold(mLock);
+        for (uint64_t base : mLogged) {
+            GuestPage *page = find_page_locked(base);
+            if (page) {
+                page->logged = false;
+            }
+        }
+        mLogged.clear();
+        mLogging = true;
+        protect_window();
+    }
+
+    // The physical pages a checkpoint has to hold, in address order. For a
+    // full one that is every page that isn't all zeros: pages written
+    // through the table, all the pages of file mappings and checkpoints,
+    // and the window pages the host has memory for (compiled code may have
+    // written those without us seeing). Otherwise it is the logged ones.
+    vector<uint64_t> checkpoint_pages(bool full) {
+        lock_guard<mutex> hold(mLock);
+        vector<uint64_t> pages;
+        if (!full) {
+            pages = mLogged;
+        }
+        else {
+            for (auto &entry : mLeaves) {
+                uint64_t first = entry.first << (LEAF_SHIFT + GUEST_PAGE_SHIFT);
+                for (int i = 0; i < (1 << LEAF_SHIFT); i++) {
+                    const GuestPage &page = entry.second->pages[i];
+                    if (page.perms && page.host != ZERO_PAGE) {
+                        pages.push_back(first + (static_cast<uint64_t>(i) << GUEST_PAGE_SHIFT));
+                    }
+                }
+            }
+            for (auto &image : mImage) {
+                pages.push_back(image.first);
+            }
+            for (const Region &region : mRegions) {
+                if (!region.backing) {
+                    continue;
+                }
+                vector<unsigned char> resident((region.size + GUEST_PAGE_OFFSET) >> GUEST_PAGE_SHIFT, 1);
+                if (!region.file) {
+                    mincore(region.backing, region.size, resident.data());
+                }
+                for (uint64_t i = 0; i < resident.size(); i++) {
+                    uint64_t base = region.base + (i << GUEST_PAGE_SHIFT);
+                    // Only where this region is the one that counts
+                    if ((resident[i] & 1) && find_region(base) == &region) {
+                        pages.push_back(base);
+                    }
+                }
+            }
+        }
+        sort(pages.begin(), pages.end());
+        pages.erase(unique(pages.begin(), pages.end()), pages.end());
+        return pages;
+    }
+    // What the page at physical base holds now (it has to be mapped)
+    const char *page_data(uint64_t base) {
+        GuestPage *page = find_page(base);
+        return page ? page->host : ZERO_PAGE;
+    }
+
+    // The mapped ranges, in the order they were mapped
+    vector<CheckpointRegion> regions() const {
+        vector<CheckpointRegion> out;
+        for (const Region &region : mRegions) {
+            out.push_back({ region.base, region.size, region.perms });
+        }
+        return out;
+    }
+
+    // Make count pages of the file fd, from offset on, what the guest pages
+    // from base on hold, replacing whatever they held. The ranges have to be
+    // mapped already, and the pages aren't read until the guest uses them.
+    // Returns false if the host can't map the file.
+    bool map_checkpoint(uint64_t base, int fd, uint64_t offset, uint64_t count) {
+        lock_guard<mutex> hold(mLock);
+        uint64_t size = count << GUEST_PAGE_SHIFT;
+        const Region *region = find_region(base);
+        void *host;
+        if (region && region_in_window(*region) && find_region(base + size - 1) == region) {
+            // Read-only until unprotect() moves a page into the memfd
+            discard(base, size);
+            host = mmap(mWindow + base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, offset);
+            if (host == MAP_FAILED) {
+                return false;
+            }
+        }
+        else {
+            host = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+            if (host == MAP_FAILED) {
+                return false;
+            }
+            mFiles.push_back(make_pair(host, size));
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t page = base + (i << GUEST_PAGE_SHIFT);
+            mImage[page] = static_cast<char *>(host) + (i << GUEST_PAGE_SHIFT);
+            // A table entry from before has to come back from the image
+            auto leaf = mLeaves.find(page >> (LEAF_SHIFT + GUEST_PAGE_SHIFT));
+            if (leaf != mLeaves.end()) {
+                GuestPage &entry = leaf->second->pages[(page >> GUEST_PAGE_SHIFT) & ((1 << LEAF_SHIFT) - 1)];
+                if (entry.perms && entry.owned) {
+                    free_page(entry.host);
+                }
+                entry.perms = 0;
+            }
+        }
+        return true;
+    }
+
+    uint64_t allocated_pages() const {
+        return mAllocated;
+    }
+};
+
+// Guest memory lent to the host in place (see GuestMemory::lend()), as
+// pieces of host memory for readv() and writev()
+struct HostSpans {
+    vector<iovec> pieces;
+    uint64_t size = 0;          // Bytes in the pieces
+    bool code = false;          // Written pages include some this hart decoded code from
+};
+
+// One hart's view of guest memory. In front of the PhysicalMemory there is
+// a small direct mapped cache of pages per kind of access, so the common
+// case is one compare and an add. Anything else goes through the slow path,
+// which fills the caches.
+//
+// With satp in Sv39 mode, guest addresses are virtual and the slow path
+// translates them first. The page caches then hold virtual pages of the
+// current address space only (they are the fast half of the TLB, and are
+// emptied when satp changes). Behind them is mTlb, which is tagged with
+// the ASID and so keeps its entries across address space switches; only
+// a miss there walks the page table. SFENCE.VMA empties mTlb by address
+// and ASID. Without a privilege mode the guest is treated as one that may
+// use every valid leaf: the U bit is not checked. The walker sets A and D
+// itself.
+//
+// Every hart has its own caches, TLB, satp and code pages. A store only
+// tells the hart that made it about code it hit; as RISC-V has it, another
+// hart sees new code after its own FENCE.I. Once memory is shared, pages
+// are given host memory before they go in a page cache even for a read,
+// so no hart keeps reading ZERO_PAGE after another has written the page.
+class GuestMemory {
+    shared_ptr<PhysicalMemory> mPhys;
+    uint64_t mHartBit;            // This hart's bit in GuestPage::code
+    vector<uint64_t> mCodePages;  // Pages with our code bit set, for clear_code()
+    PageCacheEntry mCache[NUM_ACCESS_KINDS][PAGE_CACHE_SIZE];
+    uint64_t mCachePhys[NUM_ACCESS_KINDS][PAGE_CACHE_SIZE]; // Physical page of each entry
+    TlbEntry mTlb[TLB_SIZE];
+    uint64_t mSatp;
+
+    // What an access of size bytes at address has to match in the cache.
+    // Accesses that aren't aligned to their size never match, so the fast
+    // path never has to worry about crossing into the next page.
+    static uint64_t cache_tag(uint64_t address, uint64_t size) {
+        return address & (~GUEST_PAGE_OFFSET | (size - 1));
+    }
+    PageCacheEntry &cache_entry(AccessKinds access, uint64_t address) {
+        return mCache[access][(address >> GUEST_PAGE_SHIFT) & (PAGE_CACHE_SIZE - 1)];
+    }
+    void fill_cache(AccessKinds access, uint64_t base, uint64_t physical, const GuestPage *page) {
+        cache_entry(access, base) = { base, reinterpret_cast<uint64_t>(page->host) - base };
+        mCachePhys[access][(base >> GUEST_PAGE_SHIFT) & (PAGE_CACHE_SIZE - 1)] = physical;
+    }
+    // Drop the physical page at base from every cache, whatever virtual
+    // pages map it
+    void forget(uint64_t base) {
+        for (int access = 0; access < NUM_ACCESS_KINDS; access++) {
+            for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
+                if (mCachePhys[access][i] == base) {
+                    mCache[access][i].tag = ~0UL;
+                }
+            }
+        }
+    }
+    void flush() {
+        for (int access = 0; access < NUM_ACCESS_KINDS; access++) {
+            for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
+                mCache[access][i].tag = ~0UL;
+            }
+        }
+    }
+    void reset(int hart) {
+        mHartBit = 1UL << hart;
+        mSatp = 0;
+        flush();
+        for (TlbEntry &entry : mTlb) {
+            entry.flags = 0;
+        }
+    }
+
+    // Has this hart decoded code from page? (The other bits change under us.)
+    bool our_code(const GuestPage *page) const {
+        return __atomic_load_n(&page->code, __ATOMIC_RELAXED) & mHartBit;
+    }
+
+    // PhysicalMemory::unprotect(), and if that gave the page host memory of
+    // its own, the caches stop pointing at ZERO_PAGE for it
+    void unprotect(GuestPage *page, uint64_t base) {
+        bool zero = page->host == ZERO_PAGE;
+        mPhys->unprotect(page, base);
+        if (zero) {
+            forget(base);
+        }
+    }
+
+    // Page table entries are read and written straight in physical memory
+    uint64_t read_pte(uint64_t address) {
+        GuestPage *page = mPhys->access_page(address, ACCESS_READ);
+        uint64_t pte;
+        memcpy(&pte, page->host + (address & GUEST_PAGE_OFFSET), sizeof(pte));
+        return pte;
+    }
+    void write_pte(uint64_t address, uint64_t pte) {
+        GuestPage *page = mPhys->access_page(address, ACCESS_WRITE);
+        unprotect(page, address & ~GUEST_PAGE_OFFSET);
+        memcpy(page->host + (address & GUEST_PAGE_OFFSET), &pte, sizeof(pte));
+    }
+
+    // Walk the Sv39 page table for address and fill entry from the leaf.
+    // Returns false for a page fault.
+    bool walk(uint64_t address, AccessKinds access, TlbEntry &entry) {
+        uint64_t table = (mSatp & SATP_PPN_MASK) << GUEST_PAGE_SHIFT;
+        for (int level = 2; level >= 0; level--) {
+            uint64_t pte_address = table + ((address >> (GUEST_PAGE_SHIFT + 9 * level)) & 0x1ff) * 8;
+            uint64_t pte = read_pte(pte_address);
+            uint64_t ppn = (pte >> 10) & SATP_PPN_MASK;
+            if (!(pte & PTE_V) || ((pte & PTE_W) && !(pte & PTE_R))) {
+                return false;
+            }
+            if (!(pte & (PTE_R | PTE_X))) {
+                // A pointer to the next level
+                table = ppn << GUEST_PAGE_SHIFT;
+                continue;
+            }
+            uint64_t low = (1UL << (9 * level)) - 1;
+            if (!(pte & ACCESS_PTE_BITS[access]) || (ppn & low)) {
+                return false;
+            }
+            uint64_t updated = pte | PTE_A | ((access == ACCESS_WRITE) ? PTE_D : 0);
+            if (updated != pte) {
+                write_pte(pte_address, updated);
+            }
+            entry.vpn = (address >> GUEST_PAGE_SHIFT) & ((1UL << 27) - 1);
+            entry.ppn = ppn | (entry.vpn & low);
+            entry.asid = asid();
+            entry.flags = updated & 0xff;
+            entry.level = level;
+            return true;
+        }
+        return false;
+    }
+
+    // The physical address for an access to address. Returns false for a
+    // page fault.
+    bool translate(uint64_t address, AccessKinds access, uint64_t &physical) {
+        if ((mSatp >> SATP_MODE_SHIFT) != SATP_SV39) {
+            physical = address;
+            return true;
+        }
+        // Sv39 addresses are 39 bits, sign extended
+        int64_t top = static_cast<int64_t>(address) >> 38;
+        if (top != 0 && top != -1) {
+            return false;
+        }
+        uint64_t vpn = (address >> GUEST_PAGE_SHIFT) & ((1UL << 27) - 1);
+        TlbEntry &entry = mTlb[vpn & (TLB_SIZE - 1)];
+        bool hit = entry.flags && entry.vpn == vpn &&
+                   (entry.asid == asid() || (entry.flags & PTE_G));
+        // A store through an entry that isn't dirty yet walks again to set D
+        uint8_t needed = ACCESS_PTE_BITS[access] | ((access == ACCESS_WRITE) ? PTE_D : 0);
+        if ((!hit || (entry.flags & needed) != needed) && !walk(address, access, entry)) {
+            return false;
+        }
+        physical = (entry.ppn << GUEST_PAGE_SHIFT) | (address & GUEST_PAGE_OFFSET);
+        return true;
+    }
+
+    // The page for an access to a guest (virtual) address, and its physical
+    // address. Throws a GuestFault if it isn't allowed.
+    GuestPage *access_virtual(uint64_t address, AccessKinds access, uint64_t &physical) {
+        if (!translate(address, access, physical)) {
+            throw GuestFault{address, access, true};
+        }
+        return mPhys->access_page(physical, access);
+    }
+
+    void read_slow(uint64_t address, void *out, uint64_t size, AccessKinds access) {
+        char *to = static_cast<char *>(out);
+        while (size > 0) {
+            uint64_t physical;
+            GuestPage *page = access_virtual(address, access, physical);
+            uint64_t base = address & ~GUEST_PAGE_OFFSET;
+            uint64_t n = min(size, GUEST_PAGE_SIZE - (address - base));
+            if (page->host == ZERO_PAGE && mPhys->shared()) {
+                unprotect(page, physical & ~GUEST_PAGE_OFFSET);
+            }
+            memcpy(to, page->host + (address - base), n);
+            fill_cache(access, base, physical & ~GUEST_PAGE_OFFSET, page);
+            address += n;
+            to += n;
+            size -= n;
+        }
+    }
+
+    bool write_slow(uint64_t address, const void *in, uint64_t size) {
+        const char *from = static_cast<const char *>(in);
+        bool code = false;
+        while (size > 0) {
+            uint64_t physical;
+            GuestPage *page = access_virtual(address, ACCESS_WRITE, physical);
+            uint64_t base = address & ~GUEST_PAGE_OFFSET;
+            uint64_t n = min(size, GUEST_PAGE_SIZE - (address - base));
+            unprotect(page, physical & ~GUEST_PAGE_OFFSET);
+            memcpy(page->host + (address - base), from, n);
+            // Stores to code pages always come this way so they get noticed
+            if (our_code(page)) {
+                code = true;
+            }
+            else {
+                fill_cache(ACCESS_WRITE, base, physical & ~GUEST_PAGE_OFFSET, page);
+            }
+            address += n;
+            from += n;
+            size -= n;
+        }
+        return code;
+    }
+
+public:
+    // Pages of memory of its own come from arena, if given
+    explicit GuestMemory(PageArena *arena = nullptr) : mPhys(make_shared<PhysicalMemory>(arena)) {
+        reset(0);
+    }
+    // The view of hart hart on the same memory as other
+    GuestMemory(GuestMemory &other, int hart) : mPhys(other.mPhys) {
+        mPhys->share();
+        // other may have cached ZERO_PAGE before the memory was shared
+        other.flush();
+        reset(hart);
+    }
+
+    bool open_window() {
+        return mPhys->open_window();
+    }
+    // The host address of guest physical address 0 in the RAM window, or
+    // nullptr without one
+    char *window() const {
+        return mPhys->window();
+    }
+    void map(uint64_t base, uint64_t size, uint8_t perms) {
+        mPhys->map(base, size, perms);
+        flush();
+    }
+    bool map_file(uint64_t base, int fd, uint64_t offset, uint64_t size, uint8_t perms) {
+        bool mapped = mPhys->map_file(base, fd, offset, size, perms);
+        flush();
+        return mapped;
+    }
+    // Write size bytes at physical address address the way a loader does,
+    // whatever the page permissions are. data == nullptr writes zeros.
+    void load(uint64_t address, const char *data, uint64_t size) {
+        mPhys->load(address, data, size);
+        flush();
+    }
+
+    template<typename T>
+    T read(uint64_t address, AccessKinds access = ACCESS_READ) {
+        const PageCacheEntry &entry = cache_entry(access, address);
+        T value;
+        if (entry.tag == cache_tag(address, sizeof(T))) {
+            memcpy(&value, reinterpret_cast<const char *>(address + entry.addend), sizeof(T));
+        }
+        else {
+            read_slow(address, &value, sizeof(T), access);
+        }
+        return value;
+    }
+
+    // Returns true if the write landed on a page that code was decoded from
+    template<typename T>
+    bool write(uint64_t address, T value) {
+        const PageCacheEntry &entry = cache_entry(ACCESS_WRITE, address);
+        if (entry.tag == cache_tag(address, sizeof(T))) {
+            memcpy(reinterpret_cast<char *>(address + entry.addend), &value, sizeof(T));
+            return false;
+        }
+        return write_slow(address, &value, sizeof(T));
+    }
+
+    // Zero size bytes at address, as stores would, up to the first page the
+    // guest can't write. Unlike load(), this goes through the address
+    // translation and leaves the caches alone. Pages still reading from
+    // ZERO_PAGE are skipped rather than given memory. Returns true if any of
+    // it was on a page this hart decoded code from.
+    bool zero(uint64_t address, uint64_t size) {
+        bool code = false;
+        while (size > 0) {
+            uint64_t physical;
+            GuestPage *page;
+            try {
+                page = access_virtual(address, ACCESS_WRITE, physical);
+            }
+            catch (const GuestFault &) {
+                break;
+            }
+            uint64_t base = address & ~GUEST_PAGE_OFFSET;
+            uint64_t n = min(size, GUEST_PAGE_SIZE - (address - base));
+            if (__atomic_load_n(&page->host, __ATOMIC_ACQUIRE) != ZERO_PAGE) {
+                unprotect(page, physical & ~GUEST_PAGE_OFFSET);
+                memset(page->host + (address - base), 0, n);
+                code = code || our_code(page);
+            }
+            address += n;
+            size -= n;
+        }
+        return code;
+    }
+
+    // Run op on the aligned T at address as one host atomic operation and
+    // return what it returns. op gets the host address. If write, the page
+    // has to be readable and writable, and code says whether this hart
+    // decoded instructions from it.
+    template<typename T, typename F>
+    T atomic(uint64_t address, bool write, F op, bool &code) {
+        AccessKinds access = write ? ACCESS_WRITE : ACCESS_READ;
+        if (address & (sizeof(T) - 1)) {
+            throw GuestFault{address, access, false};
+        }
+        uint64_t physical;
+        GuestPage *page = access_virtual(address, access, physical);
+        if (!(page->perms & PERM_R)) {
+            throw GuestFault{address, ACCESS_READ, false};
+        }
+        if (write) {
+            unprotect(page, physical & ~GUEST_PAGE_OFFSET);
+        }
+        T result = op(reinterpret_cast<T *>(page->host + (physical & GUEST_PAGE_OFFSET)));
+        code = write && our_code(page);
+        return result;
+    }
+
+    // Lend the host the memory behind size bytes at address, to read (or if
+    // write, to write) in place instead of copying it. Pages that follow
+    // each other in host memory make one piece. Pages are lent in order up
+    // to the first one the guest can't access, or until there are IOV_MAX
+    // pieces, so spans.size can come up short, the way a read() or write()
+    // can. A page lent for writing gets host memory of its own first, as
+    // for write_slow().
+    void lend(uint64_t address, uint64_t size, bool write, HostSpans &spans) {
+        AccessKinds access = write ? ACCESS_WRITE : ACCESS_READ;
+        while (size > 0 && spans.pieces.size() < IOV_MAX) {
+            uint64_t physical;
+            GuestPage *page;
+            try {
+                page = access_virtual(address, access, physical);
+            }
+            catch (const GuestFault &) {
+                break;
+            }
+            uint64_t base = address & ~GUEST_PAGE_OFFSET;
+            uint64_t n = min(size, GUEST_PAGE_SIZE - (address - base));
+            if (write) {
+                unprotect(page, physical & ~GUEST_PAGE_OFFSET);
+                if (our_code(page)) {
+                    spans.code = true;
+                }
+            }
+            else if (page->host == ZERO_PAGE && mPhys->shared()) {
+                unprotect(page, physical & ~GUEST_PAGE_OFFSET);
+            }
+            char *host = page->host + (address - base);
+            iovec *last = spans.pieces.empty() ? nullptr : &spans.pieces.back();
+            if (last && static_cast<char *>(last->iov_base) + last->iov_len == host) {
+                last->iov_len += n;
+            }
+            else {
+                spans.pieces.push_back({ host, n });
+            }
+            spans.size += n;
+            address += n;
+            size -= n;
+        }
+    }
+
+    bool executable(uint64_t address) {
+        uint64_t physical;
+        if (!translate(address, ACCESS_EXEC, physical)) {
+            return false;
+        }
+        GuestPage *page = mPhys->find_page(physical);
+        return page && (page->perms & PERM_X);
+    }
+
+    // Note that instructions were decoded from the page holding address.
+    // This hart's writes to it (through any virtual address) skip the
+    // write cache from now on, so the machine can tell when they change
+    // code.
+    void mark_code(uint64_t address) {
+        uint64_t physical;
+        GuestPage *page = translate(address, ACCESS_EXEC, physical) ? mPhys->find_page(physical) : nullptr;
+        if (page && !our_code(page)) {
+            __atomic_fetch_or(&page->code, mHartBit, __ATOMIC_RELAXED);
+            mCodePages.push_back(physical & ~GUEST_PAGE_OFFSET);
+            forget(physical & ~GUEST_PAGE_OFFSET);
+            mPhys->protect(page);
+        }
+    }
+    // Forget every mark_code() (the machine dropped all it had decoded)
+    void clear_code() {
+        for (uint64_t base : mCodePages) {
+            GuestPage *page = mPhys->find_page(base);
+            if (page && our_code(page)) {
+                __atomic_fetch_and(&page->code, ~mHartBit, __ATOMIC_RELAXED);
+                mPhys->protect(page);
+            }
+        }
+        mCodePages.clear();
+    }
+
+    uint64_t satp() const {
+        return mSatp;
+    }
+    uint16_t asid() const {
+        return (mSatp >> SATP_ASID_SHIFT) & 0xffff;
+    }
+    bool paging() const {
+        return (mSatp >> SATP_MODE_SHIFT) == SATP_SV39;
+    }
+    // Write satp. A MODE other than Bare or Sv39 leaves it as it was.
+    // Returns true if the address space changed. Only the page caches are
+    // emptied; mTlb keeps every ASID's entries.
+    bool set_satp(uint64_t value) {
+        uint64_t mode = value >> SATP_MODE_SHIFT;
+        if ((mode != 0 && mode != SATP_SV39) || value == mSatp) {
+            return false;
+        }
+        mSatp = value;
+        flush();
+        return true;
+    }
+    // SFENCE.VMA: drop the TLB entries for address (if by_address) in
+    // address space asid (if by_asid; global entries stay then)
+    void sfence_vma(bool by_address, uint64_t address, bool by_asid, uint16_t asid) {
+        uint64_t vpn = (address >> GUEST_PAGE_SHIFT) & ((1UL << 27) - 1);
+        for (TlbEntry &entry : mTlb) {
+            int shift = 9 * entry.level;
+            if (entry.flags &&
+                (!by_address || (entry.vpn >> shift) == (vpn >> shift)) &&
+                (!by_asid || (entry.asid == asid && !(entry.flags & PTE_G)))) {
+                entry.flags = 0;
+            }
+        }
+        flush();
+    }
+
+    // Snapshots of memory (see PhysicalMemory). The caches go both times,
+    // so that this hart's next write to any page is noticed, and restore()
+    // empties the TLB as the page tables may have changed back. Any other
+    // harts have to be stopped, and their caches are not emptied.
+    void snapshot() {
+        mPhys->snapshot();
+        flush();
+    }
+    bool restore(bool &code) {
+        if (!mPhys->restore(code)) {
+            return false;
+        }
+        flush();
+        for (TlbEntry &entry : mTlb) {
+            entry.flags = 0;
+        }
+        return true;
+    }
+    size_t dirty_pages() const {
+        return mPhys->dirty_pages();
+    }
+
+    // Checkpoints (see PhysicalMemory). start_log() empties the caches for
+    // the same reason snapshot() does.
+    bool logging() const {
+        return mPhys->logging();
+    }
+    void start_log() {
+        mPhys->start_log();
+        flush();
+    }
+    vector<uint64_t> checkpoint_pages(bool full) {
+        return mPhys->checkpoint_pages(full);
+    }
+    const char *page_data(uint64_t base) {
+        return mPhys->page_data(base);
+    }
+    vector<CheckpointRegion> regions() const {
+        return mPhys->regions();
+    }
+    bool map_checkpoint(uint64_t base, int fd, uint64_t offset, uint64_t count) {
+        bool mapped = mPhys->map_checkpoint(base, fd, offset, count);
+        flush();
+        return mapped;
+    }
+
+    uint64_t allocated_pages() const {
+        return mPhys->allocated_pages();
+    }
+    // The caches, as [NUM_ACCESS_KINDS][PAGE_CACHE_SIZE], for JIT code
+    PageCacheEntry *page_cache() {
+        return &mCache[0][0];
+    }
+};
+
+// What a FlightRecorder entry is
+enum RecordKinds : uint16_t {
+    RECORD_INST,     // An instruction the stages retired
+    RECORD_ACCESS,   // ... that was a load, store or AMO of address
+    RECORD_BLOCK,    // A block run_fast() or run_jit() went into
+};
+
+// One entry of a FlightRecorder (32 bytes)
+struct FlightRecord {
+    uint64_t pc;
+    uint32_t inst;      // The instruction word (0 for a block)
+    RecordKinds kind;
+    uint16_t n;         // rd, or how many instructions the block has
+    int64_t rd_value;   // What rd holds after the instruction
+    uint64_t address;
+};
+
+// Compiled code finds an entry with a shift, and writes kind and n as one
+// dword
+static_assert(sizeof(FlightRecord) == 32, "FlightRecord is 32 bytes");
+static_assert(offsetof(FlightRecord, inst) == 8 && offsetof(FlightRecord, kind) == 12 &&
+              offsetof(FlightRecord, n) == 14, "FlightRecord layout");
+
+// How many entries a FlightRecorder keeps (a power of two)
+const uint64_t FLIGHT_RECORDER_SIZE = 1 << 10;
+
+// The last FLIGHT_RECORDER_SIZE things a Machine ran, always on, for
+// dump() to show how a guest got into trouble. The stages record every
+// instruction they retire, with its rd value and the address it used.
+// run_fast() and run_jit() only record each block they go into, which
+// costs a few stores per block rather than per instruction. Compiled
+// blocks do that themselves (X86Emitter::record_block()), so blocks the
+// JIT chains together are seen too. dump() doesn't allocate or use stdio,
+// so a signal handler can call it.
+class FlightRecorder {
+    FlightRecord mRecords[FLIGHT_RECORDER_SIZE];
+    uint64_t mCount;    // Entries ever recorded
+
+    // Write value into out as digits hex digits, and return the end
+    static char *hex(char *out, uint64_t value, int digits) {
+        for (int i = digits - 1; i >= 0; i--) {
+            out[i] = "0123456789abcdef"[value & 0xf];
+            value >>= 4;
+        }
+        return out + digits;
+    }
+    static char *text(char *out, const char *str) {
+        while (*str) {
+            *out++ = *str++;
+        }
+        return out;
+    }
+    static char *decimal(char *out, uint64_t value) {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        while (n) {
+            *out++ = digits[--n];
+        }
+        return out;
+    }
+
+public:
+    FlightRecorder() : mCount(0) {}
+
+    void record(uint64_t pc, uint32_t inst, int rd, int64_t rd_value) {
+        FlightRecord &entry = mRecords[mCount++ & (FLIGHT_RECORDER_SIZE - 1)];
+        entry.pc = pc;
+        entry.inst = inst;
+        entry.kind = RECORD_INST;
+        entry.n = rd;
+        entry.rd_value = rd_value;
+    }
+    void record_access(uint64_t pc, uint32_t inst, int rd, int64_t rd_value, uint64_t address) {
+        FlightRecord &entry = mRecords[mCount++ & (FLIGHT_RECORDER_SIZE - 1)];
+        entry.pc = pc;
+        entry.inst = inst;
+        entry.kind = RECORD_ACCESS;
+        entry.n = rd;
+        entry.rd_value = rd_value;
+        entry.address = address;
+    }
+    void record_block(uint64_t pc, uint64_t insts) {
+        FlightRecord &entry = mRecords[mCount++ & (FLIGHT_RECORDER_SIZE - 1)];
+        entry.pc = pc;
+        entry.inst = 0;
+        entry.kind = RECORD_BLOCK;
+        entry.n = insts;
+    }
+    // Where compiled code finds mCount, from the start of the recorder
+    // (which is mRecords)
+    static int32_t count_offset() {
+        static_assert(offsetof(FlightRecorder, mRecords) == 0, "mRecords comes first");
+        return offsetof(FlightRecorder, mCount);
+    }
+    // Put mCount back from compiled code that was keeping it (see
+    // jit_fault_handler())
+    void set_count(uint64_t count) {
+        mCount = count;
+    }
+
+    // Hand the entries to write(data, size) as text, oldest first, a line
+    // at a time:
+    //   [RECORDER] 0x0000000000001000: 00a50533 x10=0x0000000000000005
+    //   [RECORDER] 0x0000000000001004: 0005b583 x11=0x0000000000000007 @0x0000000000002000
+    //   [RECORDER] 0x0000000000001008: block of 12
+    template<typename F>
+    void dump(F write) const {
+        char line[128];
+        uint64_t first = mCount > FLIGHT_RECORDER_SIZE ? mCount - FLIGHT_RECORDER_SIZE : 0;
+        char *end = decimal(text(line, "[RECORDER] The last "), mCount - first);
+        end = decimal(text(end, " of "), mCount);
+        end = text(end, " instructions and blocks run, oldest first:\n");
+        write(line, end - line);
+        for (uint64_t i = first; i < mCount; i++) {
+            const FlightRecord &entry = mRecords[i & (FLIGHT_RECORDER_SIZE - 1)];
+            end = text(hex(text(line, "[RECORDER] 0x"), entry.pc, 16), ": ");
+            if (entry.kind == RECORD_BLOCK) {
+                end = decimal(text(end, "block of "), entry.n);
+            }
+            else {
+                end = hex(end, entry.inst, 8);
+                if (entry.n) {
+                    end = hex(text(decimal(text(end, " x"), entry.n), "=0x"), entry.rd_value, 16);
+                }
+                if (entry.kind == RECORD_ACCESS) {
+                    end = hex(text(end, " @0x"), entry.address, 16);
+                }
+            }
+            *end++ = '\n';
+            write(line, end - line);
+        }
+    }
+    void dump(ostream &out) const {
+        dump([&](const char *data, size_t size) { out.write(data, size); });
+    }
+    // For a signal handler
+    void dump(int fd) const {
+        dump([fd](const char *data, size_t size) {
+            while (size > 0) {
+                ssize_t done = write(fd, data, size);
+                if (done <= 0) {
+                    return;
+                }
+                data += done;
+                size -= done;
+            }
+        });
+    }
+};
+
+// A function of the guest program, to name profiler frames with
+struct GuestFunction {
+    uint64_t size;
+    string name;
+};
+
+// Where a guest spends its time. A Machine with a profiler (see
+// Machine::set_profiler()) adds a sample of its call stack every so many
+// instructions, and write() turns the samples into the folded stack format
+// that flame graph tools (flamegraph.pl, speedscope, inferno) read.
+class Profiler {
+    // How often each stack was seen: where the program started, the entry
+    // points of the functions called from there, then the PC
+    map<vector<uint64_t>, uint64_t> mStacks;
+    uint64_t mSamples;
+
+public:
+    Profiler() : mSamples(0) {}
+
+    void add(const vector<uint64_t> &stack) {
+        mStacks[stack]++;
+        mSamples++;
+    }
+    void merge(const Profiler &other) {
+        for (auto &stack : other.mStacks) {
+            mStacks[stack.first] += stack.second;
+        }
+        mSamples += other.mSamples;
+    }
+    uint64_t samples() const {
+        return mSamples;
+    }
+
+    // Write one line per stack to path: its frames from the outermost in,
+    // joined by ';', then a space and how many samples it had. A frame is
+    // the function in functions (by address) that holds it, or the entry
+    // point in hex if there is none. The PC only adds a frame of its own if
+    // it is in a known function other than the one last called, as after a
+    // tail call. Returns false if path can't be written.
+    bool write(const string &path, const map<uint64_t, GuestFunction> &functions) const {
+        // The function address is in, or nullptr
+        auto function = [&](uint64_t address) -> const GuestFunction * {
+            auto found = functions.upper_bound(address);
+            if (found == functions.begin()) {
+                return nullptr;
+            }
+            --found;
+            return address - found->first < max<uint64_t>(found->second.size, 1) ? &found->second : nullptr;
+        };
+        auto name = [&](uint64_t address) {
+            const GuestFunction *holder = function(address);
+            if (holder) {
+                return holder->name;
+            }
+            ostringstream hex_name;
+            hex_name << "0x" << hex << address;
+            return hex_name.str();
+        };
+        // Stacks that differ only in the PC can fold to the same line
+        map<string, uint64_t> lines;
+        for (auto &stack : mStacks) {
+            const vector<uint64_t> &frames = stack.first;
+            string line = name(frames[0]);
+            for (size_t i = 1; i + 1 < frames.size(); i++) {
+                line += ';' + name(frames[i]);
+            }
+            const GuestFunction *leaf = function(frames.back());
+            if (leaf && leaf != function(frames[frames.size() - 2])) {
+                line += ';' + leaf->name;
+            }
+            lines[line] += stack.second;
+        }
+        ofstream out(path);
+        for (auto &line : lines) {
+            out << line.first << ' ' << line.second << '\n';
+        }
+        return static_cast<bool>(out);
+    }
+};
+
+// The recorder of the machine this thread is running, for a signal to dump
+thread_local const FlightRecorder *tRecorder = nullptr;
+
+// A signal that would kill us dumps this thread's recorder first, then
+// happens again the default way
+void recorder_signal_handler(int sig) {
+    if (tRecorder) {
+        static const char message[] = "[RECORDER] Stopped by a signal\n";
+        if (write(STDERR_FILENO, message, sizeof(message) - 1) > 0) {
+            tRecorder->dump(STDERR_FILENO);
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Keep SIGINT and SIGTERM off the calling thread, which runs no hart, so
+// the kernel hands one sent to the whole process to a thread that has a
+// recorder to dump. Returns the mask to put back with pthread_sigmask().
+sigset_t block_stop_signals() {
+    sigset_t stop, old;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, &old);
+    return old;
+}
+
+// Install recorder_signal_handler() for the signals that stop us. (The JIT
+// takes over SIGSEGV when it needs it, and hands on the ones that aren't
+// its own.)
+void install_recorder_signal_handlers() {
+    for (int sig : { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGINT, SIGTERM }) {
+        signal(sig, recorder_signal_handler);
+    }
+}
+
+#if defined(__x86_64__)
+// What a JIT compiled block returns: the guest PC to go to next and, when the
+// block left through an exit that could be chained, the address of that
+// exit's stub so it can be patched into a direct jump. A guest PC with bit 0
+// set means "run the instruction at pc & ~1 in the interpreter".
+struct JitExit {
+    int64_t pc;
+    uint8_t *patch;
+};
+// memory is the guest page caches, or the RAM window if the blocks were
+// compiled to use it (see Machine::jit_window()), and recorder is the
+// machine's flight recorder. exited is GuestProcess::exited: a block that
+// finds it set goes back to run_jit() before it does anything.
+typedef JitExit (*JitCode)(int64_t *regs, void *memory, FlightRecorder *recorder,
+                           const atomic<bool> *exited);
+static_assert(sizeof(atomic<bool>) == 1, "compiled code tests exited as a byte");
+
+// The x86-64 registers the JIT uses. rdi points at the guest registers and
+// rsi at the guest page caches or RAM window for the whole run; rax, rcx and
+// rdx are scratch. r9 holds the flight recorder and r8 its count, which
+// chained blocks keep there rather than in memory, and only put back when
+// they return (see X86Emitter::record_block()). r10 points at the flag
+// that says the program has exited.
+enum HostRegs { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+// Opcodes for alu_rr() (op r/m, reg) and the /digit for alu_ri()
+enum X86AluOps { X86_ADD = 0x01, X86_OR = 0x09, X86_AND = 0x21, X86_SUB = 0x29,
+                 X86_XOR = 0x31, X86_CMP = 0x39, X86_MOV = 0x89 };
+// Opcodes for alu_rm() (op reg, r/m)
+enum X86AluMems { X86M_ADD = 0x03, X86M_CMP = 0x3b };
+enum X86AluImms { X86I_ADD = 0, X86I_OR = 1, X86I_AND = 4, X86I_XOR = 6, X86I_CMP = 7 };
+enum X86Shifts { X86_SHL = 4, X86_SHR = 5, X86_SAR = 7 };
+enum X86Conds { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+                CC_L = 0xc, CC_GE = 0xd };
+// The condition each branch kind jumps on, BEQ first
+const X86Conds BRANCH_CONDS[NUM_BRANCH_KINDS] = { CC_E, CC_NE, CC_L, CC_GE, CC_B, CC_AE };
+// Bytes in an exit stub: movabs rax, pc; mov [r9 + count], r8;
+// lea rdx, [stub]; ret
+const int JIT_STUB_SIZE = 25;
+// Bytes before the point chained jumps go to in a block: mov r9, rdx;
+// mov r10, rcx; mov r8, [r9 + count]
+const int JIT_ENTRY_SIZE = 13;
+// Size of the executable buffer. It is emptied (with all blocks) when full.
+const size_t JIT_BUFFER_SIZE = 32 << 20;
+
+// Writes x86-64 machine code into an mmap'd executable buffer. Only the
+// handful of instruction forms Machine::jit_compile() needs are here.
+// The buffer is a memfd mapped twice, read and execute where the code runs
+// and read and write where it is written, so no page is ever writable and
+// executable at once. Addresses in the code (here(), the jump displacements
+// patch_to() fills in, stubs) are always where it runs.
+class X86Emitter {
+    uint8_t *mCode;
+    uint8_t *mWritable;  // The same memory as mCode
+    size_t mUsed;
+    // Each load or store that reaches into the RAM window, with the stub
+    // that hands it to the interpreter instead. In code order, for
+    // fault_stub().
+    vector<pair<const uint8_t *, const uint8_t *>> mFaultSites;
+
+    void rex(bool wide) {
+        if (wide) {
+            byte(0x48);
+        }
+    }
+    void modrm(int mod, int reg, int rm) {
+        byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+    // Where to write the code byte at at
+    uint8_t *writable(const uint8_t *at) const {
+        return mWritable + (at - mCode);
+    }
+    // [base + disp] with base one of the low eight registers other than rsp/rbp
+    void mem_operand(int reg, int base, int32_t disp) {
+        if (disp >= -128 && disp < 128) {
+            modrm(1, reg, base);
+            byte(disp);
+        }
+        else {
+            modrm(2, reg, base);
+            dword(disp);
+        }
+    }
+
+public:
+    X86Emitter() {
+        mCode = nullptr;
+        mWritable = nullptr;
+        mUsed = 0;
+    }
+    ~X86Emitter() {
+        if (mCode) {
+            munmap(mCode, JIT_BUFFER_SIZE);
+            munmap(mWritable, JIT_BUFFER_SIZE);
+        }
+    }
+
+    // Map the buffer the first time the JIT is used. Returns false if the
+    // host won't give us executable memory.
+    bool ready() {
+        if (mCode) {
+            return true;
+        }
+        int fd = memfd_create("jit", MFD_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        void *code = MAP_FAILED;
+        void *writable = MAP_FAILED;
+        if (ftruncate(fd, JIT_BUFFER_SIZE) == 0) {
+            code = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+            writable = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        // The mappings keep the memory
+        close(fd);
+        if (code == MAP_FAILED || writable == MAP_FAILED) {
+            if (code != MAP_FAILED) {
+                munmap(code, JIT_BUFFER_SIZE);
+            }
+            if (writable != MAP_FAILED) {
+                munmap(writable, JIT_BUFFER_SIZE);
+            }
+            return false;
+        }
+        mCode = static_cast<uint8_t *>(code);
+        mWritable = static_cast<uint8_t *>(writable);
+        return true;
+    }
+    void reset() {
+        mUsed = 0;
+        mFaultSites.clear();
+    }
+    // Room for one more block of n guest instructions? (Generous: the
+    // biggest instruction, a DIV, is well under 128 bytes.)
+    bool has_room(size_t n) const {
+        return mUsed + (n + 4) * 128 < JIT_BUFFER_SIZE;
+    }
+    uint8_t *here() const {
+        return mCode + mUsed;
+    }
+
+    void byte(uint8_t b) {
+        mWritable[mUsed++] = b;
+    }
+    void dword(uint32_t d) {
+        memcpy(mWritable + mUsed, &d, 4);
+        mUsed += 4;
+    }
+    void qword(uint64_t q) {
+        memcpy(mWritable + mUsed, &q, 8);
+        mUsed += 8;
+    }
+
+    // host = guest register r (x0 reads as zero)
+    void load_reg(int host, int r) {
+        if (r == 0) {
+            modrm_only(0x31, host, host, false);
+            return;
+        }
+        rex(true);
+        byte(0x8b);
+        mem_operand(host, RDI, r * 8);
+    }
+    // guest register r = host (writes to x0 are dropped)
+    void store_reg(int r, int host) {
+        if (r == 0) {
+            return;
+        }
+        rex(true);
+        byte(0x89);
+        mem_operand(host, RDI, r * 8);
+    }
+    void load_imm(int host, int64_t value) {
+        if (value == static_cast<int32_t>(value)) {
+            rex(true);
+            byte(0xc7);
+            modrm(3, 0, host);
+            dword(value);
+        }
+        else {
+            rex(true);
+            byte(0xb8 + host);
+            qword(value);
+        }
+    }
+    // op dst, src (register to register)
+    void modrm_only(uint8_t op, int dst, int src, bool wide) {
+        rex(wide);
+        byte(op);
+        modrm(3, src, dst);
+    }
+    void alu_rr(X86AluOps op, int dst, int src, bool wide = true) {
+        modrm_only(op, dst, src, wide);
+    }
+    // op reg, [base + disp]
+    void alu_rm(X86AluMems op, int reg, int base, int32_t disp) {
+        rex(true);
+        byte(op);
+        mem_operand(reg, base, disp);
+    }
+    void alu_ri(X86AluImms op, int dst, int32_t imm, bool wide = true) {
+        rex(wide);
+        byte(0x81);
+        modrm(3, op, dst);
+        dword(imm);
+    }
+    void imul(int dst, int src, bool wide = true) {
+        rex(wide);
+        byte(0x0f);
+        byte(0xaf);
+        modrm(3, dst, src);
+    }
+    void shift_cl(X86Shifts op, int dst, bool wide = true) {
+        rex(wide);
+        byte(0xd3);
+        modrm(3, op, dst);
+    }
+    void shift_imm(X86Shifts op, int dst, uint8_t amount, bool wide = true) {
+        rex(wide);
+        byte(0xc1);
+        modrm(3, op, dst);
+        byte(amount);
+    }
+    // dst = sign extended low 32 bits of src
+    void movsxd(int dst, int src) {
+        rex(true);
+        byte(0x63);
+        modrm(3, dst, src);
+    }
+    void test(int a, int b) {
+        modrm_only(0x85, a, b, true);
+    }
+    void mfence() {
+        byte(0x0f);
+        byte(0xae);
+        byte(0xf0);
+    }
+    void neg(int r) {
+        rex(true);
+        byte(0xf7);
+        modrm(3, 3, r);
+    }
+    // rdx:rax = sign extended rax, then signed divide by r
+    void cqo_idiv(int r) {
+        byte(0x48);
+        byte(0x99);
+        rex(true);
+        byte(0xf7);
+        modrm(3, 7, r);
+    }
+    // rcx = [rax] with the width and extension of a guest load
+    void guest_load(InstKinds kind) {
+        switch (kind) {
+            case I_LB:  byte(0x48); byte(0x0f); byte(0xbe); break;
+            case I_LBU: byte(0x0f); byte(0xb6); break;
+            case I_LH:  byte(0x48); byte(0x0f); byte(0xbf); break;
+            case I_LHU: byte(0x0f); byte(0xb7); break;
+            case I_LW:  byte(0x48); byte(0x63); break;
+            case I_LWU: byte(0x8b); break;
+            default:    byte(0x48); byte(0x8b); break;
+        }
+        byte(0x08); // rcx, [rax]
+    }
+    // [rax] = rcx with the width of a guest store
+    void guest_store(InstKinds kind) {
+        switch (kind) {
+            case I_SB: byte(0x88); break;
+            case I_SH: byte(0x66); byte(0x89); break;
+            case I_SW: byte(0x89); break;
+            default:   byte(0x48); byte(0x89); break;
+        }
+        byte(0x08);
+    }
+    // Add one to the counter at p (clobbers rdx)
+    void count(uint64_t *p) {
+        load_imm(RDX, reinterpret_cast<int64_t>(p));
+        byte(0x48);
+        byte(0xff);
+        byte(0x02); // inc qword [rdx]
+    }
+    // Where a block is called from run_jit(): pick up the flight recorder
+    // (the third argument), its count, and the exited flag (the fourth).
+    // JIT_ENTRY_SIZE bytes.
+    void entry() {
+        byte(0x49);
+        byte(0x89);
+        byte(0xd1); // mov r9, rdx
+        byte(0x49);
+        byte(0x89);
+        byte(0xca); // mov r10, rcx
+        byte(0x4d);
+        byte(0x8b);
+        byte(0x81);
+        dword(FlightRecorder::count_offset()); // mov r8, [r9 + count]
+    }
+    // FlightRecorder::record_block(pc, insts), with the count in r8 (clobbers
+    // rax and rcx). The count stays in a register across chained blocks, so
+    // blocks don't wait on each other's stores to it.
+    void record_block(int64_t pc, uint64_t insts) {
+        FlightRecord entry = {};
+        entry.kind = RECORD_BLOCK;
+        entry.n = insts;
+        uint32_t kind_n;
+        memcpy(&kind_n, &entry.kind, sizeof(kind_n));
+        byte(0x4c);
+        byte(0x89);
+        byte(0xc0); // mov rax, r8
+        alu_ri(X86I_AND, RAX, FLIGHT_RECORDER_SIZE - 1, false);
+        shift_imm(X86_SHL, RAX, 5, false);
+        if (pc == static_cast<int32_t>(pc)) {
+            byte(0x49);
+            byte(0xc7);
+            byte(0x04);
+            byte(0x01);
+            dword(pc);  // mov qword [r9 + rax], pc
+        }
+        else {
+            load_imm(RCX, pc);
+            byte(0x49);
+            byte(0x89);
+            byte(0x0c);
+            byte(0x01); // mov [r9 + rax], rcx
+        }
+        byte(0x41);
+        byte(0xc7);
+        byte(0x44);
+        byte(0x01);
+        byte(8);
+        dword(0);       // mov dword [r9 + rax + 8], 0 (inst)
+        byte(0x41);
+        byte(0xc7);
+        byte(0x44);
+        byte(0x01);
+        byte(12);
+        dword(kind_n);  // mov dword [r9 + rax + 12], kind and n
+        byte(0x49);
+        byte(0xff);
+        byte(0xc0);     // inc r8
+    }
+    // Jump to the returned displacement if the exited flag is set
+    uint8_t *jump_if_exited() {
+        byte(0x41);
+        byte(0x80);
+        byte(0x3a);
+        byte(0);    // cmp byte [r10], 0
+        return jcc(CC_NE);
+    }
+    // Put the count back in the recorder before a return
+    void save_count() {
+        byte(0x4d);
+        byte(0x89);
+        byte(0x81);
+        dword(FlightRecorder::count_offset()); // mov [r9 + count], r8
+    }
+
+    // Jumps with a 32-bit displacement. They return the address of the
+    // displacement so it can be filled in by patch_to().
+    uint8_t *jcc(X86Conds cc) {
+        byte(0x0f);
+        byte(0x80 | cc);
+        dword(0);
+        return here() - 4;
+    }
+    uint8_t *jmp() {
+        byte(0xe9);
+        dword(0);
+        return here() - 4;
+    }
+    void patch_to(uint8_t *disp, const uint8_t *target) {
+        int32_t rel = static_cast<int32_t>(target - (disp + 4));
+        memcpy(writable(disp), &rel, 4);
+    }
+
+    // Leave the block for guest PC pc through a stub that can later be
+    // patched into a direct jump to the next block.
+    void exit_stub(int64_t pc) {
+        byte(0x48);
+        byte(0xb8);
+        qword(pc);
+        save_count();
+        // lea rdx, [rip - 24]: the start of this stub
+        byte(0x48);
+        byte(0x8d);
+        byte(0x15);
+        dword(static_cast<uint32_t>(1 - JIT_STUB_SIZE));
+        byte(0xc3);
+    }
+    // Leave the block for the guest PC in rax (no chaining)
+    void exit_rax() {
+        save_count();
+        modrm_only(0x31, RDX, RDX, false);
+        byte(0xc3);
+    }
+    // Leave the block, asking the interpreter to run the instruction at pc
+    void exit_interpret(int64_t pc) {
+        load_imm(RAX, pc | 1);
+        exit_rax();
+    }
+    // Turn an exit stub into a jmp to the block at target, past its entry()
+    void chain(uint8_t *stub, const uint8_t *target) {
+        *writable(stub) = 0xe9;
+        patch_to(stub + 1, target + JIT_ENTRY_SIZE);
+    }
+    // Turn it back into the exit stub for guest PC pc it was. The jmp only
+    // took the first five bytes of its movabs rax, pc.
+    void unchain(uint8_t *stub, int64_t pc) {
+        uint8_t *at = writable(stub);
+        at[0] = 0x48;
+        at[1] = 0xb8;
+        memcpy(at + 2, &pc, 3);
+    }
+    // Is at in compiled code?
+    bool contains(const uint8_t *at) const {
+        return at >= mCode && at < mCode + mUsed;
+    }
+
+    // The guest access at at goes to stub if it faults. Sites have to be
+    // added in the order they were emitted.
+    void add_fault_site(const uint8_t *at, const uint8_t *stub) {
+        mFaultSites.push_back(make_pair(at, stub));
+    }
+    // Where to resume after a fault at rip, or nullptr if rip isn't a guest
+    // access in this buffer. (Called from a signal handler: no allocation.)
+    const uint8_t *fault_stub(const uint8_t *rip) const {
+        auto found = lower_bound(mFaultSites.begin(), mFaultSites.end(),
+                                 make_pair(rip, static_cast<const uint8_t *>(nullptr)));
+        return (found != mFaultSites.end() && found->first == rip) ? found->second : nullptr;
+    }
+};
+
+// The emitter whose code this thread is running, if any
+thread_local const X86Emitter *tRunningJit = nullptr;
+
+// SIGSEGV from a compiled load or store that hit a protected page or a
+// guard zone of the RAM window: resume at its exit to the interpreter,
+// which redoes the access the slow way. Any other SIGSEGV is a real crash,
+// for recorder_signal_handler().
+void jit_fault_handler(int sig, siginfo_t *, void *context) {
+    greg_t *regs = static_cast<ucontext_t *>(context)->uc_mcontext.gregs;
+    const uint8_t *stub = tRunningJit
+        ? tRunningJit->fault_stub(reinterpret_cast<const uint8_t *>(regs[REG_RIP])) : nullptr;
+    if (stub) {
+        regs[REG_RIP] = reinterpret_cast<greg_t>(stub);
+        return;
+    }
+    // Compiled code that crashed still had its recorder in r9 and the
+    // count in r8
+    if (tRunningJit && tRunningJit->contains(reinterpret_cast<const uint8_t *>(regs[REG_RIP]))) {
+        reinterpret_cast<FlightRecorder *>(regs[REG_R9])->set_count(regs[REG_R8]);
+    }
+    recorder_signal_handler(sig);
+}
+
+// Install jit_fault_handler() for SIGSEGV. It is for the whole process, so
+// the first hart to need it does this, once: the result goes in a static.
+bool install_jit_fault_handler() {
+    struct sigaction action = {};
+    action.sa_sigaction = jit_fault_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGSEGV, &action, nullptr) == 0;
+}
+#endif
+
+// The default amount of RAM, mapped from address 0
+const int MEM_SIZE = 1 << 18;
+// ELF programs get a stack that ends here, of ELF_STACK_SIZE bytes by default
+const uint64_t STACK_TOP = 1UL << 38;
+const uint64_t ELF_STACK_SIZE = 8 << 20;
+// ... and address space for a heap of up to ELF_HEAP_SIZE bytes after
+// their last segment, and for mmap() below the stack (see GuestProcess)
+const uint64_t ELF_HEAP_SIZE = 1UL << 32;
+const uint64_t ELF_MMAP_SIZE = 1UL << 32;
+// Each hart after the first starts with sp this far below the one before
+const uint64_t HART_STACK_SIZE = 16 << 10;
+const int NUM_REGS = 32;
+
+// The Linux system calls ECALL runs, by their RV64 numbers (in a7). The
+// machine's own services (a7 = 0, 1 and 2) don't clash with any of them.
+enum LinuxSyscalls {
+    LINUX_OPENAT = 56,
+    LINUX_CLOSE = 57,
+    LINUX_LSEEK = 62,
+    LINUX_READ = 63,
+    LINUX_WRITE = 64,
+    LINUX_FSTAT = 80,
+    LINUX_EXIT = 93,
+    LINUX_EXIT_GROUP = 94,
+    LINUX_CLOCK_GETTIME = 113,
+    LINUX_BRK = 214,
+    LINUX_MUNMAP = 215,
+    LINUX_MMAP = 222
+};
+// MachineStats counts ECALLs by a7 below this one by one, and the rest together
+const int NUM_ECALL_COUNTS = 256;
+
+// The name of the Linux system call number, or nullptr
+const char *linux_syscall_name(int64_t number) {
+    switch (number) {
+    case LINUX_OPENAT:        return "openat";
+    case LINUX_CLOSE:         return "close";
+    case LINUX_LSEEK:         return "lseek";
+    case LINUX_READ:          return "read";
+    case LINUX_WRITE:         return "write";
+    case LINUX_FSTAT:         return "fstat";
+    case LINUX_EXIT:          return "exit";
+    case LINUX_EXIT_GROUP:    return "exit_group";
+    case LINUX_CLOCK_GETTIME: return "clock_gettime";
+    case LINUX_BRK:           return "brk";
+    case LINUX_MUNMAP:        return "munmap";
+    case LINUX_MMAP:          return "mmap";
+    default:                  return nullptr;
+    }
+}
+
+// openat() flags as RV64 Linux numbers them, and the host's. The access
+// mode (the low two bits) is the same everywhere.
+const int GUEST_OPEN_FLAGS[][2] = {
+    { 0100, O_CREAT }, { 0200, O_EXCL }, { 0400, O_NOCTTY }, { 01000, O_TRUNC },
+    { 02000, O_APPEND }, { 04000, O_NONBLOCK }, { 010000, O_DSYNC },
+    { 0200000, O_DIRECTORY }, { 0400000, O_NOFOLLOW }, { 04010000, O_SYNC }
+};
+// mmap() flags the machine looks at
+const int GUEST_MAP_FIXED = 0x10;
+const int GUEST_MAP_ANONYMOUS = 0x20;
+// The guest's AT_FDCWD
+const int GUEST_AT_FDCWD = -100;
+
+// struct stat as RV64 Linux lays it out (asm-generic/stat.h)
+struct GuestStat {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t rdev;
+    uint64_t pad1;
+    int64_t size;
+    int32_t blksize;
+    int32_t pad2;
+    int64_t blocks;
+    int64_t atime;
+    uint64_t atime_nsec;
+    int64_t mtime;
+    uint64_t mtime_nsec;
+    int64_t ctime;
+    uint64_t ctime_nsec;
+    uint32_t unused[2];
+};
+static_assert(sizeof(GuestStat) == 128, "RV64 struct stat is 128 bytes");
+
+// Where an ELF program's heap and mmap() area are. load_elf() maps both
+// when it loads the program (pages cost nothing until they are written),
+// so brk() and mmap() only move these bounds and never drop a snapshot or
+// make the next checkpoint a full one. The catch is that the program can
+// touch memory past its break without a fault.
+struct GuestHeap {
+    uint64_t brk_start;  // The break is in [brk_start, brk_end], or 0
+    uint64_t brk;        // without a heap (a flat binary)
+    uint64_t brk_end;
+    uint64_t brk_top;    // The highest break so far: above it is all zeros
+    uint64_t mmap_start; // mmap() hands out the area [mmap_start, mmap_end)
+    uint64_t mmap_next;  // top down: everything from mmap_next up is in use
+    uint64_t mmap_end;   // but for GuestProcess::free_ranges
+};
+
+// What the Linux system calls keep of the program, which all its harts
+// share: the heap, and the files it opened. Guest fds 0, 1 and 2 are the
+// machine's console; each one above that is a host fd in files.
+struct GuestProcess {
+    GuestHeap heap = {};
+    // munmap()ed parts of the mmap() area below mmap_next, by base, with
+    // their sizes. They keep their host memory, and are zeroed when mmap()
+    // hands them out again.
+    map<uint64_t, uint64_t> free_ranges;
+    vector<int> files;   // Host fd of guest fd i + 3, or -1 for none
+    mutex lock;
+    // Set once a hart calls exit_group, which stops every hart. Harts look
+    // at it between blocks, and compiled code at the start of each block.
+    atomic<bool> exited{false};
+    int64_t exit_code = 0;   // exit_group's a0, once exited is set
+
+    // The first exit_group decides the status
+    void exit_group(int64_t code) {
+        lock_guard<mutex> hold(lock);
+        if (!exited.load()) {
+            exit_code = code;
+            exited.store(true);
+        }
+    }
+
+    ~GuestProcess() {
+        for (int fd : files) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+};
+
+// A checkpoint file (see Machine::save_checkpoint()) starts with this.
+// After it come num_regions CheckpointRegions, the base of each page it
+// holds (num_pages of them, in address order), and from pages_offset on
+// the pages themselves, in the same order.
+struct CheckpointHeader {
+    char magic[8];          // CHECKPOINT_MAGIC
+    uint64_t version;       // CHECKPOINT_VERSION
+    char parent[256];       // File name of the checkpoint this one adds to,
+                            // in the same directory, or "" for a full one
+    uint64_t num_regions;
+    uint64_t num_pages;
+    uint64_t pages_offset;  // A multiple of the page size
+    int64_t pc;
+    int64_t regs[NUM_REGS];
+    uint64_t satp;
+    uint64_t instret;
+    int64_t exit_code;
+    int64_t end_pc;         // Where the program stops (see load_program())
+    uint8_t halted;
+    uint8_t faulted;
+    GuestHeap heap;
+};
+// What a Machine has retired (see Machine::stats())
+struct MachineStats {
+    uint64_t kinds[NUM_INST_KINDS];          // Each kind of instruction
+    uint64_t taken[NUM_BRANCH_KINDS];        // Branches taken, BEQ first
+    uint64_t ecalls[NUM_ECALL_COUNTS + 1];   // ECALLs by a7, then any other a7
+
+    MachineStats() {
+        fill(kinds, kinds + NUM_INST_KINDS, 0);
+        fill(taken, taken + NUM_BRANCH_KINDS, 0);
+        fill(ecalls, ecalls + NUM_ECALL_COUNTS + 1, 0);
+    }
+    void count_ecall(int64_t a7) {
+        ecalls[(a7 >= 0 && a7 < NUM_ECALL_COUNTS) ? a7 : NUM_ECALL_COUNTS]++;
+    }
+    MachineStats &operator+=(const MachineStats &other) {
+        for (int i = 0; i < NUM_INST_KINDS; i++) {
+            kinds[i] += other.kinds[i];
+        }
+        for (int i = 0; i < NUM_BRANCH_KINDS; i++) {
+            taken[i] += other.taken[i];
+        }
+        for (int i = 0; i <= NUM_ECALL_COUNTS; i++) {
+            ecalls[i] += other.ecalls[i];
+        }
+        return *this;
+    }
+
+    // Print a summary: the total, the mix by OpcodeCategories and by
+    // instruction, branches taken and not, loads and stores by width, and
+    // ECALLs by number. Only what happened is listed.
+    void print(ostream &out) const {
+        uint64_t total = 0;
+        uint64_t categories[UNIMPL + 1] = {};
+        for (int i = 0; i < NUM_INST_KINDS; i++) {
+            total += kinds[i];
+            categories[ISA[i].op] += kinds[i];
+        }
+        auto line = [&](const string &name, uint64_t count, const char *note = nullptr) {
+            out << "  " << setw(12) << left << name << ' ' << setw(14) << right << count
+                << fixed << setprecision(2) << setw(8) << (total ? 100.0 * count / total : 0.0) << '%'
+                << (note ? "  " : "") << (note ? note : "") << '\n';
+        };
+        out << "Instructions retired: " << total << '\n';
+        out << "By category:\n";
+        for (int i = 0; i <= UNIMPL; i++) {
+            if (categories[i]) {
+                line(CATEGORY_NAMES[i], categories[i]);
+            }
+        }
+        out << "By instruction:\n";
+        for (int i = 0; i < NUM_INST_KINDS; i++) {
+            if (kinds[i]) {
+                line(ISA[i].name, kinds[i]);
+            }
+        }
+        out << "Branches:" << setw(20) << right << "taken" << setw(14) << "not taken" << '\n';
+        for (int i = 0; i < NUM_BRANCH_KINDS; i++) {
+            if (kinds[I_BEQ + i]) {
+                out << "  " << setw(12) << left << ISA[I_BEQ + i].name << ' ' << setw(14) << right
+                    << taken[i] << setw(14) << kinds[I_BEQ + i] - taken[i] << '\n';
+            }
+        }
+        // The funct3 cases of memory(), by the bytes they move
+        const InstKinds loads[4][2] = {
+            { I_LB, I_LBU }, { I_LH, I_LHU }, { I_LW, I_LWU }, { I_LD, I_LD }
+        };
+        const InstKinds stores[4] = { I_SB, I_SH, I_SW, I_SD };
+        out << "Memory by width:" << setw(13) << right << "loads" << setw(14) << "stores" << '\n';
+        for (int i = 0; i < 4; i++) {
+            uint64_t load_count = kinds[loads[i][0]] + (loads[i][1] != loads[i][0] ? kinds[loads[i][1]] : 0);
+            if (load_count || kinds[stores[i]]) {
+                out << "  " << setw(12) << left << (to_string(1 << i) + (i ? " bytes" : " byte")) << ' '
+                    << setw(14) << right << load_count << setw(14) << kinds[stores[i]] << '\n';
+            }
+        }
+        if (any_of(ecalls, ecalls + NUM_ECALL_COUNTS + 1, [](uint64_t count) { return count != 0; })) {
+            out << "ECALLs by a7:\n";
+            for (int i = 0; i < NUM_ECALL_COUNTS; i++) {
+                if (ecalls[i]) {
+                    line(to_string(i), ecalls[i], linux_syscall_name(i));
+                }
+            }
+            if (ecalls[NUM_ECALL_COUNTS]) {
+                line("other", ecalls[NUM_ECALL_COUNTS]);
+            }
+        }
+    }
+};
+
+// The registers inst reads. x0 is never a hazard, so it stands for none.
+void inst_sources(const DecodeOut &inst, int &rs1, int &rs2) {
+    rs1 = 0;
+    rs2 = 0;
+    switch (ISA[inst.kind].format) {
+    case FMT_R:
+    case FMT_S:
+    case FMT_B:
+    case FMT_AMO:
+        rs1 = inst.rs1;
+        rs2 = inst.rs2;
+    break;
+    case FMT_I:
+    case FMT_SHIFT:
+    case FMT_SHIFTW:
+        rs1 = inst.rs1;
+    break;
+    case FMT_SYSTEM:
+        // The immediate CSR forms have a constant where rs1 goes
+        if (inst.kind == I_CSRRW || inst.kind == I_CSRRS || inst.kind == I_CSRRC ||
+            inst.kind == I_SFENCE_VMA) {
+            rs1 = inst.rs1;
+            rs2 = inst.rs2;
+        }
+        else if (inst.kind == I_ECALL) {
+            rs1 = 17;
+            rs2 = 10;
+        }
+    break;
+    default:
+    break;
+    }
+}
+
+// An instruction in a latch of the PipelineModel: what each stage made of
+// it, as the stages worked it out when it ran
+struct PipeSlot {
+    uint64_t seq;        // Its place in program order
+    int64_t pc;
+    FetchOut fo;
+    DecodeOut dec;
+    ExecuteOut eo;
+    MemoryOut mo;
+    bool redirect;       // The instruction after it isn't at pc + 4
+};
+
+// Where a PipelineModel lost cycles
+enum PipeStalls {
+    STALL_LOAD_USE,      // A load's result was needed by the next instruction
+    STALL_BRANCH,        // Fetch slots flushed by a taken branch
+    STALL_JUMP,          // ... by a JAL or JALR
+    STALL_SERIALIZE,     // ... by an ECALL, CSR, FENCE.I or SFENCE.VMA
+    NUM_PIPE_STALLS
+};
+const char *const PIPE_STALL_NAMES[NUM_PIPE_STALLS] = {
+    "load-use", "branch flush", "jump flush", "serialize"
+};
+
+// Cycle timing of a classic in-order five-stage pipeline (IF, ID, EX, MEM,
+// WB). The instructions come from the stages in program order, already
+// run, and go through the four latches (IF/ID, ID/EX, EX/MEM, MEM/WB) a
+// clock at a time, with up to five in flight. Results are forwarded to EX
+// from EX/MEM and MEM/WB, so the only data hazard that stalls is a load
+// (or AMO) whose result the very next instruction needs: it waits a cycle
+// in ID. Fetch predicts every branch not taken. A JAL is resolved in ID, so
+// one fetch slot after it is flushed, and taken branches and JALR are
+// resolved in EX, which flushes two. Instructions that change how later
+// ones are fetched or run (ECALL, CSRs, FENCE.I, SFENCE.VMA) flush the same
+// way as JALR. Memory takes a cycle.
+class PipelineModel {
+    // The latches point into mSlots, which has room for every instruction
+    // in flight, or are nullptr for a bubble
+    PipeSlot mSlots[8];
+    const PipeSlot *mIfId;
+    const PipeSlot *mIdEx;
+    const PipeSlot *mExMem;
+    const PipeSlot *mMemWb;
+    // The instruction fetch is waiting on, and the stage (1 = ID, 2 = EX)
+    // that decides where to fetch after it
+    uint64_t mWaitSeq;
+    int mWaitStage;
+    PipeStalls mWaitReason;
+    bool mWaiting;
+    uint64_t mSeq;
+
+    uint64_t mCycles;
+    uint64_t mRetired;
+    uint64_t mStalls[NUM_PIPE_STALLS];
+    uint64_t mForwards[2];   // Operands forwarded from EX/MEM and from MEM/WB
+
+    static bool writes(const PipeSlot *slot, int reg) {
+        return slot && reg != 0 && slot->dec.rd == reg;
+    }
+    // Which stage the instruction seq is in now, with 5 for gone
+    int stage_of(uint64_t seq) const {
+        const PipeSlot *latches[4] = { mIfId, mIdEx, mExMem, mMemWb };
+        for (int i = 0; i < 4; i++) {
+            if (latches[i] && latches[i]->seq == seq) {
+                return i + 1;
+            }
+        }
+        return 5;
+    }
+
+    // One clock. next is the instruction IF would fetch (nullptr at the
+    // end). Returns true if it was fetched.
+    bool clock(const PipeSlot *next) {
+        mCycles++;
+        if (mMemWb) {
+            mRetired++;
+        }
+        // The instruction in EX takes its operands from the nearest latch
+        // that has them
+        int rs[2];
+        if (mIdEx) {
+            inst_sources(mIdEx->dec, rs[0], rs[1]);
+            for (int i = 0; i < 2; i++) {
+                if (writes(mExMem, rs[i])) {
+                    mForwards[0]++;
+                }
+                else if (writes(mMemWb, rs[i])) {
+                    mForwards[1]++;
+                }
+            }
+        }
+        // A load in EX has nothing to forward yet to the instruction in ID
+        bool load_use = false;
+        if (mIfId && mIdEx && (mIdEx->dec.op == LOAD || mIdEx->dec.op == AMO)) {
+            inst_sources(mIfId->dec, rs[0], rs[1]);
+            load_use = writes(mIdEx, rs[0]) || writes(mIdEx, rs[1]);
+        }
+        bool can_fetch = !mWaiting || stage_of(mWaitSeq) > mWaitStage;
+
+        mMemWb = mExMem;
+        mExMem = mIdEx;
+        if (load_use) {
+            mIdEx = nullptr;
+            mStalls[STALL_LOAD_USE]++;
+            return false;
+        }
+        mIdEx = mIfId;
+        if (!next || !can_fetch) {
+            mIfId = nullptr;
+            if (next) {
+                mStalls[mWaitReason]++;
+            }
+            return false;
+        }
+        PipeSlot &slot = mSlots[mSeq & 7];
+        slot = *next;
+        slot.seq = mSeq++;
+        mIfId = &slot;
+        mWaiting = false;
+        if (next->redirect || next->dec.op == SYSTEM || next->dec.op == MISC_MEM) {
+            mWaiting = true;
+            mWaitSeq = slot.seq;
+            mWaitStage = next->dec.op == JAL ? 1 : 2;
+            mWaitReason = next->dec.op == BRANCH ? STALL_BRANCH
+                        : (next->dec.op == JAL || next->dec.op == JALR) ? STALL_JUMP : STALL_SERIALIZE;
+            // FENCE only orders memory
+            if (next->dec.kind == I_FENCE) {
+                mWaiting = false;
+            }
+        }
+        return true;
+    }
+
+public:
+    PipelineModel() {
+        mIfId = mIdEx = mExMem = mMemWb = nullptr;
+        mWaiting = false;
+        mSeq = 0;
+        mCycles = 0;
+        mRetired = 0;
+        fill(mStalls, mStalls + NUM_PIPE_STALLS, 0);
+        mForwards[0] = mForwards[1] = 0;
+    }
+
+    // inst is the next instruction in program order: clock the pipeline
+    // until IF takes it
+    void fetch(const PipeSlot &inst) {
+        while (!clock(&inst)) {
+        }
+    }
+    // Clock the pipeline until the last instruction has left WB
+    void drain() {
+        while (mIfId || mIdEx || mExMem || mMemWb) {
+            clock(nullptr);
+        }
+    }
+
+    uint64_t cycles() const {
+        return mCycles;
+    }
+    uint64_t retired() const {
+        return mRetired;
+    }
+
+    // Print cycles, CPI and where the cycles beyond one per instruction
+    // went. drain() it first.
+    void print(ostream &out) const {
+        out << "Pipeline cycles:     " << mCycles << '\n'
+            << "Instructions:        " << mRetired << '\n'
+            << "CPI:                 " << fixed << setprecision(3)
+            << (mRetired ? static_cast<double>(mCycles) / mRetired : 0.0) << '\n'
+            << "Stall cycles:\n";
+        for (int i = 0; i < NUM_PIPE_STALLS; i++) {
+            out << "  " << setw(14) << left << PIPE_STALL_NAMES[i] << ' ' << setw(14) << right
+                << mStalls[i] << '\n';
+        }
+        // The cycles before the first instruction reaches WB and after the
+        // last one leaves IF
+        uint64_t stalled = accumulate(mStalls, mStalls + NUM_PIPE_STALLS, 0UL);
+        out << "  " << setw(14) << left << "fill/drain" << ' ' << setw(14) << right
+            << mCycles - mRetired - stalled << '\n'
+            << "Forwarded operands:\n"
+            << "  " << setw(14) << left << "from EX/MEM" << ' ' << setw(14) << right << mForwards[0] << '\n'
+            << "  " << setw(14) << left << "from MEM/WB" << ' ' << setw(14) << right << mForwards[1] << '\n';
+    }
+};
+
+// Guesses whether a conditional branch is taken, the way a front end must
+// before the branch is executed. predict() is always followed by update()
+// for the same branch, with what really happened.
+class BranchPredictor {
+public:
+    virtual ~BranchPredictor() {}
+    virtual const char *name() const = 0;
+    // Is the branch at pc, which goes to target when taken, taken?
+    virtual bool predict(uint64_t pc, uint64_t target) = 0;
+    virtual void update(uint64_t pc, bool taken) = 0;
+};
+
+// Backward taken, forward not taken: what a core with no tables does
+class StaticPredictor : public BranchPredictor {
+public:
+    const char *name() const override {
+        return "static";
+    }
+    bool predict(uint64_t pc, uint64_t target) override {
+        return target < pc;
+    }
+    void update(uint64_t, bool) override {
+    }
+};
+
+// A two-bit saturating counter, taken at 2 and 3
+inline void train_counter(uint8_t &counter, bool taken) {
+    if (taken && counter < 3) {
+        counter++;
+    }
+    else if (!taken && counter > 0) {
+        counter--;
+    }
+}
+
+// A table of two-bit counters indexed by PC
+class BimodalPredictor : public BranchPredictor {
+    static const int BITS = 12;
+    uint8_t mCounters[1 << BITS];
+
+    static int index(uint64_t pc) {
+        return (pc >> 2) & ((1 << BITS) - 1);
+    }
+
+public:
+    BimodalPredictor() {
+        fill(mCounters, mCounters + (1 << BITS), 1);
+    }
+    const char *name() const override {
+        return "bimodal";
+    }
+    bool predict(uint64_t pc, uint64_t) override {
+        return mCounters[index(pc)] >= 2;
+    }
+    void update(uint64_t pc, bool taken) override {
+        train_counter(mCounters[index(pc)], taken);
+    }
+};
+
+// Two-bit counters indexed by the PC xor the outcomes of the last BITS
+// branches
+class GsharePredictor : public BranchPredictor {
+    static const int BITS = 14;
+    uint8_t mCounters[1 << BITS];
+    uint64_t mHistory;
+
+    int index(uint64_t pc) const {
+        return ((pc >> 2) ^ mHistory) & ((1 << BITS) - 1);
+    }
+
+public:
+    GsharePredictor() : mHistory(0) {
+        fill(mCounters, mCounters + (1 << BITS), 1);
+    }
+    const char *name() const override {
+        return "gshare";
+    }
+    bool predict(uint64_t pc, uint64_t) override {
+        return mCounters[index(pc)] >= 2;
+    }
+    void update(uint64_t pc, bool taken) override {
+        train_counter(mCounters[index(pc)], taken);
+        mHistory = (mHistory << 1) | taken;
+    }
+};
+
+// A small TAGE: a bimodal base table and NUM_TABLES tagged tables, each
+// indexed and tagged by the PC hashed with a longer stretch of global
+// history (geometric lengths up to 64). The longest table whose tag
+// matches gives the prediction. After a mispredict an entry is claimed
+// in a longer table, one that wasn't useful lately.
+class TagePredictor : public BranchPredictor {
+    static const int NUM_TABLES = 4;
+    static const int BASE_BITS = 12;
+    static const int TABLE_BITS = 10;
+    static const int TAG_BITS = 9;
+    // How often the useful bits age
+    static const uint64_t AGE_PERIOD = 1 << 18;
+
+    struct Entry {
+        uint16_t tag;
+        int8_t counter;   // -4 to 3, taken if >= 0
+        uint8_t useful;   // 0 to 3
+    };
+    uint8_t mBase[1 << BASE_BITS];
+    Entry mTables[NUM_TABLES][1 << TABLE_BITS];
+    uint64_t mHistory;
+    uint64_t mBranches;
+    // Each table's stretch of history xored down to TABLE_BITS and
+    // TAG_BITS - 1 bits, kept up to date a bit at a time
+    uint32_t mFoldedIndex[NUM_TABLES];
+    uint32_t mFoldedTag[NUM_TABLES];
+
+    // What predict() found, for update()
+    int mIndex[NUM_TABLES];
+    uint16_t mTag[NUM_TABLES];
+    int mProvider;        // The table that predicted, or -1 for the base
+    bool mPrediction;
+    bool mAltPrediction;  // What the next shorter match would have said
+
+    static int history_length(int table) {
+        static const int LENGTHS[NUM_TABLES] = { 5, 12, 27, 60 };
+        return LENGTHS[table];
+    }
+    // Shift taken into folded, the last length outcomes xored down to
+    // bits bits, and drop the outcome that is now too old
+    void fold(uint32_t &folded, int length, int bits, bool taken) const {
+        uint32_t oldest = (mHistory >> (length - 1)) & 1;
+        folded = (folded << 1) | taken;
+        folded ^= oldest << (length % bits);
+        folded ^= folded >> bits;
+        folded &= (1 << bits) - 1;
+    }
+
+public:
+    TagePredictor() : mHistory(0), mBranches(0) {
+        fill(mBase, mBase + (1 << BASE_BITS), 1);
+        fill(mFoldedIndex, mFoldedIndex + NUM_TABLES, 0);
+        fill(mFoldedTag, mFoldedTag + NUM_TABLES, 0);
+        for (auto &table : mTables) {
+            fill(table, table + (1 << TABLE_BITS), Entry{ 0, 0, 0 });
+        }
+    }
+    const char *name() const override {
+        return "TAGE";
+    }
+    bool predict(uint64_t pc, uint64_t) override {
+        uint64_t address = pc >> 2;
+        mProvider = -1;
+        int alt = -1;
+        for (int i = 0; i < NUM_TABLES; i++) {
+            mIndex[i] = (address ^ (address >> TABLE_BITS) ^ mFoldedIndex[i]) & ((1 << TABLE_BITS) - 1);
+            mTag[i] = (address ^ (mFoldedTag[i] << 1)) & ((1 << TAG_BITS) - 1);
+            if (mTables[i][mIndex[i]].tag == mTag[i]) {
+                alt = mProvider;
+                mProvider = i;
+            }
+        }
+        bool base = mBase[address & ((1 << BASE_BITS) - 1)] >= 2;
+        mAltPrediction = alt >= 0 ? mTables[alt][mIndex[alt]].counter >= 0 : base;
+        mPrediction = mProvider >= 0 ? mTables[mProvider][mIndex[mProvider]].counter >= 0 : base;
+        return mPrediction;
+    }
+    void update(uint64_t pc, bool taken) override {
+        if (mProvider >= 0) {
+            Entry &entry = mTables[mProvider][mIndex[mProvider]];
+            if (mPrediction != mAltPrediction) {
+                if (mPrediction == taken && entry.useful < 3) {
+                    entry.useful++;
+                }
+                else if (mPrediction != taken && entry.useful > 0) {
+                    entry.useful--;
+                }
+            }
+            if (taken && entry.counter < 3) {
+                entry.counter++;
+            }
+            else if (!taken && entry.counter > -4) {
+                entry.counter--;
+            }
+        }
+        else {
+            train_counter(mBase[(pc >> 2) & ((1 << BASE_BITS) - 1)], taken);
+        }
+        // Claim an entry in a longer table, or make room for next time
+        if (mPrediction != taken && mProvider < NUM_TABLES - 1) {
+            bool claimed = false;
+            for (int i = mProvider + 1; i < NUM_TABLES && !claimed; i++) {
+                Entry &entry = mTables[i][mIndex[i]];
+                if (entry.useful == 0) {
+                    entry = Entry{ mTag[i], static_cast<int8_t>(taken ? 0 : -1), 0 };
+                    claimed = true;
+                }
+            }
+            for (int i = mProvider + 1; i < NUM_TABLES && !claimed; i++) {
+                mTables[i][mIndex[i]].useful--;
+            }
+        }
+        if (++mBranches % AGE_PERIOD == 0) {
+            for (auto &table : mTables) {
+                for (Entry &entry : table) {
+                    entry.useful >>= 1;
+                }
+            }
+        }
+        for (int i = 0; i < NUM_TABLES; i++) {
+            fold(mFoldedIndex[i], history_length(i), TABLE_BITS, taken);
+            fold(mFoldedTag[i], history_length(i), TAG_BITS - 1, taken);
+        }
+        mHistory = (mHistory << 1) | taken;
+    }
+};
+
+// Runs every BranchPredictor on the branches a Machine resolves, along
+// with a branch target buffer and a return address stack for the jumps,
+// and keeps count of how each did, in total and per branch PC.
+class BranchModel {
+    vector<unique_ptr<BranchPredictor>> mPredictors;
+
+    // Per branch PC
+    struct Site {
+        uint64_t executed;
+        uint64_t taken;
+        vector<uint64_t> mispredicts;   // By predictor
+    };
+    unordered_map<uint64_t, Site> mSites;
+    uint64_t mLastPc;     // Loops run the same branch over and over
+    Site *mLastSite;
+    vector<uint64_t> mMispredicts;      // By predictor
+    uint64_t mBranches;
+    uint64_t mTaken;
+
+    // Direct mapped branch target buffer, for the targets of taken
+    // branches and jumps
+    static const int BTB_BITS = 10;
+    struct BtbEntry {
+        uint64_t pc;
+        uint64_t target;
+    };
+    BtbEntry mBtb[1 << BTB_BITS];
+    uint64_t mJumps;
+    uint64_t mBtbMisses;
+    // Return address stack, a ring that overwrites its oldest entries
+    static const int RAS_SIZE = 16;
+    uint64_t mRas[RAS_SIZE];
+    int mRasTop;          // Entries pushed minus popped, at most RAS_SIZE
+    int mRasPos;
+    uint64_t mReturns;
+    uint64_t mRasMisses;
+
+    // Did the BTB know where the control transfer at pc goes? It does now.
+    bool btb_hit(uint64_t pc, uint64_t target) {
+        BtbEntry &entry = mBtb[(pc >> 2) & ((1 << BTB_BITS) - 1)];
+        bool hit = entry.pc == pc && entry.target == target;
+        entry.pc = pc;
+        entry.target = target;
+        return hit;
+    }
+
+public:
+    BranchModel() : mLastPc(~0UL), mLastSite(nullptr), mBranches(0), mTaken(0), mJumps(0), mBtbMisses(0),
+                    mRasTop(0), mRasPos(0), mReturns(0), mRasMisses(0) {
+        mPredictors.push_back(unique_ptr<BranchPredictor>(new StaticPredictor));
+        mPredictors.push_back(unique_ptr<BranchPredictor>(new BimodalPredictor));
+        mPredictors.push_back(unique_ptr<BranchPredictor>(new GsharePredictor));
+        mPredictors.push_back(unique_ptr<BranchPredictor>(new TagePredictor));
+        mMispredicts.assign(mPredictors.size(), 0);
+        fill(mBtb, mBtb + (1 << BTB_BITS), BtbEntry{ ~0UL, 0 });
+    }
+
+    // The conditional branch at pc to target was (taken) or wasn't taken.
+    // Returns whether the last predictor, and the BTB if it was taken, got
+    // it right.
+    bool branch(uint64_t pc, uint64_t target, bool taken) {
+        if (pc != mLastPc) {
+            mLastPc = pc;
+            mLastSite = &mSites[pc];
+            if (mLastSite->mispredicts.empty()) {
+                mLastSite->mispredicts.assign(mPredictors.size(), 0);
+            }
+        }
+        Site &site = *mLastSite;
+        site.executed++;
+        site.taken += taken;
+        mBranches++;
+        mTaken += taken;
+        bool right = true;
+        for (size_t i = 0; i < mPredictors.size(); i++) {
+            right = mPredictors[i]->predict(pc, target) == taken;
+            if (!right) {
+                mMispredicts[i]++;
+                site.mispredicts[i]++;
+            }
+            mPredictors[i]->update(pc, taken);
+        }
+        if (taken && !btb_hit(pc, target)) {
+            mBtbMisses++;
+            right = false;
+        }
+        return right;
+    }
+
+    // The JAL or JALR inst at pc went to target. Calls and returns are
+    // told apart by the RISC-V hints (see Machine::track_call()): a return
+    // is predicted by the RAS, and anything else by the BTB. Returns whether
+    // the prediction was right.
+    bool jump(uint64_t pc, const DecodeOut &inst, uint64_t target) {
+        bool link = inst.rd == 1 || inst.rd == 5;
+        bool through = inst.kind == I_JALR && (inst.rs1 == 1 || inst.rs1 == 5);
+        bool right = true;
+        mJumps++;
+        if (through && (!link || inst.rd != inst.rs1)) {
+            mReturns++;
+            if (mRasTop == 0 || mRas[(mRasPos + RAS_SIZE - 1) % RAS_SIZE] != target) {
+                mRasMisses++;
+                right = false;
+            }
+            if (mRasTop > 0) {
+                mRasTop--;
+                mRasPos = (mRasPos + RAS_SIZE - 1) % RAS_SIZE;
+            }
+        }
+        else if (!btb_hit(pc, target)) {
+            mBtbMisses++;
+            right = false;
+        }
+        if (link) {
+            mRas[mRasPos] = pc + 4;
+            mRasPos = (mRasPos + 1) % RAS_SIZE;
+            mRasTop = min(mRasTop + 1, RAS_SIZE);
+        }
+        return right;
+    }
+
+    // Print how each predictor did, with MPKI over instructions, and the
+    // branches the last (best) one got wrong most often, with the MPKI each
+    // predictor owes to each of them
+    void print(ostream &out, uint64_t instructions) const {
+        auto mpki = [&](uint64_t misses) {
+            return instructions ? 1000.0 * misses / instructions : 0.0;
+        };
+        out << "Branches: " << mBranches << " conditional (" << mTaken << " taken), "
+            << mJumps << " jumps (" << mReturns << " returns)\n"
+            << "  " << setw(12) << left << "predictor" << setw(14) << right << "mispredicts"
+            << setw(10) << "accuracy" << setw(10) << "MPKI" << '\n' << fixed << setprecision(3);
+        for (size_t i = 0; i < mPredictors.size(); i++) {
+            out << "  " << setw(12) << left << mPredictors[i]->name() << setw(14) << right << mMispredicts[i]
+                << setw(9) << (mBranches ? 100.0 - 100.0 * mMispredicts[i] / mBranches : 100.0) << '%'
+                << setw(10) << mpki(mMispredicts[i]) << '\n';
+        }
+        out << "  " << setw(12) << left << "BTB" << setw(14) << right << mBtbMisses << setw(10) << ""
+            << setw(10) << mpki(mBtbMisses) << '\n'
+            << "  " << setw(12) << left << "RAS" << setw(14) << right << mRasMisses << setw(10) << ""
+            << setw(10) << mpki(mRasMisses) << '\n';
+
+        vector<pair<uint64_t, const Site *>> worst;
+        for (auto &site : mSites) {
+            if (site.second.mispredicts.back()) {
+                worst.push_back(make_pair(site.first, &site.second));
+            }
+        }
+        sort(worst.begin(), worst.end(), [](const pair<uint64_t, const Site *> &a,
+                                            const pair<uint64_t, const Site *> &b) {
+            return a.second->mispredicts.back() > b.second->mispredicts.back() ||
+                   (a.second->mispredicts.back() == b.second->mispredicts.back() && a.first < b.first);
+        });
+        if (worst.size() > MAX_WORST_BRANCHES) {
+            worst.resize(MAX_WORST_BRANCHES);
+        }
+        if (worst.empty()) {
+            return;
+        }
+        out << "Most mispredicted branches, by " << mPredictors.back()->name() << " (MPKI):\n"
+            << "  " << setw(18) << left << "pc" << setw(12) << right << "executed" << setw(12) << "taken";
+        for (auto &predictor : mPredictors) {
+            out << setw(10) << predictor->name();
+        }
+        out << '\n';
+        for (auto &site : worst) {
+            ostringstream pc;
+            pc << "0x" << hex << site.first;
+            out << "  " << setw(18) << left << pc.str() << setw(12) << right << site.second->executed
+                << setw(12) << site.second->taken;
+            for (uint64_t misses : site.second->mispredicts) {
+                out << setw(10) << mpki(misses);
+            }
+            out << '\n';
+        }
+    }
+    static const size_t MAX_WORST_BRANCHES = 20;
+};
+
+enum ReplacementPolicy {
+    REPLACE_LRU,
+    REPLACE_FIFO,
+    REPLACE_RANDOM
+};
+
+enum WritePolicy {
+    WRITE_BACK,     // Writes allocate a line and mark it dirty
+    WRITE_THROUGH   // Writes go on to the next level and don't allocate
+};
+
+// The shape of one level of cache
+struct CacheConfig {
+    uint64_t size;          // Bytes
+    int ways;
+    int line;               // Bytes, a power of two
+    ReplacementPolicy replacement;
+    WritePolicy write;
+    int latency;            // Cycles a hit takes
+};
+
+// Parse SIZE[:WAYS[:LINE[:lru|fifo|random[:wb|wt[:LATENCY]]]]] into config,
+// leaving out the fields that aren't given. SIZE can end in K or M. The
+// number of sets has to come out a power of two.
+bool parse_cache_config(const string &text, CacheConfig &config) {
+    const char *p = text.c_str();
+    char *end;
+    config.size = strtoull(p, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        config.size <<= 10;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm') {
+        config.size <<= 20;
+        end++;
+    }
+    vector<string> fields;
+    for (p = end; *p == ':'; ) {
+        const char *next = strchr(p + 1, ':');
+        fields.push_back(string(p + 1, next ? next : p + strlen(p)));
+        p = next ? next : p + strlen(p);
+    }
+    if (*p || fields.size() > 5) {
+        return false;
+    }
+    if (fields.size() > 0) {
+        config.ways = atoi(fields[0].c_str());
+    }
+    if (fields.size() > 1) {
+        config.line = atoi(fields[1].c_str());
+    }
+    if (fields.size() > 2) {
+        if (fields[2] == "lru") {
+            config.replacement = REPLACE_LRU;
+        }
+        else if (fields[2] == "fifo") {
+            config.replacement = REPLACE_FIFO;
+        }
+        else if (fields[2] == "random") {
+            config.replacement = REPLACE_RANDOM;
+        }
+        else {
+            return false;
+        }
+    }
+    if (fields.size() > 3) {
+        if (fields[3] != "wb" && fields[3] != "wt") {
+            return false;
+        }
+        config.write = fields[3] == "wb" ? WRITE_BACK : WRITE_THROUGH;
+    }
+    if (fields.size() > 4) {
+        config.latency = atoi(fields[4].c_str());
+    }
+    if (config.ways < 1 || config.line < 4 || (config.line & (config.line - 1)) ||
+        config.size % (static_cast<uint64_t>(config.ways) * config.line)) {
+        return false;
+    }
+    uint64_t sets = config.size / config.ways / config.line;
+    return sets > 0 && (sets & (sets - 1)) == 0 && config.latency >= 0;
+}
+
+// What one level of cache saw
+struct CacheCounts {
+    uint64_t reads;
+    uint64_t read_misses;
+    uint64_t writes;
+    uint64_t write_misses;
+    uint64_t writebacks;    // Dirty lines pushed out
+};
+
+// One set associative level of cache. It only keeps tags, the data stays
+// in guest memory. The ways of a set sit next to each other, tags in one
+// array and replacement stamps in another, so a lookup of an 8 way set
+// reads one host cache line of tags.
+class Cache {
+    CacheConfig mConfig;
+    int mLineBits;
+    uint64_t mSetMask;
+    // Line number << 1 | dirty, or INVALID, whose line number no address has
+    vector<uint64_t> mTags;
+    vector<uint32_t> mStamps;   // When each way was last used (LRU) or filled (FIFO)
+    uint32_t mClock;
+    uint64_t mRandom;           // xorshift state for REPLACE_RANDOM
+    // The way that hit last. Fetches and most loads and stores go to the
+    // same line as the access before them, so it is checked first.
+    size_t mLastWay;
+    CacheCounts mCounts;
+
+    static constexpr uint64_t INVALID = ~0UL;
+
+public:
+    static constexpr uint64_t NO_LINE = ~0UL;
+
+    explicit Cache(const CacheConfig &config) : mConfig(config), mClock(0), mRandom(0x9e3779b97f4a7c15UL),
+                                                mLastWay(0) {
+        mLineBits = __builtin_ctz(config.line);
+        uint64_t sets = config.size / config.ways / config.line;
+        mSetMask = sets - 1;
+        mTags.assign(sets * config.ways, INVALID);
+        mStamps.assign(sets * config.ways, 0);
+        memset(&mCounts, 0, sizeof(mCounts));
+    }
+    const CacheConfig &config() const {
+        return mConfig;
+    }
+    const CacheCounts &counts() const {
+        return mCounts;
+    }
+    // The first byte of the line addr is in
+    uint64_t line_of(uint64_t addr) const {
+        return addr >> mLineBits << mLineBits;
+    }
+
+    // Read or write the line holding addr. Returns whether it was here. A
+    // miss brings the line in, unless it's a write that doesn't allocate,
+    // and evicted gets the address of a dirty line that made room for it
+    // (or NO_LINE).
+    bool access(uint64_t addr, bool write, uint64_t &evicted) {
+        uint64_t line = addr >> mLineBits;
+        bool dirty = write && mConfig.write == WRITE_BACK;
+        evicted = NO_LINE;
+        (write ? mCounts.writes : mCounts.reads)++;
+        mClock++;
+        if ((mTags[mLastWay] >> 1) == line) {
+            mTags[mLastWay] |= dirty;
+            if (mConfig.replacement == REPLACE_LRU) {
+                mStamps[mLastWay] = mClock;
+            }
+            return true;
+        }
+        return access_set(line, write, dirty, evicted);
+    }
+
+private:
+    // access() when the line isn't in the last way that hit
+    bool access_set(uint64_t line, bool write, bool dirty, uint64_t &evicted) {
+        size_t set = (line & mSetMask) * mConfig.ways;
+        uint64_t *tags = &mTags[set];
+        uint32_t *stamps = &mStamps[set];
+        for (int way = 0; way < mConfig.ways; way++) {
+            if ((tags[way] >> 1) == line) {
+                tags[way] |= dirty;
+                if (mConfig.replacement == REPLACE_LRU) {
+                    stamps[way] = mClock;
+                }
+                mLastWay = set + way;
+                return true;
+            }
+        }
+        (write ? mCounts.write_misses : mCounts.read_misses)++;
+        if (write && mConfig.write == WRITE_THROUGH) {
+            return false;
+        }
+        // An empty way, or else the oldest (or a random one)
+        int victim = 0;
+        for (int way = 0; way < mConfig.ways; way++) {
+            if (tags[way] == INVALID) {
+                victim = way;
+                break;
+            }
+            if (mConfig.replacement == REPLACE_RANDOM) {
+                mRandom ^= mRandom << 13;
+                mRandom ^= mRandom >> 7;
+                mRandom ^= mRandom << 17;
+                victim = mRandom % mConfig.ways;
+            }
+            // Stamps wrap, so compare how long ago each was
+            else if (mClock - stamps[way] > mClock - stamps[victim]) {
+                victim = way;
+            }
+        }
+        if (tags[victim] != INVALID && (tags[victim] & 1)) {
+            evicted = (tags[victim] >> 1) << mLineBits;
+            mCounts.writebacks++;
+        }
+        tags[victim] = line << 1 | dirty;
+        stamps[victim] = mClock;
+        mLastWay = set + victim;
+        return false;
+    }
+
+public:
+    // Describe the configuration, e.g. "32 KiB, 8 ways, 64 B lines, LRU,
+    // write-back, 1 cycle"
+    string describe() const {
+        static const char *REPLACEMENT_NAMES[] = { "LRU", "FIFO", "random" };
+        ostringstream out;
+        if (mConfig.size % (1 << 20) == 0) {
+            out << (mConfig.size >> 20) << " MiB";
+        }
+        else {
+            out << (mConfig.size >> 10) << " KiB";
+        }
+        out << ", " << mConfig.ways << (mConfig.ways == 1 ? " way, " : " ways, ") << mConfig.line << " B lines, "
+            << REPLACEMENT_NAMES[mConfig.replacement] << ", "
+            << (mConfig.write == WRITE_BACK ? "write-back" : "write-through") << ", "
+            << mConfig.latency << (mConfig.latency == 1 ? " cycle" : " cycles");
+        return out.str();
+    }
+};
+
+// The loads and stores memory() can do, as the CacheModel counts them:
+// loads by funct3, stores by 8 + funct3, and AMOs
+const int NUM_MEMORY_OPS = 13;
+const char *const MEMORY_OP_NAMES[NUM_MEMORY_OPS] = {
+    "LB", "LH", "LW", "LD", "LBU", "LHU", "LWU", "",
+    "SB", "SH", "SW", "SD", "AMO"
+};
+
+// Split L1 instruction and data caches in front of a shared L2 and memory
+// that takes a fixed number of cycles. Machine::fetch() and memory() hand
+// it every fetch and data access, by guest virtual address, and it keeps
+// count of the hits and misses of each level, of each PC, and of each kind
+// of load and store.
+class CacheModel {
+    Cache mL1i;
+    Cache mL1d;
+    Cache mL2;
+    int mMemoryLatency;
+    uint64_t mMemoryReads;
+    uint64_t mMemoryWrites;
+    uint64_t mFetchCycles;
+    uint64_t mDataCycles;
+
+    // Per PC, or per kind of access
+    struct Site {
+        uint64_t accesses;
+        uint64_t misses[2];     // In L1, in L2
+    };
+    // The Sites of each PC, with the ones used lately found by a direct
+    // mapped lookup in front of the hash table
+    struct SiteTable {
+        static const int RECENT_SIZE = 1024;
+        unordered_map<uint64_t, Site> sites;
+        uint64_t recent_pcs[RECENT_SIZE];
+        Site *recent[RECENT_SIZE];
+
+        SiteTable() {
+            fill(recent_pcs, recent_pcs + RECENT_SIZE, ~0UL);
+        }
+        Site &operator[](uint64_t pc) {
+            int slot = (pc >> 2) & (RECENT_SIZE - 1);
+            if (recent_pcs[slot] != pc) {
+                recent_pcs[slot] = pc;
+                recent[slot] = &sites[pc];
+            }
+            return *recent[slot];
+        }
+    };
+    SiteTable mFetchSites;
+    SiteTable mDataSites;
+    Site mKinds[NUM_MEMORY_OPS];
+
+    // Send a dirty line l1 evicted to L2
+    void write_back(uint64_t addr) {
+        uint64_t evicted;
+        if (!mL2.access(addr, true, evicted) || mL2.config().write == WRITE_THROUGH) {
+            mMemoryWrites++;
+        }
+        if (evicted != Cache::NO_LINE) {
+            mMemoryWrites++;
+        }
+    }
+
+    // Look addr up through l1, L2 and memory and add the cycles it takes.
+    // Returns where it was found: 0 for L1, 1 for L2 and 2 for memory.
+    // Writes through l1 are buffered, so only an L1 miss costs time.
+    int lookup(Cache &l1, uint64_t addr, bool write, uint64_t &cycles) {
+        uint64_t evicted;
+        cycles += l1.config().latency;
+        bool hit = l1.access(addr, write, evicted);
+        if (evicted != Cache::NO_LINE) {
+            write_back(evicted);
+        }
+        bool through = write && l1.config().write == WRITE_THROUGH;
+        if (hit && !through) {
+            return 0;
+        }
+        // L1 wants the line, or passes the write on
+        bool l2_hit = mL2.access(addr, through, evicted);
+        if (evicted != Cache::NO_LINE) {
+            mMemoryWrites++;
+        }
+        if (through && (!l2_hit || mL2.config().write == WRITE_THROUGH)) {
+            mMemoryWrites++;
+        }
+        else if (!l2_hit) {
+            mMemoryReads++;
+        }
+        if (hit) {
+            return 0;
+        }
+        cycles += mL2.config().latency;
+        if (l2_hit) {
+            return 1;
+        }
+        cycles += mMemoryLatency;
+        return 2;
+    }
+
+    static void count(Site &site, int level) {
+        site.accesses++;
+        site.misses[0] += level > 0;
+        site.misses[1] += level > 1;
+    }
+
+    static void print_sites(ostream &out, const char *title, const SiteTable &table) {
+        vector<pair<uint64_t, const Site *>> worst;
+        for (auto &site : table.sites) {
+            if (site.second.misses[0]) {
+                worst.push_back(make_pair(site.first, &site.second));
+            }
+        }
+        sort(worst.begin(), worst.end(), [](const pair<uint64_t, const Site *> &a,
+                                            const pair<uint64_t, const Site *> &b) {
+            return a.second->misses[0] > b.second->misses[0] ||
+                   (a.second->misses[0] == b.second->misses[0] && a.first < b.first);
+        });
+        if (worst.size() > MAX_WORST_SITES) {
+            worst.resize(MAX_WORST_SITES);
+        }
+        if (worst.empty()) {
+            return;
+        }
+        out << title << ":\n"
+            << "  " << setw(18) << left << "pc" << setw(12) << right << "accesses"
+            << setw(12) << "L1 misses" << setw(12) << "L2 misses" << '\n';
+        for (auto &site : worst) {
+            ostringstream pc;
+            pc << "0x" << hex << site.first;
+            out << "  " << setw(18) << left << pc.str() << setw(12) << right << site.second->accesses
+                << setw(12) << site.second->misses[0] << setw(12) << site.second->misses[1] << '\n';
+        }
+    }
+
+public:
+    static const size_t MAX_WORST_SITES = 20;
+
+    CacheModel(const CacheConfig &l1i, const CacheConfig &l1d, const CacheConfig &l2, int memory_latency)
+        : mL1i(l1i), mL1d(l1d), mL2(l2), mMemoryLatency(memory_latency),
+          mMemoryReads(0), mMemoryWrites(0), mFetchCycles(0), mDataCycles(0) {
+        memset(mKinds, 0, sizeof(mKinds));
+    }
+
+    // The instruction at pc was fetched
+    void fetch(uint64_t pc) {
+        count(mFetchSites[pc], lookup(mL1i, pc, false, mFetchCycles));
+    }
+
+    // The load or store at pc, of kind (see MEMORY_OP_NAMES), read or
+    // wrote size bytes at addr. An access that straddles two lines looks
+    // both up, and counts as missed if either missed.
+    void data(uint64_t pc, uint64_t addr, int size, bool write, int kind) {
+        int level = lookup(mL1d, addr, write, mDataCycles);
+        if (mL1d.line_of(addr) != mL1d.line_of(addr + size - 1)) {
+            level = max(level, lookup(mL1d, addr + size - 1, write, mDataCycles));
+        }
+        count(mDataSites[pc], level);
+        count(mKinds[kind], level);
+    }
+
+    // Print the configuration, the hits and misses of each level, the
+    // misses of each kind of access, and the PCs that missed most
+    void print(ostream &out) const {
+        const Cache *levels[] = { &mL1i, &mL1d, &mL2 };
+        const char *names[] = { "L1I", "L1D", "L2" };
+        out << "Caches:\n";
+        for (int i = 0; i < 3; i++) {
+            out << "  " << setw(8) << left << names[i] << levels[i]->describe() << '\n';
+        }
+        out << "  " << setw(8) << left << "memory" << mMemoryLatency << " cycles\n"
+            << "  " << setw(8) << left << "level" << setw(14) << right << "reads" << setw(12) << "misses"
+            << setw(14) << "writes" << setw(12) << "misses" << setw(11) << "miss rate" << setw(12) << "writebacks"
+            << '\n' << fixed << setprecision(2);
+        for (int i = 0; i < 3; i++) {
+            const CacheCounts &counts = levels[i]->counts();
+            uint64_t accesses = counts.reads + counts.writes;
+            uint64_t misses = counts.read_misses + counts.write_misses;
+            out << "  " << setw(8) << left << names[i] << setw(14) << right << counts.reads
+                << setw(12) << counts.read_misses << setw(14) << counts.writes << setw(12) << counts.write_misses
+                << setw(10) << (accesses ? 100.0 * misses / accesses : 0.0) << '%'
+                << setw(12) << counts.writebacks << '\n';
+        }
+        out << "  " << setw(8) << left << "memory" << setw(14) << right << mMemoryReads << setw(12) << ""
+            << setw(14) << mMemoryWrites << '\n';
+        uint64_t fetches = mL1i.counts().reads;
+        uint64_t accesses = 0;
+        for (const Site &kind : mKinds) {
+            accesses += kind.accesses;
+        }
+        out << "Average fetch time:  " << (fetches ? 1.0 * mFetchCycles / fetches : 0.0) << " cycles\n"
+            << "Average access time: " << (accesses ? 1.0 * mDataCycles / accesses : 0.0) << " cycles\n"
+            << "Loads and stores:\n"
+            << "  " << setw(8) << left << "kind" << setw(14) << right << "accesses"
+            << setw(12) << "L1 misses" << setw(12) << "L2 misses" << '\n';
+        for (int i = 0; i < NUM_MEMORY_OPS; i++) {
+            if (mKinds[i].accesses) {
+                out << "  " << setw(8) << left << MEMORY_OP_NAMES[i] << setw(14) << right << mKinds[i].accesses
+                    << setw(12) << mKinds[i].misses[0] << setw(12) << mKinds[i].misses[1] << '\n';
+            }
+        }
+        print_sites(out, "Loads and stores that missed most", mDataSites);
+        print_sites(out, "Fetches that missed most", mFetchSites);
+    }
+};
+
+const int NUM_ALU_COMMANDS = ALU_NOT + 1;
+const char *const ALU_COMMAND_NAMES[NUM_ALU_COMMANDS] = {
+    "add", "sub", "mul", "div", "rem", "sll", "srl", "sra", "and", "or", "xor", "not"
+};
+
+// The shape of an OutOfOrderModel core
+struct OutOfOrderConfig {
+    int width;          // Instructions fetched, renamed and committed a cycle
+    int issue_width;    // Instructions sent to the functional units a cycle
+    int rob_size;       // Reorder buffer entries
+    int iq_size;        // Issue queue entries
+    int lsq_size;       // Load/store queue entries
+    int phys_regs;      // Physical registers, 32 of them for the committed state
+    int frontend;       // Cycles from fetch to rename, and so a redirect's cost
+    int load_latency;   // Cycles from issuing a load to its result
+    int latency[NUM_ALU_COMMANDS];  // Cycles from issue to result, by AluCommands
+};
+const OutOfOrderConfig DEFAULT_OOO_CONFIG = {
+    4, 4, 128, 64, 48, 160, 5, 3,
+    { 1, 1, 3, 20, 20, 1, 1, 1, 1, 1, 1, 1 }
+};
+
+// Parse KEY=N[,KEY=N...] into config. The keys are width, issue, rob, iq,
+// lsq, regs, frontend and load, and the latency of each ALU_COMMAND_NAMES.
+bool parse_ooo_config(const string &text, OutOfOrderConfig &config) {
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find(',', start);
+        if (end == string::npos) {
+            end = text.size();
+        }
+        string field = text.substr(start, end - start);
+        size_t equals = field.find('=');
+        if (equals == string::npos) {
+            return false;
+        }
+        string key = field.substr(0, equals);
+        int value = atoi(field.c_str() + equals + 1);
+        if (value < 1) {
+            return false;
+        }
+        int *target = key == "width" ? &config.width : key == "issue" ? &config.issue_width
+                    : key == "rob" ? &config.rob_size : key == "iq" ? &config.iq_size
+                    : key == "lsq" ? &config.lsq_size : key == "regs" ? &config.phys_regs
+                    : key == "frontend" ? &config.frontend : key == "load" ? &config.load_latency : nullptr;
+        for (int i = 0; i < NUM_ALU_COMMANDS && !target; i++) {
+            if (key == ALU_COMMAND_NAMES[i]) {
+                target = &config.latency[i];
+            }
+        }
+        if (!target) {
+            return false;
+        }
+        *target = value;
+        start = end + 1;
+    }
+    return config.phys_regs > NUM_REGS;
+}
+
+// Why an OutOfOrderModel renamed fewer instructions than it could in a cycle
+enum DispatchStalls {
+    DISPATCH_FRONTEND,      // Nothing fetched yet (fill, taken jumps)
+    DISPATCH_MISPREDICT,    // Fetch was waiting on a mispredicted branch
+    DISPATCH_ROB_FULL,
+    DISPATCH_IQ_FULL,
+    DISPATCH_LSQ_FULL,
+    DISPATCH_NO_REGS,       // No free physical register for rd
+    DISPATCH_SERIALIZE,     // Waiting for an ECALL, CSR, FENCE.I or SFENCE.VMA
+    NUM_DISPATCH_STALLS
+};
+const char *const DISPATCH_STALL_NAMES[NUM_DISPATCH_STALLS] = {
+    "front end", "mispredict", "ROB full", "IQ full", "LSQ full", "no registers", "serialize"
+};
+
+// Cycle timing of an out-of-order superscalar core. Like PipelineModel it
+// is handed each instruction the stages retire, in program order and
+// already run, so it knows every branch outcome and address; it works out
+// when the instruction would have run.
+//
+// Fetch takes width instructions a cycle, up to the first taken branch or
+// jump. After frontend cycles they are renamed, width a cycle, onto the
+// physical registers, and go into the reorder buffer and the issue queue
+// (and the load/store queue). Each cycle up to issue_width instructions
+// whose operands are ready issue from the issue queue, oldest first. Each
+// takes the latency of its AluCommands entry, or load_latency; DIV and REM
+// share one divider that isn't pipelined. A load waits for an older store
+// to the same bytes to issue, then takes its data, and loads and stores
+// that don't overlap pass each other freely. Up to width finished
+// instructions commit a cycle from the head of the reorder buffer, which
+// frees the physical register their rd had before. Branches are predicted
+// by a BranchModel (its TAGE, BTB and RAS). Fetch stops after a
+// mispredicted one until it has run. ECALL, CSRs, FENCE.I and SFENCE.VMA
+// are renamed alone, once the reorder buffer is empty.
+class OutOfOrderModel {
+    struct Entry {
+        uint64_t seq;
+        uint64_t fetched;       // Cycle it was fetched
+        uint64_t done;          // Cycle its result is ready, once issued
+        int src[2];             // Registers read: architectural until renamed,
+                                // then physical, -1 for none
+        int dest;               // Register rd is renamed to, or -1
+        int prev;               // The register rd had before, freed at commit
+        uint8_t rd;
+        AluCommands cmd;
+        uint64_t addr;
+        int size;
+        bool load;
+        bool store;
+        bool serialize;
+        bool mispredicted;
+        bool issued;
+    };
+    static const uint64_t NOT_YET = ~0UL;
+
+    OutOfOrderConfig mConfig;
+    BranchModel mPredictor;
+
+    // Fetched, waiting to be renamed
+    vector<Entry> mFetchQueue;
+    size_t mFetchHead;
+    size_t mFetchCount;
+    int mFetchedThisCycle;
+    bool mFetchStopped;         // A taken branch or jump ended this cycle's fetch
+    uint64_t mFetchResume;      // Cycle fetch can go on after a mispredict
+    uint64_t mRecoverSeq;       // The instruction after the last mispredict
+
+    // Rename state
+    int mMap[NUM_REGS];         // Physical register of each xN
+    vector<int> mFree;
+    vector<uint64_t> mReady;    // Cycle each physical register is written
+
+    vector<Entry> mRob;
+    size_t mRobHead;
+    size_t mRobCount;
+    vector<size_t> mIssueQueue; // ROB indices, oldest first
+    deque<size_t> mStores;      // ROB indices of the stores, oldest first
+    int mLsqCount;
+    bool mSerializing;          // A serializing instruction is in the ROB
+    uint64_t mDividerFree;      // Cycle the divider takes its next op
+
+    uint64_t mCycle;
+    uint64_t mSeq;
+    uint64_t mCommitted;
+    uint64_t mMispredicts;
+    uint64_t mForwards;         // Loads that took their data from a store
+    uint64_t mStalls[NUM_DISPATCH_STALLS];  // Rename slots lost
+
+    bool is_divide(AluCommands cmd) const {
+        return cmd == ALU_DIV || cmd == ALU_REM;
+    }
+
+    void commit() {
+        for (int n = 0; n < mConfig.width && mRobCount; n++) {
+            Entry &entry = mRob[mRobHead];
+            if (!entry.issued || entry.done > mCycle) {
+                break;
+            }
+            if (entry.prev >= 0) {
+                mFree.push_back(entry.prev);
+            }
+            if (entry.load || entry.store) {
+                mLsqCount--;
+            }
+            if (entry.store) {
+                mStores.pop_front();
+            }
+            if (entry.serialize) {
+                mSerializing = false;
+            }
+            mRobHead = (mRobHead + 1) % mRob.size();
+            mRobCount--;
+            mCommitted++;
+        }
+    }
+
+    // Can the entry at ROB index at issue this cycle? forwarded is set if
+    // it is a load taking its data from a store.
+    bool ready(size_t at, bool &forwarded) {
+        const Entry &entry = mRob[at];
+        forwarded = false;
+        for (int src : entry.src) {
+            if (src >= 0 && mReady[src] > mCycle) {
+                return false;
+            }
+        }
+        if (is_divide(entry.cmd) && !entry.load && !entry.store && mDividerFree > mCycle) {
+            return false;
+        }
+        if (!entry.load) {
+            return true;
+        }
+        // The youngest older store that overlaps decides
+        for (auto i = mStores.rbegin(); i != mStores.rend(); ++i) {
+            const Entry &older = mRob[*i];
+            if (older.seq < entry.seq && older.addr < entry.addr + entry.size &&
+                entry.addr < older.addr + older.size) {
+                forwarded = true;
+                return older.issued && older.done <= mCycle;
+            }
+        }
+        return true;
+    }
+
+    void issue() {
+        int issued = 0;
+        size_t kept = 0;
+        for (size_t at : mIssueQueue) {
+            Entry &entry = mRob[at];
+            bool forwarded;
+            if (issued == mConfig.issue_width || !ready(at, forwarded)) {
+                mIssueQueue[kept++] = at;
+                continue;
+            }
+            int latency = entry.load ? mConfig.load_latency : entry.store ? 1 : mConfig.latency[entry.cmd];
+            entry.issued = true;
+            entry.done = mCycle + latency;
+            if (entry.dest >= 0) {
+                mReady[entry.dest] = entry.done;
+            }
+            if (is_divide(entry.cmd) && !entry.load && !entry.store) {
+                mDividerFree = entry.done;
+            }
+            if (entry.mispredicted) {
+                mFetchResume = entry.done;
+            }
+            mForwards += forwarded;
+            issued++;
+        }
+        mIssueQueue.resize(kept);
+    }
+
+    // Rename up to width instructions into the ROB, and count the slots
+    // left empty against whatever stopped the first one that couldn't go
+    void dispatch() {
+        int n = 0;
+        DispatchStalls why = NUM_DISPATCH_STALLS;
+        for (; n < mConfig.width; n++) {
+            Entry &entry = mFetchQueue[mFetchHead];
+            if (!mFetchCount || entry.fetched + mConfig.frontend > mCycle) {
+                why = mRecoverSeq != NOT_YET ? DISPATCH_MISPREDICT : DISPATCH_FRONTEND;
+                break;
+            }
+            if (mSerializing || (entry.serialize && mRobCount)) {
+                why = DISPATCH_SERIALIZE;
+                break;
+            }
+            if (mRobCount == mRob.size()) {
+                why = DISPATCH_ROB_FULL;
+                break;
+            }
+            if (mIssueQueue.size() == static_cast<size_t>(mConfig.iq_size)) {
+                why = DISPATCH_IQ_FULL;
+                break;
+            }
+            if ((entry.load || entry.store) && mLsqCount == mConfig.lsq_size) {
+                why = DISPATCH_LSQ_FULL;
+                break;
+            }
+            if (entry.rd && mFree.empty()) {
+                why = DISPATCH_NO_REGS;
+                break;
+            }
+            for (int &src : entry.src) {
+                src = src ? mMap[src] : -1;
+            }
+            entry.dest = -1;
+            entry.prev = -1;
+            if (entry.rd) {
+                entry.prev = mMap[entry.rd];
+                entry.dest = mFree.back();
+                mFree.pop_back();
+                mMap[entry.rd] = entry.dest;
+                mReady[entry.dest] = NOT_YET;
+            }
+            if (entry.seq == mRecoverSeq) {
+                mRecoverSeq = NOT_YET;
+            }
+            size_t at = (mRobHead + mRobCount++) % mRob.size();
+            mRob[at] = entry;
+            mIssueQueue.push_back(at);
+            if (entry.store) {
+                mStores.push_back(at);
+            }
+            mLsqCount += entry.load || entry.store;
+            mSerializing |= entry.serialize;
+            mFetchHead = (mFetchHead + 1) % mFetchQueue.size();
+            mFetchCount--;
+        }
+        if (n < mConfig.width) {
+            mStalls[why] += mConfig.width - n;
+        }
+    }
+
+    void clock() {
+        commit();
+        issue();
+        dispatch();
+        mCycle++;
+        mFetchedThisCycle = 0;
+        mFetchStopped = false;
+    }
+
+    // Fetch inst this cycle if the front end can
+    bool try_fetch(const PipeSlot &inst) {
+        if (mFetchedThisCycle == mConfig.width || mFetchStopped || mCycle < mFetchResume ||
+            mFetchCount == mFetchQueue.size()) {
+            return false;
+        }
+        Entry &entry = mFetchQueue[(mFetchHead + mFetchCount++) % mFetchQueue.size()];
+        const DecodeOut &dec = inst.dec;
+        entry.seq = mSeq++;
+        entry.fetched = mCycle;
+        inst_sources(dec, entry.src[0], entry.src[1]);
+        entry.rd = dec.rd;
+        entry.cmd = dec.cmd;
+        entry.addr = inst.eo.result;
+        entry.size = 1 << (dec.funct3 & 3);
+        entry.load = dec.op == LOAD || dec.op == AMO;
+        entry.store = dec.op == STORE || dec.op == AMO;
+        entry.serialize = dec.op == SYSTEM || (dec.op == MISC_MEM && dec.kind != I_FENCE);
+        entry.issued = false;
+        entry.mispredicted = false;
+        if (dec.op == BRANCH) {
+            entry.mispredicted = !mPredictor.branch(inst.pc, inst.pc + dec.imm, inst.eo.taken);
+        }
+        else if (dec.op == JAL || dec.op == JALR) {
+            // JAL's target is known once it's decoded
+            entry.mispredicted = !mPredictor.jump(inst.pc, dec, inst.eo.result) && dec.op == JALR;
+        }
+        mFetchedThisCycle++;
+        mFetchStopped = inst.redirect;
+        if (entry.mispredicted) {
+            mMispredicts++;
+            mFetchResume = NOT_YET;
+            mRecoverSeq = entry.seq + 1;
+        }
+        return true;
+    }
+
+public:
+    explicit OutOfOrderModel(const OutOfOrderConfig &config) : mConfig(config) {
+        mFetchQueue.resize(config.width * (config.frontend + 1));
+        mFetchHead = mFetchCount = 0;
+        mFetchedThisCycle = 0;
+        mFetchStopped = false;
+        mFetchResume = 0;
+        mRecoverSeq = NOT_YET;
+        for (int i = 0; i < NUM_REGS; i++) {
+            mMap[i] = i;
+        }
+        for (int i = config.phys_regs - 1; i >= NUM_REGS; i--) {
+            mFree.push_back(i);
+        }
+        mReady.assign(config.phys_regs, 0);
+        mRob.resize(config.rob_size);
+        mRobHead = mRobCount = 0;
+        mLsqCount = 0;
+        mSerializing = false;
+        mDividerFree = 0;
+        mCycle = 0;
+        mSeq = 0;
+        mCommitted = 0;
+        mMispredicts = 0;
+        mForwards = 0;
+        fill(mStalls, mStalls + NUM_DISPATCH_STALLS, 0);
+    }
+
+    // inst is the next instruction in program order: clock the core until
+    // it is fetched
+    void fetch(const PipeSlot &inst) {
+        while (!try_fetch(inst)) {
+            clock();
+        }
+    }
+    // Clock the core until the last instruction has committed
+    void drain() {
+        while (mFetchCount || mRobCount) {
+            clock();
+        }
+    }
+
+    uint64_t cycles() const {
+        return mCycle;
+    }
+    uint64_t committed() const {
+        return mCommitted;
+    }
+
+    // Print cycles, IPC and the rename slots lost to each cause. drain()
+    // it first.
+    void print(ostream &out) const {
+        uint64_t slots = mCycle * mConfig.width;
+        out << "Out-of-order core:   " << mConfig.width << " wide, issue " << mConfig.issue_width << ", ROB "
+            << mConfig.rob_size << ", IQ " << mConfig.iq_size << ", LSQ " << mConfig.lsq_size << ", "
+            << mConfig.phys_regs << " registers\n"
+            << "Cycles:              " << mCycle << '\n'
+            << "Instructions:        " << mCommitted << '\n'
+            << "IPC:                 " << fixed << setprecision(3)
+            << (mCycle ? static_cast<double>(mCommitted) / mCycle : 0.0) << '\n'
+            << "Mispredicts:         " << mMispredicts << '\n'
+            << "Forwarded loads:     " << mForwards << '\n'
+            << "Rename slots lost:   " << slots - mCommitted << " of " << slots << '\n';
+        for (int i = 0; i < NUM_DISPATCH_STALLS; i++) {
+            out << "  " << setw(14) << left << DISPATCH_STALL_NAMES[i] << ' ' << setw(14) << right << mStalls[i]
+                << setw(9) << (slots ? 100.0 * mStalls[i] / slots : 0.0) << "%\n";
+        }
+    }
+};
+
+// The guest end of stdin and stdout, for machines that have no console of
+// their own (see Machine::set_console()). Output goes into a ring that a
+// writer thread drains to stdout, a large write() at a time, so the guest
+// only waits for the host when the ring is full. The ring is lock-free
+// between the harts' side and the writer; the harts take turns at their
+// side. Input is read from stdin a large block at a time.
+class Console {
+    static const size_t RING_SIZE = 1 << 16;
+    static const size_t INPUT_SIZE = 1 << 16;
+
+    char mRing[RING_SIZE];
+    atomic<uint64_t> mHead;     // Bytes ever put in the ring
+    atomic<uint64_t> mTail;     // Bytes ever written out
+    mutex mProducer;            // Held by the hart putting bytes in
+    // The writer sleeps on mWake when the ring is empty, and harts sleep
+    // on mDrained when it is full or they want it empty. Each side sets its
+    // flag (mWriterAsleep, mWaiters) before it looks at the other's
+    // counter, and the other side stores its counter before it looks at
+    // the flag. All of these are seq_cst, so at least one side sees the
+    // other and no wakeup is lost.
+    mutex mLock;
+    condition_variable mWake;
+    condition_variable mDrained;
+    atomic<bool> mWriterAsleep;
+    atomic<int> mWaiters;
+    bool mStop;
+    thread mWriter;
+    bool mLineBuffered;         // stdout is a terminal
+
+    mutex mInputLock;
+    char mInput[INPUT_SIZE];
+    size_t mInputPos;
+    size_t mInputEnd;
+
+    void writer() {
+        for (;;) {
+            uint64_t tail = mTail.load(memory_order_relaxed);
+            uint64_t head = mHead.load(memory_order_acquire);
+            if (head == tail) {
+                unique_lock<mutex> lock(mLock);
+                mWriterAsleep.store(true);
+                mWake.wait(lock, [&]() {
+                    return mStop || mHead.load() != mTail.load(memory_order_relaxed);
+                });
+                mWriterAsleep.store(false);
+                if (mStop && mHead.load() == mTail.load(memory_order_relaxed)) {
+                    return;
+                }
+                continue;
+            }
+            // Up to the end of the ring, then round again
+            size_t at = tail % RING_SIZE;
+            size_t size = min<uint64_t>(head - tail, RING_SIZE - at);
+            ssize_t written = ::write(STDOUT_FILENO, mRing + at, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            // If stdout is gone the output is dropped, not waited on.
+            // (seq_cst, like mHead in write(), so the store can't pass the
+            // load of mWaiters and miss a hart that is about to wait.)
+            mTail.store(tail + (written > 0 ? written : size));
+            if (mWaiters.load()) {
+                lock_guard<mutex> lock(mLock);
+                mDrained.notify_all();
+            }
+        }
+    }
+
+    // Wait until the ring has at most free bytes in it
+    void wait_for(uint64_t used) {
+        mWaiters++;
+        unique_lock<mutex> lock(mLock);
+        mDrained.wait(lock, [&]() {
+            return mHead.load(memory_order_relaxed) - mTail.load() <= used;
+        });
+        mWaiters--;
+    }
+
+    Console() : mHead(0), mTail(0), mWriterAsleep(false), mWaiters(0), mStop(false),
+                mLineBuffered(isatty(STDOUT_FILENO)), mInputPos(0), mInputEnd(0) {
+        // Anything the emulator printed comes first
+        cout.flush();
+        fflush(stdout);
+        // The writer starts with the signals blocked, since it has no
+        // recorder
+        sigset_t old = block_stop_signals();
+        mWriter = thread([this]() {
+            writer();
+        });
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    }
+
+public:
+    ~Console() {
+        {
+            lock_guard<mutex> lock(mLock);
+            mStop = true;
+            mWake.notify_one();
+        }
+        mWriter.join();
+    }
+
+    // The one console for stdin and stdout
+    static Console &get() {
+        static Console console;
+        return console;
+    }
+
+    // Put size bytes of data in the ring, waiting for room if need be
+    void write(const char *data, size_t size) {
+        lock_guard<mutex> producer(mProducer);
+        while (size > 0) {
+            uint64_t head = mHead.load(memory_order_relaxed);
+            uint64_t used = head - mTail.load(memory_order_acquire);
+            if (used == RING_SIZE) {
+                wait_for(RING_SIZE - 1);
+                continue;
+            }
+            size_t at = head % RING_SIZE;
+            size_t chunk = min<uint64_t>({ size, RING_SIZE - used, RING_SIZE - at });
+            memcpy(mRing + at, data, chunk);
+            mHead.store(head + chunk);
+            data += chunk;
+            size -= chunk;
+            if (mWriterAsleep.load()) {
+                lock_guard<mutex> lock(mLock);
+                mWake.notify_one();
+            }
+        }
+    }
+
+    // Should each line go out as soon as it's written? Only for a person
+    // reading it on a terminal.
+    bool line_buffered() const {
+        return mLineBuffered;
+    }
+
+    // Wait until everything put in the ring so far is out
+    void flush() {
+        wait_for(0);
+    }
+
+    // The next byte of stdin, or EOF. Output is flushed before waiting on
+    // stdin, so that a prompt shows first.
+    int read() {
+        lock_guard<mutex> lock(mInputLock);
+        while (mInputPos == mInputEnd) {
+            flush();
+            ssize_t got = ::read(STDIN_FILENO, mInput, INPUT_SIZE);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return EOF;
+            }
+            mInputPos = 0;
+            mInputEnd = got;
+        }
+        return static_cast<uint8_t>(mInput[mInputPos++]);
+    }
+
+    // Read stdin into pieces, as readv() does: what is already buffered,
+    // or if nothing is, straight from stdin (after flushing output, as
+    // read() does)
+    ssize_t read(const iovec *pieces, int count) {
+        lock_guard<mutex> lock(mInputLock);
+        if (mInputPos == mInputEnd) {
+            flush();
+            ssize_t got;
+            do {
+                got = ::readv(STDIN_FILENO, pieces, count);
+            } while (got < 0 && errno == EINTR);
+            return got;
+        }
+        size_t got = 0;
+        for (int i = 0; i < count && mInputPos < mInputEnd; i++) {
+            size_t n = min(pieces[i].iov_len, mInputEnd - mInputPos);
+            memcpy(pieces[i].iov_base, mInput + mInputPos, n);
+            mInputPos += n;
+            got += n;
+        }
+        return got;
+    }
+};
+
+const char CHECKPOINT_MAGIC[8] = { 'R', 'V', 'W', 'B', 'C', 'K', 'P', 'T' };
+const uint64_t CHECKPOINT_VERSION = 2;
+// How many files a chain of checkpoints may have, so a loop can't hang us
+const int MAX_CHECKPOINT_CHAIN = 1 << 16;
+// Number of entries in the predecode cache (must be a power of two)
+const int DECODE_CACHE_SIZE = 1 << 12;
+// Bytes a machine collects for stdout before handing them to the Console
+const size_t CONSOLE_BUFFER_SIZE = 1 << 12;
+// Calls deeper than this aren't added to the profiler's stacks
+const size_t MAX_PROFILE_DEPTH = 1 << 12;
+// Longest straight run of instructions translated into one Block
+const int MAX_BLOCK_INSTS = 64;
+class Machine {
+   GuestMemory mMem; // The memory.
+   int64_t mPC;     // The program counter
+   int64_t mRegs[NUM_REGS]; // The register file
+   
+
+   FetchOut mFO;    // Result of the fetch method.
+
+   DecodeOut mDO;   // Result of the decode method.
+
+   ExecuteOut mEO;  // Result of the Execute method.
+
+   MemoryOut mMO;   // Result of the Memory method.
+
+   int64_t mAluLeft;  // The operands execute() gave the ALU, kept so that
+   int64_t mAluRight; // debug_execute_out() can work out the flags
+
+   // Predecode cache. It is direct mapped on PC / 4: mDecodeTags holds the PC
+   // that each slot was decoded from (-1 when empty) and mDecodeCache its DecodeOut.
+   vector<int64_t> mDecodeTags;
+   vector<DecodeOut> mDecodeCache;
+
+   // Block cache for run_fast(), by guest PC, and the blocks on each guest
+   // page (by address >> GUEST_PAGE_SHIFT). mMem knows which pages any
+   // cached decode came from. A store to one of them drops the blocks it
+   // overlaps into mDeadBlocks, and run_fast() deletes those before it
+   // enters another block. mBlocksStale means every block has to go.
+   unordered_map<int64_t, Block *> mBlocks;
+   unordered_map<int64_t, vector<Block *>> mPageBlocks;
+   vector<Block *> mDeadBlocks;
+   bool mBlocksStale;
+   bool mBlocksForJit; // The blocks were translated for run_jit(), not run_fast()
+
+   bool mUseJit;       // run_fast() hands over to run_jit()
+   bool mHalted;       // The program asked to exit (ECALL with a7 = 0)
+   bool mFaulted;      // ... or it was stopped by a fault
+
+   int64_t mExitCode;  // a0 of that ECALL
+
+   // The ECALL console and where the machine's messages go. By default that
+   // is stdin, stdout and stderr; a batch job has buffers of its own.
+   const string *mInput;     // What a7 = 1 reads, or nullptr for stdin
+   size_t mInputPos;
+   string *mOutput;          // Where a7 = 2 writes, or nullptr for stdout
+   ostream *mLog;
+   // Output for stdout waits here until there are mConsoleLimit bytes, or
+   // until flush_console()
+   string mConsoleOut;
+   size_t mConsoleLimit;
+   bool mConsoleUsed;        // It has written to stdout
+   // The heap and files of the Linux system calls, shared with the other harts
+   shared_ptr<GuestProcess> mProcess;
+
+   // Instructions retired, and where run_fast() stops counting up to
+   uint64_t mInstret;
+   uint64_t mInstLimit;
+
+   // What snapshot() saved of the machine itself (memory keeps its own)
+   struct Snapshot {
+      int64_t pc;
+      int64_t regs[NUM_REGS];
+      uint64_t satp;
+      bool halted;
+      bool faulted;
+      int64_t exit_code;
+      size_t input_pos;
+      uint64_t instret;
+      GuestHeap heap;
+      map<uint64_t, uint64_t> free_ranges;
+   };
+   Snapshot mSnapshot;
+
+   string mCheckpoint;       // The last checkpoint saved or loaded, which
+                             // the next one adds to
+
+   int mHartId;              // What mhartid reads
+   uint64_t mReservation;    // Address LR reserved, or ~0 for none
+   int64_t mReservedValue;   // What LR read there
+
+   uint64_t mFusionCounts[NUM_FUSIONS]; // How often each fused pair ran
+   FlightRecorder mRecorder; // What ran last, dumped when something goes wrong
+   // What retired, except for what run_fast()'s blocks still hold (see
+   // fold_stats())
+   MachineStats mStats;
+
+   // The profiler, if any, gets a sample every mSampleEvery instructions,
+   // the next at mNextSample. mInstLimit is the nearer of that and the
+   // instruction limit (mUserLimit), so run_fast() checks for both at once.
+   Profiler *mProfiler;
+   uint64_t mSampleEvery;
+   uint64_t mNextSample;
+   uint64_t mUserLimit;
+   // The calls the profiler sees this hart in: the function called and sp
+   // at the call, outermost first, below the PC the profiler started at
+   vector<pair<uint64_t, int64_t>> mCallStack;
+   uint64_t mProfileRoot;
+
+   PipelineModel *mPipeline; // Times what the stages retire, if set
+   OutOfOrderModel *mOutOfOrder; // ... on an out-of-order core, if set
+   BranchModel *mBranches;   // Is told how each branch and jump went, if set
+   CacheModel *mCaches;      // Is told what the stages fetch, load and store, if set
+#if defined(__x86_64__)
+   X86Emitter mJit;    // Executable buffer holding the compiled blocks
+#endif
+
+   // Read from the internal memory
+   // Usage:
+   // int myintval = memory_read<int>(0); // Read the first 4 bytes
+   // char mycharval = memory_read<char>(8); // Read byte index 8
+   // An address the guest can't read throws a GuestFault.
+   template<typename T>
+   T memory_read(int64_t address) {
+       return mMem.read<T>(address);
+   }
+
+   // Write to the internal memory
+   // Usage:
+   // memory_write<int>(0, 0xdeadbeef); // Set bytes 0, 1, 2, 3 to 0xdeadbeef
+   // memory_write<char>(8, 0xff);      // Set byte index 8 to 0xff
+   template<typename T>
+   void memory_write(int64_t address, T value) {
+       if (mMem.write<T>(address, value)) {
+           code_written(address, sizeof(T));
+       }
+   }
+
+   // A write of size bytes at address landed on a page we decoded code
+   // from, and may have replaced an instruction. With paging on, other
+   // virtual addresses may map the same page, so every decode goes.
+   void code_written(int64_t address, int size) {
+       if (mMem.paging()) {
+           forget_decodes();
+           return;
+       }
+       invalidate_decode(address);
+       if (size > 1) {
+           invalidate_decode(address + size - 1);
+       }
+       drop_blocks(address, address + size);
+   }
+
+   // Run LR, SC or an AMO (inst) on the T at address, with operand from rs2,
+   // and return what goes in rd. The harts run on host threads and each of
+   // these is one sequentially consistent host atomic, which is at least as
+   // strong as any aq and rl bits ask for. SC succeeds if the reserved
+   // address still holds what LR read there, so a store by another hart of
+   // that same value goes unnoticed.
+   template<typename T>
+   int64_t amo(const DecodeOut &inst, uint64_t address, T operand) {
+       typedef typename make_unsigned<T>::type U;
+       // The W and D kinds are in the same order
+       int kind = (inst.kind >= I_LR_D) ? inst.kind - (I_LR_D - I_LR_W) : inst.kind;
+       bool code = false;
+       T result;
+       switch (kind) {
+       case I_LR_W:
+           result = mMem.atomic<T>(address, false, [](T *p) {
+               return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+           }, code);
+           mReservation = address;
+           mReservedValue = result;
+           return result;
+       case I_SC_W: {
+           bool reserved = mReservation == address;
+           T expected = mReservedValue;
+           mReservation = ~0UL;
+           if (!reserved) {
+               return 1;
+           }
+           result = mMem.atomic<T>(address, true, [&](T *p) {
+               return static_cast<T>(!__atomic_compare_exchange_n(
+                   p, &expected, operand, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+           }, code);
+       }
+       break;
+       case I_AMOSWAP_W:
+           result = mMem.atomic<T>(address, true, [&](T *p) {
+               return __atomic_exchange_n(p, operand, __ATOMIC_SEQ_CST);
+           }, code);
+       break;
+       case I_AMOADD_W:
+           result = mMem.atomic<T>(address, true, [&](T *p) {
+               return static_cast<T>(__atomic_fetch_add(reinterpret_cast<U *>(p),
+                                                        static_cast<U>(operand), __ATOMIC_SEQ_CST));
+           }, code);
+       break;
+       case I_AMOXOR_W:
+           result = mMem.atomic<T>(address, true, [&](T *p) {
+               return __atomic_fetch_xor(p, operand, __ATOMIC_SEQ_CST);
+           }, code);
+       break;
+       case I_AMOAND_W:
+           result = mMem.atomic<T>(address, true, [&](T *p) {
+               return __atomic_fetch_and(p, operand, __ATOMIC_SEQ_CST);
+           }, code);
+       break;
+       case I_AMOOR_W:
+           result = mMem.atomic<T>(address, true, [&](T *p) {
+               return __atomic_fetch_or(p, operand, __ATOMIC_SEQ_CST);
+           }, code);
+       break;
+       default:
+           // MIN, MAX, MINU and MAXU have no host instruction, so they retry
+           // a compare and swap until nobody got in between
+           result = mMem.atomic<T>(address, true, [&](T *p) {
+               T old = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+               T value;
+               do {
+                   switch (kind) {
+                   case I_AMOMIN_W:  value = min(old, operand); break;
+                   case I_AMOMAX_W:  value = max(old, operand); break;
+                   case I_AMOMINU_W: value = min<U>(old, operand); break;
+                   default:          value = max<U>(old, operand); break;
+                   }
+               } while (!__atomic_compare_exchange_n(p, &old, value, false,
+                                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+               return old;
+           }, code);
+       break;
+       }
+       if (code) {
+           code_written(address, sizeof(T));
+       }
+       return result;
+   }
+
+   // The ECALL services, with a7 in regs[17]: a7 = 0 exits with code a0,
+   // 1 reads a character into a0 (-1 at the end of the input) and 2 writes
+   // the one in a0. Any other a7 is a Linux system call (see syscall()).
+   // regs holds the other arguments; a0 is both an argument and the result.
+   void ecall(const int64_t *regs, int64_t &a0) {
+       int64_t a7 = regs[17];
+       mStats.count_ecall(a7);
+       if (a7 == 0 || a7 == LINUX_EXIT || a7 == LINUX_EXIT_GROUP) {
+           mHalted = true;
+           mExitCode = a0;
+           if (a7 == LINUX_EXIT_GROUP) {
+               mProcess->exit_group(a0);
+           }
+           flush_console();
+       }
+       else if (a7 == 1) {
+           if (!mInput) {
+               flush_console();
+               a0 = Console::get().read();
+           }
+           else {
+               a0 = (mInputPos < mInput->size()) ? static_cast<uint8_t>((*mInput)[mInputPos++]) : EOF;
+           }
+       }
+       else if (a7 == 2) {
+           if (!mOutput) {
+               mConsoleOut.push_back(static_cast<char>(a0));
+               mConsoleUsed = true;
+               if (mConsoleOut.size() >= mConsoleLimit ||
+                   (a0 == '\n' && Console::get().line_buffered())) {
+                   Console::get().write(mConsoleOut.data(), mConsoleOut.size());
+                   mConsoleOut.clear();
+               }
+           }
+           else {
+               mOutput->push_back(static_cast<char>(a0));
+           }
+       }
+       else {
+           a0 = syscall(a7, a0, regs);
+       }
+   }
+
+   // Linux system call number with arguments a0 and regs[11] on. Returns
+   // the result, or -errno. Buffers are lent to the host where they are
+   // (GuestMemory::lend()), so a read() or write() of a file is one readv()
+   // or writev() straight to or from guest memory. fds 0, 1 and 2 are the
+   // machine's console: stdout keeps its place among a7 = 2's characters,
+   // and closing one of them does nothing. mmap() only gives out anonymous
+   // memory, and not at a MAP_FIXED address. exit (see ecall()) only stops
+   // the hart that calls it, and exit_group stops them all.
+   int64_t syscall(int64_t number, int64_t a0, const int64_t *regs) {
+       uint64_t a1 = regs[11], a2 = regs[12], a3 = regs[13];
+       switch (number) {
+       case LINUX_READ:
+       case LINUX_WRITE:
+           return transfer(a0, a1, a2, number == LINUX_READ);
+       case LINUX_OPENAT:
+           return open_file(a0, a1, a2, a3);
+       case LINUX_CLOSE:
+           return close_file(a0);
+       case LINUX_LSEEK: {
+           int fd = host_file(a0);
+           if (fd < 0) {
+               return (a0 >= 0 && a0 <= 2) ? -ESPIPE : -EBADF;
+           }
+           off_t offset = lseek(fd, a1, a2);
+           return (offset < 0) ? -errno : offset;
+       }
+       case LINUX_FSTAT:
+           return stat_file(a0, a1);
+       case LINUX_CLOCK_GETTIME: {
+           timespec now;
+           if (clock_gettime(static_cast<clockid_t>(a0), &now) != 0) {
+               return -errno;
+           }
+           int64_t out[2] = { now.tv_sec, now.tv_nsec };
+           return copy_out(a1, out, sizeof(out)) ? 0 : -EFAULT;
+       }
+       case LINUX_BRK:
+           return set_break(a0);
+       case LINUX_MMAP:
+           return map_anonymous(a1, a3);
+       case LINUX_MUNMAP:
+           return unmap(a0, a1);
+       default:
+           log() << "[ECALL] Unsupported system call " << number << '\n';
+           return -ENOSYS;
+       }
+   }
+
+   // The host fd behind guest fd fd, or -1 if it isn't open. The console
+   // (0, 1 and 2) has none.
+   int host_file(int64_t fd) {
+       lock_guard<mutex> hold(mProcess->lock);
+       uint64_t index = fd - 3;
+       return (fd >= 3 && index < mProcess->files.size()) ? mProcess->files[index] : -1;
+   }
+
+   // Copy size bytes of data to the guest at address. Returns false if the
+   // guest can't write all of it.
+   bool copy_out(uint64_t address, const void *data, uint64_t size) {
+       HostSpans spans;
+       mMem.lend(address, size, true, spans);
+       const char *from = static_cast<const char *>(data);
+       for (const iovec &piece : spans.pieces) {
+           memcpy(piece.iov_base, from, piece.iov_len);
+           from += piece.iov_len;
+       }
+       if (spans.code) {
+           forget_decodes();
+       }
+       return spans.size == size;
+   }
+
+   // read() (if in) or write() of size bytes at address on guest fd fd
+   int64_t transfer(int64_t fd, uint64_t address, uint64_t size, bool in) {
+       int host = host_file(fd);
+       if (host < 0 && !(in ? fd == 0 : (fd == 1 || fd == 2))) {
+           return -EBADF;
+       }
+       if (size == 0) {
+           return 0;
+       }
+       HostSpans spans;
+       mMem.lend(address, size, in, spans);
+       if (spans.size == 0) {
+           return -EFAULT;
+       }
+       const iovec *pieces = spans.pieces.data();
+       int count = spans.pieces.size();
+       ssize_t done;
+       if (host >= 0) {
+           do {
+               done = in ? readv(host, pieces, count) : writev(host, pieces, count);
+           } while (done < 0 && errno == EINTR);
+       }
+       else if (in && mInput) {
+           done = 0;
+           for (int i = 0; i < count && mInputPos < mInput->size(); i++) {
+               size_t n = min(pieces[i].iov_len, mInput->size() - mInputPos);
+               memcpy(pieces[i].iov_base, mInput->data() + mInputPos, n);
+               mInputPos += n;
+               done += n;
+           }
+       }
+       else if (in) {
+           flush_console();
+           done = Console::get().read(pieces, count);
+       }
+       else {
+           // stdout goes after what a7 = 2 has buffered, and stderr after
+           // all of stdout
+           if (fd == 2) {
+               flush_console();
+           }
+           for (int i = 0; i < count; i++) {
+               const char *data = static_cast<const char *>(pieces[i].iov_base);
+               if (fd == 2) {
+                   log().write(data, pieces[i].iov_len);
+               }
+               else if (mOutput) {
+                   mOutput->append(data, pieces[i].iov_len);
+               }
+               else {
+                   if (!mConsoleOut.empty()) {
+                       Console::get().write(mConsoleOut.data(), mConsoleOut.size());
+                       mConsoleOut.clear();
+                   }
+                   Console::get().write(data, pieces[i].iov_len);
+                   mConsoleUsed = true;
+               }
+           }
+           done = spans.size;
+       }
+       int error = errno;
+       if (in && spans.code && done > 0) {
+           forget_decodes();
+       }
+       return (done < 0) ? -error : done;
+   }
+
+   // openat() of the path at address, relative to guest fd dir
+   int64_t open_file(int64_t dir, uint64_t address, int64_t flags, int64_t mode) {
+       string path;
+       try {
+           for (char c; (c = mMem.read<char>(address + path.size())) != 0; ) {
+               if (path.size() >= PATH_MAX) {
+                   return -ENAMETOOLONG;
+               }
+               path.push_back(c);
+           }
+       }
+       catch (const GuestFault &) {
+           return -EFAULT;
+       }
+       int host_dir = AT_FDCWD;
+       if (dir != GUEST_AT_FDCWD && path[0] != '/' && (host_dir = host_file(dir)) < 0) {
+           return -EBADF;
+       }
+       int host_flags = (flags & O_ACCMODE) | O_CLOEXEC;
+       for (auto &flag : GUEST_OPEN_FLAGS) {
+           if ((flags & flag[0]) == flag[0]) {
+               host_flags |= flag[1];
+           }
+       }
+       int fd = openat(host_dir, path.c_str(), host_flags, static_cast<mode_t>(mode));
+       if (fd < 0) {
+           return -errno;
+       }
+       // The lowest guest fd that is free, as on Linux
+       lock_guard<mutex> hold(mProcess->lock);
+       vector<int> &files = mProcess->files;
+       size_t index = find(files.begin(), files.end(), -1) - files.begin();
+       if (index == files.size()) {
+           files.push_back(fd);
+       }
+       else {
+           files[index] = fd;
+       }
+       return index + 3;
+   }
+
+   int64_t close_file(int64_t fd) {
+       if (fd >= 0 && fd <= 2) {
+           return 0;
+       }
+       int host;
+       {
+           lock_guard<mutex> hold(mProcess->lock);
+           uint64_t index = fd - 3;
+           if (fd < 3 || index >= mProcess->files.size() || mProcess->files[index] < 0) {
+               return -EBADF;
+           }
+           host = mProcess->files[index];
+           mProcess->files[index] = -1;
+       }
+       return (close(host) == 0 || errno == EINTR) ? 0 : -errno;
+   }
+
+   // fstat() of guest fd fd into the GuestStat at address. The console's
+   // fds are the host's.
+   int64_t stat_file(int64_t fd, uint64_t address) {
+       int host = (fd >= 0 && fd <= 2) ? fd : host_file(fd);
+       struct stat info;
+       if (host < 0) {
+           return -EBADF;
+       }
+       if (fstat(host, &info) != 0) {
+           return -errno;
+       }
+       GuestStat out = {};
+       out.dev = info.st_dev;
+       out.ino = info.st_ino;
+       out.mode = info.st_mode;
+       out.nlink = info.st_nlink;
+       out.uid = info.st_uid;
+       out.gid = info.st_gid;
+       out.rdev = info.st_rdev;
+       out.size = info.st_size;
+       out.blksize = info.st_blksize;
+       out.blocks = info.st_blocks;
+       out.atime = info.st_atim.tv_sec;
+       out.atime_nsec = info.st_atim.tv_nsec;
+       out.mtime = info.st_mtim.tv_sec;
+       out.mtime_nsec = info.st_mtim.tv_nsec;
+       out.ctime = info.st_ctim.tv_sec;
+       out.ctime_nsec = info.st_ctim.tv_nsec;
+       return copy_out(address, &out, sizeof(out)) ? 0 : -EFAULT;
+   }
+
+   // Zero size bytes at guest address for brk() or mmap() to hand out again
+   void zero_out(uint64_t address, uint64_t size) {
+       if (mMem.zero(address, size)) {
+           forget_decodes();
+       }
+   }
+
+   // brk(): move the break to address if that is in the heap, and return
+   // where it is. Memory the break grows over reads as zeros.
+   int64_t set_break(uint64_t address) {
+       lock_guard<mutex> hold(mProcess->lock);
+       GuestHeap &heap = mProcess->heap;
+       if (heap.brk_start && address >= heap.brk_start && address <= heap.brk_end) {
+           if (address > heap.brk && heap.brk < heap.brk_top) {
+               zero_out(heap.brk, min(address, heap.brk_top) - heap.brk);
+           }
+           heap.brk = address;
+           heap.brk_top = max(heap.brk_top, address);
+       }
+       return heap.brk;
+   }
+
+   // mmap() of size bytes of anonymous memory (flags says which): the first
+   // range munmap() gave back that is big enough, or else the next one
+   // down in the mmap() area. All of it is readable and writable.
+   int64_t map_anonymous(uint64_t size, int64_t flags) {
+       if (!(flags & GUEST_MAP_ANONYMOUS)) {
+           return -ENODEV;
+       }
+       if ((flags & GUEST_MAP_FIXED) || size == 0) {
+           return -EINVAL;
+       }
+       size = (size + GUEST_PAGE_OFFSET) & ~GUEST_PAGE_OFFSET;
+       lock_guard<mutex> hold(mProcess->lock);
+       GuestHeap &heap = mProcess->heap;
+       map<uint64_t, uint64_t> &free_ranges = mProcess->free_ranges;
+       for (auto range = free_ranges.begin(); range != free_ranges.end(); ++range) {
+           if (range->second >= size) {
+               uint64_t base = range->first;
+               if (range->second > size) {
+                   free_ranges[base + size] = range->second - size;
+               }
+               free_ranges.erase(range);
+               zero_out(base, size);
+               return base;
+           }
+       }
+       if (size > heap.mmap_next - heap.mmap_start) {
+           return -ENOMEM;
+       }
+       heap.mmap_next -= size;
+       return heap.mmap_next;
+   }
+
+   // munmap() of size bytes at address. Only the mmap() area is given back;
+   // anything else is left as it is.
+   int64_t unmap(uint64_t address, uint64_t size) {
+       if ((address & GUEST_PAGE_OFFSET) || size == 0) {
+           return -EINVAL;
+       }
+       lock_guard<mutex> hold(mProcess->lock);
+       GuestHeap &heap = mProcess->heap;
+       map<uint64_t, uint64_t> &free_ranges = mProcess->free_ranges;
+       uint64_t start = max(address, heap.mmap_next);
+       uint64_t end = min(address + ((size + GUEST_PAGE_OFFSET) & ~GUEST_PAGE_OFFSET), heap.mmap_end);
+       if (start >= end) {
+           return 0;
+       }
+       // Join the free ranges it touches
+       auto range = free_ranges.upper_bound(start);
+       if (range != free_ranges.begin() && prev(range)->first + prev(range)->second >= start) {
+           --range;
+       }
+       while (range != free_ranges.end() && range->first <= end) {
+           start = min(start, range->first);
+           end = max(end, range->first + range->second);
+           range = free_ranges.erase(range);
+       }
+       if (start == heap.mmap_next) {
+           heap.mmap_next = end;
+       }
+       else {
+           free_ranges[start] = end - start;
+       }
+       return 0;
+   }
+
+   ostream &log() {
+       return *mLog;
+   }
+
+   // FENCE orders this hart's memory accesses with the other harts'. A hart
+   // only notices its own stores to code, so FENCE.I also drops everything
+   // decoded, to pick up code that other harts wrote.
+   void fence(const DecodeOut &inst) {
+       atomic_thread_fence(memory_order_seq_cst);
+       if (inst.kind == I_FENCE_I) {
+           forget_decodes();
+       }
+   }
+
+   // Drop every cached decode and, before the next block runs, every block.
+   // Used when the PC to instruction mapping may have changed as a whole.
+   void forget_decodes() {
+       mDecodeTags.assign(DECODE_CACHE_SIZE, -1);
+       if (!mBlocks.empty()) {
+           mBlocksStale = true;
+       }
+   }
+
+   // Run a CSR instruction and return the CSR's old value. satp and the
+   // read-only mhartid are the only CSRs this machine has; any other reads
+   // as 0 and ignores writes.
+   int64_t csr_access(const DecodeOut &inst, int64_t rs1_value) {
+       int csr = inst.imm & 0xfff;
+       // CSRRS and CSRRC of x0 (or of 0) only read
+       bool writes = inst.kind == I_CSRRW || inst.kind == I_CSRRWI || inst.rs1 != 0;
+       if (csr == CSR_MHARTID) {
+           if (writes) {
+               log() << "[CSR] mhartid is read-only\n";
+           }
+           return mHartId;
+       }
+       if (csr != CSR_SATP) {
+           log() << "[CSR] Unsupported CSR 0x" << hex << csr << dec << '\n';
+           return 0;
+       }
+       // The I forms take rs1 itself as a 5-bit immediate
+       bool immediate = inst.kind >= I_CSRRWI;
+       uint64_t operand = immediate ? inst.rs1 : rs1_value;
+       uint64_t old = mMem.satp();
+       if (writes) {
+           uint64_t value = operand;
+           if (inst.kind == I_CSRRS || inst.kind == I_CSRRSI) {
+               value = old | operand;
+           }
+           else if (inst.kind == I_CSRRC || inst.kind == I_CSRRCI) {
+               value = old & ~operand;
+           }
+           if (mMem.set_satp(value)) {
+               forget_decodes();
+           }
+       }
+       return old;
+   }
+
+   // SFENCE.VMA rs1, rs2: rs1 gives the address and rs2 the ASID to flush,
+   // x0 meaning all of them. The page tables may have changed under code we
+   // decoded, so that goes too.
+   void sfence_vma(const DecodeOut &inst, int64_t rs1_value, int64_t rs2_value) {
+       mMem.sfence_vma(inst.rs1 != 0, rs1_value, inst.rs2 != 0, rs2_value);
+       forget_decodes();
+   }
+
+   // Keep the decode of the instruction at pc in predecode slot slot
+   void cache_decode(int slot, int64_t pc) {
+       mDecodeTags[slot] = pc;
+       mDecodeCache[slot] = mDO;
+       mMem.mark_code(pc);
+   }
+
+   // Drop the cached decode of the instruction word that holds address, if any
+   void invalidate_decode(int64_t address) {
+       int64_t pc = address & ~3L;
+       int slot = (pc >> 2) & (DECODE_CACHE_SIZE - 1);
+       if (mDecodeTags[slot] == pc) {
+           mDecodeTags[slot] = -1;
+       }
+   }
+
+    //All of the decoders, using the table provided, the types are broken down
+    //into rd, funct3, funct7, rs1, rs2, and the immediate
+    void decode_r() {
+    mDO.rd        = (mFO.instruction >> 7) & 0x1f;
+    mDO.funct3    = (mFO.instruction >> 12) & 7;
+    mDO.rs1       = (mFO.instruction >> 15) & 0x1f;
+    mDO.rs2       = (mFO.instruction >> 20) & 0x1f;
+    mDO.funct7    = (mFO.instruction >> 25) & 0x7f;
+    mDO.imm       = 0;
+    }
+
+    void decode_i() {
+    mDO.rd        = (mFO.instruction >> 7) & 0x1f;
+    mDO.funct3    = (mFO.instruction >> 12) & 7;
+    mDO.rs1       = (mFO.instruction >> 15) & 0x1f;
+    mDO.rs2       = 0;
+    mDO.funct7    = (mFO.instruction >> 25) & 0x7f; // Only meaningful for the shifts
+    mDO.imm       = sign_extend(((mFO.instruction >> 20) & 0xfff), 11);
+    }
+
+    void decode_s() {
+    mDO.rd        = 0;
+    mDO.funct3    = (mFO.instruction >> 12) & 7;
+    mDO.rs1       = (mFO.instruction >> 15) & 0x1f; // The base address
+    mDO.rs2       = (mFO.instruction >> 20) & 0x1f; // The value to store
+    mDO.funct7    = 0;
+    mDO.imm       = sign_extend((((mFO.instruction >> 25) & 0x7f) << 5) |
+                                (((mFO.instruction >> 7) & 0x1f) << 0), 11);
+    }
+
+    
+    void decode_b() {
+    mDO.rd        = 0;
+    mDO.funct3    = (mFO.instruction >> 12) & 7;
+    mDO.rs1       = (mFO.instruction >> 15) & 0x1f;
+    mDO.rs2       = (mFO.instruction >> 20) & 0x1f;
+    mDO.funct7    = 0;
+    mDO.imm       = sign_extend((((mFO.instruction >> 31) & 1) << 12) |
+                                (((mFO.instruction >> 25) & 0x3f) << 5) |
+                                (((mFO.instruction >> 8) & 0xf) << 1) | 
+                                (((mFO.instruction >> 7) & 1) << 11), 12);
+    }
+
+    void decode_u() {
+    mDO.rd        = (mFO.instruction >> 7) & 0x1f;
+    mDO.funct3    = 0;
+    mDO.rs1       = 0;
+    mDO.rs2       = 0;
+    mDO.funct7    = 0;
+    mDO.imm       = sign_extend((((mFO.instruction >> 12) & 0xfffff) << 12), 31);
+    }
+
+    void decode_j() {
+    mDO.rd        = (mFO.instruction >> 7) & 0x1f; 
+    mDO.funct3    = 0;
+    mDO.rs1       = 0;
+    mDO.rs2       = 0;
+    mDO.funct7    = 0;
+    mDO.imm       = sign_extend((((mFO.instruction >> 31) & 1) << 20) |
+                                (((mFO.instruction >> 21) & 0x3ff) << 1) |
+                                (((mFO.instruction >> 20) & 1) << 11) |
+                                (((mFO.instruction >> 12) & 0xff) << 12), 20);
+    }
+
+    // Decode mFO.instruction into mDO. Returns false if this machine can't run
+    // the instruction, in which case mDO is set to an UNIMPL that does nothing.
+    // Nothing is said about it here: the instruction may never run, so
+    // report_invalid() is left to whatever retires it.
+    // DECODE_TABLE gives the one instruction it can be, and the format of that
+    // says where its fields are.
+    bool decode_instruction() {
+    if ((mFO.instruction & 3) != 3) {
+        decode_unimpl();
+        return false;
+    }
+
+    const IsaEntry &entry = ISA[DECODE_TABLE.kind[decode_index(mFO.instruction)]];
+    if (!isa_matches(entry, mFO.instruction)) {
+        decode_unimpl();
+        return false;
+    }
+    switch (entry.format) {
+    case FMT_I:
+    case FMT_SYSTEM:
+        decode_i();
+    break;
+    case FMT_SHIFT:
+    case FMT_SHIFTW:
+        decode_i();
+        mDO.imm &= 0x3f; // Only the shift amount, not the funct bits
+    break;
+    case FMT_S:
+        decode_s();
+    break;
+    case FMT_B:
+        decode_b();
+    break;
+    case FMT_J:
+        decode_j();
+    break;
+    case FMT_U:
+        decode_u();
+    break;
+    default:
+        decode_r();
+    break;
+    }
+    mDO.op   = entry.op;
+    mDO.cmd  = entry.cmd;
+    mDO.kind = entry.kind;
+    return true;
+    }
+
+    // Say that mFO.instruction can't be run, with the flight recorder's
+    // account of how the guest got to it. Done once each time it retires.
+    void report_invalid() {
+    if ((mFO.instruction & 3) != 3) {
+        log() << "[DECODE] Invalid instruction (not a 32-bit instruction).\n";
+    }
+    else {
+        log() << "[DECODE] Unsupported instruction: " << mFO << '\n';
+    }
+    mRecorder.dump(log());
+    }
+
+    // An instruction we can't run becomes one that only moves on to PC + 4
+    void decode_unimpl() {
+    mDO.op     = UNIMPL;
+    mDO.rd     = 0;
+    mDO.rs1    = 0;
+    mDO.rs2    = 0;
+    mDO.funct3 = 0;
+    mDO.funct7 = 0;
+    mDO.imm    = 0;
+    mDO.cmd    = ALU_ADD;
+    mDO.kind   = I_INVALID;
+    }
+
+    // Return the decoded instruction at pc, decoding it on a predecode cache
+    // miss. Instructions that fail to decode are not kept, so that they are
+    // looked at again (and reported by whatever runs them) every time.
+    const DecodeOut &predecode(int64_t pc) {
+    int slot = (pc >> 2) & (DECODE_CACHE_SIZE - 1);
+    if (mDecodeTags[slot] != pc) {
+        mFO.instruction = mMem.read<uint32_t>(pc, ACCESS_EXEC);
+        bool ok = decode_instruction();
+        if (ok && (pc & 3) == 0) {
+            cache_decode(slot, pc);
+        }
+        else {
+            mDecodeTags[slot] = -1;
+            mDecodeCache[slot] = mDO;
+        }
+    }
+    return mDecodeCache[slot];
+    }
+
+    // Translate the block that starts at pc. handlers maps each InstKinds to
+    // its run_fast() label, plus one extra label at NUM_INST_KINDS that just
+    // falls through to next_pc, for blocks cut short by MAX_BLOCK_INSTS or
+    // by end_pc. The JIT passes no handlers and compiles the block instead.
+    Block *translate_block(int64_t pc, int64_t end_pc, void *const *handlers) {
+    // If pc can't be fetched this throws before anything is allocated
+    mMem.read<uint32_t>(pc, ACCESS_EXEC);
+    Block *blk = new Block;
+    blk->pc = pc;
+    blk->taken = nullptr;
+    blk->taken_pc = 0;
+    blk->fallthrough = nullptr;
+    blk->native = nullptr;
+    blk->runs = 0;
+    blk->taken_runs = 0;
+    while (true) {
+        BlockInst bi;
+        bi.fusion = FUSE_NONE;
+        bi.dec = predecode(pc);
+        bi.handler = handlers ? handlers[bi.dec.kind] : nullptr;
+        pc += 4;
+        // The PC relative values are known now, so store them ready to use
+        switch (bi.dec.kind) {
+            case I_AUIPC:
+                bi.dec.imm += pc - 4;
+                bi.handler = handlers ? handlers[I_LUI] : nullptr;
+            break;
+            case I_JAL:
+            case I_BEQ:
+            case I_BNE:
+            case I_BLT:
+            case I_BGE:
+            case I_BLTU:
+            case I_BGEU:
+                bi.dec.imm += pc - 4;
+                blk->taken_pc = bi.dec.imm;
+            break;
+            default:
+            break;
+        }
+        blk->insts.push_back(bi);
+
+        if (is_block_exit(bi.dec)) {
+            break;
+        }
+        // Stop before an address that would fault, so that the fault only
+        // happens if the program really gets there
+        if (pc == end_pc || blk->insts.size() == MAX_BLOCK_INSTS || !mMem.executable(pc)) {
+            bi.handler = handlers ? handlers[H_FALLTHROUGH] : nullptr;
+            blk->insts.push_back(bi);
+            break;
+        }
+    }
+    blk->next_pc = pc;
+    fuse_block(blk, handlers);
+    mBlocks[blk->pc] = blk;
+    for (int64_t page = blk->pc >> GUEST_PAGE_SHIFT; page <= (blk->next_pc - 1) >> GUEST_PAGE_SHIFT; page++) {
+        mPageBlocks[page].push_back(blk);
+    }
+    return blk;
+    }
+
+    // Look for fusable pairs in a freshly translated block. The first
+    // instruction of a pair gets the fused handler, which also does the
+    // second one and skips over it, so the block still has one entry per
+    // instruction. AUIPC and branch immediates are already absolute here.
+    void fuse_block(Block *blk, void *const *handlers) {
+    size_t count = blk->insts.size();
+    if (count > 0 && !is_block_exit(blk->insts[count - 1].dec)) {
+        count--; // Never fuse with the fall through entry
+    }
+    for (size_t i = 0; i + 1 < count; i++) {
+        BlockInst &first = blk->insts[i];
+        DecodeOut &a = first.dec;
+        const DecodeOut &b = blk->insts[i + 1].dec;
+        if (a.rd == 0 || b.rs1 != a.rd) {
+            if (!(b.op == BRANCH && b.rs2 == a.rd && a.rd != 0)) {
+                continue;
+            }
+        }
+        int handler = -1;
+        if (a.kind == I_LUI && (b.kind == I_ADDI || b.kind == I_ADDIW) && b.rd == a.rd) {
+            first.fusion = FUSE_LI;
+            a.imm = (b.kind == I_ADDI) ? a.imm + b.imm : sign_extend(a.imm + b.imm, 31);
+            handler = H_FUSED_CONST;
+        }
+        else if (a.kind == I_AUIPC && b.kind == I_ADDI && b.rd == a.rd) {
+            first.fusion = FUSE_LA;
+            a.imm += b.imm;
+            handler = H_FUSED_CONST;
+        }
+        else if (a.kind == I_AUIPC && b.kind == I_LD && b.rs1 == a.rd) {
+            first.fusion = FUSE_LOAD_GLOBAL;
+            handler = H_FUSED_LOAD_GLOBAL;
+        }
+        else if (a.kind == I_AUIPC && b.kind == I_JALR && b.rs1 == a.rd) {
+            first.fusion = FUSE_CALL;
+            blk->taken_pc = (a.imm + b.imm) & ~1L;
+            handler = H_FUSED_CALL;
+        }
+        else if ((a.kind == I_SUB || a.kind == I_ADDI) && b.op == BRANCH) {
+            first.fusion = (a.kind == I_SUB) ? FUSE_SUB_BRANCH : FUSE_ADDI_BRANCH;
+            handler = ((a.kind == I_SUB) ? H_SUB_BRANCH : H_ADDI_BRANCH) + (b.kind - I_BEQ);
+        }
+        if (handler < 0) {
+            continue;
+        }
+        if (handlers) {
+            first.handler = handlers[handler];
+        }
+        i++;
+    }
+    }
+
+    // Find the block for pc, translating it if this is the first visit
+    // run_fast() counts the runs of each block and how often its exit branch
+    // was taken, rather than each instruction. Add those to mStats and start
+    // the block's counts again.
+    void fold_stats(Block *blk) {
+    uint64_t count = (blk->next_pc - blk->pc) >> 2;
+    for (uint64_t i = 0; i < count; i++) {
+        mStats.kinds[blk->insts[i].dec.kind] += blk->runs;
+    }
+    const DecodeOut &exit = blk->insts[count - 1].dec;
+    if (exit.op == BRANCH) {
+        mStats.taken[exit.kind - I_BEQ] += blk->taken_runs;
+    }
+    blk->runs = 0;
+    blk->taken_runs = 0;
+    }
+    // A run of blk that stopped before the instruction at pc didn't retire
+    // the rest
+    void uncount_stats(const Block *blk, int64_t pc) {
+    uint64_t count = (blk->next_pc - blk->pc) >> 2;
+    for (uint64_t i = (pc - blk->pc) >> 2; i < count; i++) {
+        mStats.kinds[blk->insts[i].dec.kind]--;
+    }
+    }
+
+    Block *get_block(int64_t pc, int64_t end_pc, void *const *handlers) {
+    auto found = mBlocks.find(pc);
+    if (found != mBlocks.end()) {
+        return found->second;
+    }
+    return translate_block(pc, end_pc, handlers);
+    }
+
+    // Forget that from links to link's block, and clear link
+    static void drop_link(Block *from, Block *&link) {
+    if (link) {
+        auto found = find(link->callers.begin(), link->callers.end(), from);
+        if (found != link->callers.end()) {
+            link->callers.erase(found);
+        }
+        link = nullptr;
+    }
+    }
+    // Take blk out of the block cache and unlink it, so that nothing runs
+    // it again. It is deleted later, by delete_dead_blocks(), because
+    // run_fast() may be in the middle of it.
+    void drop_block(Block *blk) {
+    mBlocks.erase(blk->pc);
+    for (int64_t page = blk->pc >> GUEST_PAGE_SHIFT; page <= (blk->next_pc - 1) >> GUEST_PAGE_SHIFT; page++) {
+        vector<Block *> &blocks = mPageBlocks[page];
+        blocks.erase(find(blocks.begin(), blocks.end(), blk));
+        if (blocks.empty()) {
+            mPageBlocks.erase(page);
+        }
+    }
+    for (Block *caller : blk->callers) {
+        if (caller->taken == blk) {
+            caller->taken = nullptr;
+        }
+        if (caller->fallthrough == blk) {
+            caller->fallthrough = nullptr;
+        }
+    }
+    drop_link(blk, blk->taken);
+    drop_link(blk, blk->fallthrough);
+#if defined(__x86_64__)
+    // Some of these may be in dropped blocks, whose code is never run again
+    // but stays in mJit until it is reset, so patching them does no harm
+    for (uint8_t *stub : blk->stubs) {
+        mJit.unchain(stub, blk->pc);
+    }
+#endif
+    mDeadBlocks.push_back(blk);
+    }
+    // Drop every block holding an instruction in [start, end)
+    void drop_blocks(int64_t start, int64_t end) {
+    for (int64_t page = start >> GUEST_PAGE_SHIFT; page <= (end - 1) >> GUEST_PAGE_SHIFT; page++) {
+        auto found = mPageBlocks.find(page);
+        if (found == mPageBlocks.end()) {
+            continue;
+        }
+        vector<Block *> hit;
+        for (Block *blk : found->second) {
+            if (blk->pc < end && start < blk->next_pc) {
+                hit.push_back(blk);
+            }
+        }
+        for (Block *blk : hit) {
+            drop_block(blk);
+        }
+    }
+    }
+    void delete_dead_blocks() {
+    for (Block *blk : mDeadBlocks) {
+        fold_stats(blk);
+        delete blk;
+    }
+    mDeadBlocks.clear();
+    }
+    // Have blocks been dropped since run_fast() last deleted them?
+    bool blocks_dropped() const {
+    return mBlocksStale || !mDeadBlocks.empty();
+    }
+    // Delete what was dropped, or every block if mBlocksStale
+    void tidy_blocks() {
+    if (mBlocksStale) {
+        free_blocks();
+    }
+    else {
+        delete_dead_blocks();
+    }
+    }
+
+    // Delete every translated block
+    void free_blocks() {
+    delete_dead_blocks();
+    for (auto &entry : mBlocks) {
+        fold_stats(entry.second);
+        delete entry.second;
+    }
+    mBlocks.clear();
+    mPageBlocks.clear();
+    mMem.clear_code();
+    mBlocksStale = false;
+    // The predecode cache is only kept coherent for code pages, so it has to
+    // go along with them.
+    mDecodeTags.assign(DECODE_CACHE_SIZE, -1);
+#if defined(__x86_64__)
+    mJit.reset();
+#endif
+    }
+
+#if defined(__x86_64__)
+    // Do compiled loads and stores go straight through the RAM window? Only
+    // while guest addresses are physical ones.
+    bool jit_window() const {
+        return mMem.window() && !mMem.paging();
+    }
+
+    // Compile blk to x86-64 in mJit. Guest registers stay in mRegs (rdi).
+    // Loads and stores look their page up in mMem's page caches (rsi) and
+    // go straight to host memory on a hit. A miss leaves the block and lets
+    // the interpreter run that instruction, which also covers faults and
+    // stores into code pages (those are never in the write cache). ECALLs
+    // and invalid instructions go to the interpreter the same way. With
+    // jit_window(), rsi is the RAM window instead and loads and stores just
+    // add it; the interpreter gets them through jit_fault_handler().
+    void jit_compile(Block *blk) {
+    vector<pair<uint8_t *, int64_t>> to_interpreter;
+    // Window loads and stores, with the to_interpreter entry they fault to
+    vector<pair<const uint8_t *, size_t>> fault_sites;
+    bool window = jit_window();
+    blk->native = mJit.here();
+    int64_t pc = blk->pc;
+    size_t count = blk->insts.size();
+    // Every way in, chained or not, stops if another hart has ended the
+    // program, and otherwise records the block
+    mJit.entry();
+    uint8_t *exited = mJit.jump_if_exited();
+    mJit.record_block(pc, (blk->next_pc - blk->pc) >> 2);
+    for (size_t i = 0; i < count; i++, pc += 4) {
+        const DecodeOut &d = blk->insts[i].dec;
+        if (i == count - 1 && !is_block_exit(d)) {
+            // The block was cut short and just falls through
+            mJit.exit_stub(pc);
+            break;
+        }
+        uint8_t fusion = blk->insts[i].fusion;
+        if (fusion != FUSE_NONE) {
+            mJit.count(&mFusionCounts[fusion]);
+        }
+        if (fusion == FUSE_LI || fusion == FUSE_LA) {
+            mJit.load_imm(RAX, d.imm);
+            mJit.store_reg(d.rd, RAX);
+            i++;
+            pc += 4;
+            continue;
+        }
+        if (fusion == FUSE_CALL) {
+            // The target is known now, so this exit can be chained like a JAL
+            mJit.load_imm(RAX, d.imm);
+            mJit.store_reg(d.rd, RAX);
+            mJit.load_imm(RAX, pc + 8);
+            mJit.store_reg(blk->insts[i + 1].dec.rd, RAX);
+            mJit.exit_stub(blk->taken_pc);
+            break;
+        }
+        if (fusion == FUSE_SUB_BRANCH || fusion == FUSE_ADDI_BRANCH) {
+            // Compute the ALU result once, then compare it in place of
+            // reloading whichever branch operand it is
+            const DecodeOut &b = blk->insts[i + 1].dec;
+            mJit.load_reg(RAX, d.rs1);
+            if (fusion == FUSE_SUB_BRANCH) {
+                mJit.load_reg(RCX, d.rs2);
+                mJit.alu_rr(X86_SUB, RAX, RCX);
+            }
+            else {
+                mJit.alu_ri(X86I_ADD, RAX, d.imm);
+            }
+            mJit.store_reg(d.rd, RAX);
+            if (b.rs1 == d.rd) {
+                mJit.load_reg(RCX, b.rs2);
+                mJit.alu_rr(X86_CMP, RAX, RCX);
+            }
+            else {
+                mJit.load_reg(RCX, b.rs1);
+                mJit.alu_rr(X86_CMP, RCX, RAX);
+            }
+            X86Conds cc = BRANCH_CONDS[b.kind - I_BEQ];
+            uint8_t *taken = mJit.jcc(cc);
+            mJit.exit_stub(pc + 8);
+            mJit.patch_to(taken, mJit.here());
+            mJit.exit_stub(b.imm);
+            break;
+        }
+        // FUSE_LOAD_GLOBAL needs nothing special: the AUIPC below is already a
+        // constant load.
+        bool word = (d.op == OP_32 || d.op == OP_IMM_32);
+        switch (d.kind) {
+            case I_LUI:
+            case I_AUIPC: // already holds the finished address
+                mJit.load_imm(RAX, d.imm);
+                mJit.store_reg(d.rd, RAX);
+            break;
+
+            case I_JAL:
+                mJit.load_imm(RAX, pc + 4);
+                mJit.store_reg(d.rd, RAX);
+                mJit.exit_stub(d.imm);
+            break;
+            case I_JALR:
+                mJit.load_reg(RAX, d.rs1);
+                mJit.alu_ri(X86I_ADD, RAX, d.imm);
+                mJit.alu_ri(X86I_AND, RAX, -2);
+                mJit.load_imm(RCX, pc + 4);
+                mJit.store_reg(d.rd, RCX);
+                mJit.exit_rax();
+            break;
+
+            case I_BEQ:
+            case I_BNE:
+            case I_BLT:
+            case I_BGE:
+            case I_BLTU:
+            case I_BGEU: {
+                mJit.load_reg(RAX, d.rs1);
+                mJit.load_reg(RCX, d.rs2);
+                mJit.alu_rr(X86_CMP, RAX, RCX);
+                X86Conds cc = BRANCH_CONDS[d.kind - I_BEQ];
+                uint8_t *taken = mJit.jcc(cc);
+                mJit.exit_stub(pc + 4);
+                mJit.patch_to(taken, mJit.here());
+                mJit.exit_stub(d.imm);
+            }
+            break;
+
+            case I_LB:
+            case I_LH:
+            case I_LW:
+            case I_LD:
+            case I_LBU:
+            case I_LHU:
+            case I_LWU:
+            case I_SB:
+            case I_SH:
+            case I_SW:
+            case I_SD: {
+                int width = 1 << (d.funct3 & 3);
+                AccessKinds access = (d.op == LOAD) ? ACCESS_READ : ACCESS_WRITE;
+                int32_t entry = access * PAGE_CACHE_SIZE * sizeof(PageCacheEntry);
+                mJit.load_reg(RAX, d.rs1);
+                mJit.alu_ri(X86I_ADD, RAX, d.imm);
+                if (window) {
+                    // Anything below the window's end is at window + address.
+                    // The page protections (and a SIGSEGV) take care of the rest.
+                    mJit.alu_rr(X86_MOV, RCX, RAX);
+                    mJit.shift_imm(X86_SHR, RCX, RAM_WINDOW_SHIFT);
+                    to_interpreter.push_back(make_pair(mJit.jcc(CC_NE), pc));
+                    mJit.alu_rr(X86_ADD, RAX, RSI);
+                }
+                else {
+                    // rdx = the cache entry for the page, as GuestMemory::read() finds it
+                    mJit.alu_rr(X86_MOV, RDX, RAX);
+                    mJit.shift_imm(X86_SHR, RDX, GUEST_PAGE_SHIFT - 4);
+                    mJit.alu_ri(X86I_AND, RDX, (PAGE_CACHE_SIZE - 1) << 4);
+                    mJit.alu_rr(X86_ADD, RDX, RSI);
+                    mJit.alu_rr(X86_MOV, RCX, RAX);
+                    mJit.alu_ri(X86I_AND, RCX, static_cast<int32_t>(~GUEST_PAGE_OFFSET | (width - 1)));
+                    mJit.alu_rm(X86M_CMP, RCX, RDX, entry);
+                    to_interpreter.push_back(make_pair(mJit.jcc(CC_NE), pc));
+                    mJit.alu_rm(X86M_ADD, RAX, RDX, entry + 8);
+                }
+                if (d.op == LOAD) {
+                    fault_sites.push_back(make_pair(mJit.here(), to_interpreter.size() - 1));
+                    mJit.guest_load(d.kind);
+                    mJit.store_reg(d.rd, RCX);
+                    break;
+                }
+                mJit.load_reg(RCX, d.rs2);
+                fault_sites.push_back(make_pair(mJit.here(), to_interpreter.size() - 1));
+                mJit.guest_store(d.kind);
+            }
+            break;
+
+            case I_ADDI:
+            case I_XORI:
+            case I_ORI:
+            case I_ANDI:
+            case I_ADDIW: {
+                X86AluImms op = d.cmd == ALU_XOR ? X86I_XOR : d.cmd == ALU_OR ? X86I_OR :
+                                d.cmd == ALU_AND ? X86I_AND : X86I_ADD;
+                mJit.load_reg(RAX, d.rs1);
+                mJit.alu_ri(op, RAX, d.imm, !word);
+                if (word) {
+                    mJit.movsxd(RAX, RAX);
+                }
+                mJit.store_reg(d.rd, RAX);
+            }
+            break;
+            case I_SLLI:
+            case I_SRLI:
+            case I_SRAI:
+            case I_SLLIW:
+            case I_SRLIW:
+            case I_SRAIW: {
+                X86Shifts op = d.cmd == ALU_SLL ? X86_SHL : d.cmd == ALU_SRL ? X86_SHR : X86_SAR;
+                mJit.load_reg(RAX, d.rs1);
+                mJit.shift_imm(op, RAX, d.imm & (word ? 0x1f : 0x3f), !word);
+                if (word) {
+                    mJit.movsxd(RAX, RAX);
+                }
+                mJit.store_reg(d.rd, RAX);
+            }
+            break;
+
+            case I_ADD:
+            case I_SUB:
+            case I_XOR:
+            case I_OR:
+            case I_AND:
+            case I_ADDW:
+            case I_SUBW: {
+                X86AluOps op = d.cmd == ALU_SUB ? X86_SUB : d.cmd == ALU_XOR ? X86_XOR :
+                               d.cmd == ALU_OR ? X86_OR : d.cmd == ALU_AND ? X86_AND : X86_ADD;
+                mJit.load_reg(RAX, d.rs1);
+                mJit.load_reg(RCX, d.rs2);
+                mJit.alu_rr(op, RAX, RCX, !word);
+                if (word) {
+                    mJit.movsxd(RAX, RAX);
+                }
+                mJit.store_reg(d.rd, RAX);
+            }
+            break;
+            case I_SLL:
+            case I_SRL:
+            case I_SRA:
+            case I_SLLW:
+            case I_SRLW:
+            case I_SRAW: {
+                // x86 masks the count in cl the same way RISC-V does
+                X86Shifts op = d.cmd == ALU_SLL ? X86_SHL : d.cmd == ALU_SRL ? X86_SHR : X86_SAR;
+                mJit.load_reg(RAX, d.rs1);
+                mJit.load_reg(RCX, d.rs2);
+                mJit.shift_cl(op, RAX, !word);
+                if (word) {
+                    mJit.movsxd(RAX, RAX);
+                }
+                mJit.store_reg(d.rd, RAX);
+            }
+            break;
+            case I_MUL:
+            case I_MULW:
+                mJit.load_reg(RAX, d.rs1);
+                mJit.load_reg(RCX, d.rs2);
+                mJit.imul(RAX, RCX, !word);
+                if (word) {
+                    mJit.movsxd(RAX, RAX);
+                }
+                mJit.store_reg(d.rd, RAX);
+            break;
+            case I_DIV:
+            case I_REM:
+            case I_DIVW:
+            case I_REMW: {
+                // Same special cases as div64() and rem64(). The quotient
+                // ends up in rax and the remainder in rdx.
+                mJit.load_reg(RAX, d.rs1);
+                mJit.load_reg(RCX, d.rs2);
+                if (word) {
+                    mJit.movsxd(RAX, RAX);
+                    mJit.movsxd(RCX, RCX);
+                }
+                mJit.test(RCX, RCX);
+                uint8_t *by_zero = mJit.jcc(CC_E);
+                mJit.alu_ri(X86I_CMP, RCX, -1);
+                uint8_t *by_minus_one = mJit.jcc(CC_E);
+                mJit.cqo_idiv(RCX);
+                uint8_t *done1 = mJit.jmp();
+                mJit.patch_to(by_zero, mJit.here());
+                mJit.alu_rr(X86_MOV, RDX, RAX);
+                mJit.load_imm(RAX, -1);
+                uint8_t *done2 = mJit.jmp();
+                mJit.patch_to(by_minus_one, mJit.here());
+                mJit.neg(RAX);
+                mJit.alu_rr(X86_XOR, RDX, RDX, false);
+                mJit.patch_to(done1, mJit.here());
+                mJit.patch_to(done2, mJit.here());
+                int result = (d.cmd == ALU_DIV) ? RAX : RDX;
+                if (word) {
+                    mJit.movsxd(result, result);
+                }
+                mJit.store_reg(d.rd, result);
+            }
+            break;
+
+            case I_FENCE:
+                mJit.mfence();
+            break;
+
+            default:
+                // ECALL, CSRs, FENCE.I, LR, SC, the AMOs and invalid
+                // instructions
+                mJit.exit_interpret(pc);
+            break;
+        }
+    }
+    mJit.patch_to(exited, mJit.here());
+    mJit.load_imm(RAX, blk->pc);
+    mJit.exit_rax();
+    vector<const uint8_t *> stubs;
+    for (auto &site : to_interpreter) {
+        stubs.push_back(mJit.here());
+        mJit.patch_to(site.first, mJit.here());
+        mJit.exit_interpret(site.second);
+    }
+    if (window) {
+        for (auto &site : fault_sites) {
+            mJit.add_fault_site(site.first, stubs[site.second]);
+        }
+    }
+    }
+#endif
+    
+
+public:
+   // The machine gets ram_size bytes of RAM from address 0, which the
+   // stack starts at the top of. (load_elf() sets up its own memory, so
+   // ELF programs use a ram_size of 0.) With ram_window, guest memory goes
+   // in a RAM window (GuestMemory::open_window()) if the host allows it.
+   // Pages that get memory of their own take it from arena, if given.
+   Machine(uint64_t ram_size, bool ram_window = false, PageArena *arena = nullptr)
+      : mMem(arena) {
+      if (ram_window && !mMem.open_window()) {
+         cerr << "[MEMORY] Could not reserve the RAM window, using the page cache\n";
+      }
+      if (ram_size > 0) {
+         mMem.map(0, ram_size, PERM_R | PERM_W | PERM_X);
+      }
+      init(0);
+      set_xreg(2, ram_size);
+   }
+
+   // Hart hart (1 to MAX_HARTS - 1) of the machine that boot is hart 0 of.
+   // It shares boot's memory and starts where boot is now, with the same
+   // registers, except that a0 holds its hart ID and its stack starts
+   // hart * HART_STACK_SIZE below boot's. It runs on its own thread, so
+   // create every hart before any of them runs.
+   Machine(Machine &boot, int hart) : mMem(boot.mMem, hart) {
+      init(hart);
+      // What harts write goes out in the order they write it
+      boot.flush_console();
+      boot.mConsoleLimit = 1;
+      mConsoleLimit = 1;
+      mProcess = boot.mProcess;
+      for (int i = 1; i < NUM_REGS; i++) {
+         mRegs[i] = boot.mRegs[i];
+      }
+      set_pc(boot.mPC);
+      set_xreg(2, boot.mRegs[2] - hart * HART_STACK_SIZE);
+      set_xreg(10, hart);
+   }
+
+   ~Machine() {
+      flush_console();
+      free_blocks();
+      if (tRecorder == &mRecorder) {
+         tRecorder = nullptr;
+      }
+   }
+
+private:
+   // The state a new hart starts with, apart from memory: everything zero
+   void init(int hart) {
+      mDecodeTags.assign(DECODE_CACHE_SIZE, -1);
+      mDecodeCache.resize(DECODE_CACHE_SIZE);
+      mBlocksStale = false;
+      mBlocksForJit = false;
+      mUseJit = false;
+      mHalted = false;
+      mFaulted = false;
+      mExitCode = 0;
+      mInput = nullptr;
+      mInputPos = 0;
+      mOutput = nullptr;
+      mLog = &cerr;
+      mConsoleLimit = CONSOLE_BUFFER_SIZE;
+      mConsoleUsed = false;
+      mProcess = make_shared<GuestProcess>();
+      mInstret = 0;
+      mInstLimit = ~0UL;
+      mProfiler = nullptr;
+      mPipeline = nullptr;
+      mOutOfOrder = nullptr;
+      mBranches = nullptr;
+      mCaches = nullptr;
+      mSampleEvery = 0;
+      mNextSample = ~0UL;
+      mUserLimit = ~0UL;
+      mCheckpoint.clear();
+      mHartId = hart;
+      mReservation = ~0UL;
+      mReservedValue = 0;
+      for (int i = 0; i < NUM_FUSIONS; i++) {
+         mFusionCounts[i] = 0;
+      }
+      for (int i = 0; i < NUM_REGS; i++) {
+         mRegs[i] = 0;
+      }
+      set_pc(0);
+   }
+
+public:
+
+   // Turn the JIT on or off for the next run_fast(). Returns false if this
+   // host can't run it, in which case run_fast() keeps using the interpreter.
+   bool set_jit(bool on) {
+#if defined(__x86_64__)
+      if (on && !mJit.ready()) {
+         return false;
+      }
+      mUseJit = on;
+      return true;
+#else
+      mUseJit = false;
+      return !on;
+#endif
+   }
+   bool get_jit() const {
+      return mUseJit;
+   }
+
+   // True once the program has asked to exit (or faulted), or any hart
+   // has called exit_group
+   bool halted() const {
+      return mHalted || mProcess->exited.load(memory_order_acquire);
+   }
+   // What the program gave ECALL a7 = 0 or exit to exit with, or what any
+   // hart gave exit_group
+   int64_t exit_code() const {
+      return mProcess->exited.load(memory_order_acquire) ? mProcess->exit_code : mExitCode;
+   }
+   // True if it was a fault that halted the machine
+   bool faulted() const {
+      return mFaulted;
+   }
+
+   // Give the program input to read instead of stdin and collect what it
+   // writes in output instead of stdout. Both have to outlive the machine's
+   // runs.
+   void set_console(const string *input, string *output) {
+      mInput = input;
+      mInputPos = 0;
+      mOutput = output;
+   }
+   // Send the machine's messages (faults, unsupported instructions) to out
+   void set_log(ostream *out) {
+      mLog = out;
+   }
+   // Write out what the program has written to stdout so far, and wait
+   // until it is out. Done when it exits, faults or reads stdin.
+   void flush_console() {
+      if (mConsoleUsed) {
+         Console::get().write(mConsoleOut.data(), mConsoleOut.size());
+         mConsoleOut.clear();
+         Console::get().flush();
+      }
+   }
+
+   // Save the machine as it is now, memory included, for restore() to go
+   // back to. Memory is not copied: each page is saved the first time it
+   // is written after this, so restore() only costs as much as the pages
+   // the program wrote. Only for a machine with one hart, and not while it
+   // runs. Mapping more memory (load_elf(), map_image()) drops the
+   // snapshot.
+   void snapshot() {
+      mSnapshot.pc = mPC;
+      for (int i = 0; i < NUM_REGS; i++) {
+         mSnapshot.regs[i] = mRegs[i];
+      }
+      mSnapshot.satp = mMem.satp();
+      mSnapshot.halted = mHalted;
+      mSnapshot.faulted = mFaulted;
+      mSnapshot.exit_code = mExitCode;
+      mSnapshot.input_pos = mInputPos;
+      mSnapshot.instret = mInstret;
+      mSnapshot.heap = mProcess->heap;
+      mSnapshot.free_ranges = mProcess->free_ranges;
+      mMem.snapshot();
+   }
+
+   // The profiler's view of a JAL or JALR to target, made with sp as it
+   // was. Following the RISC-V hints for return address stacks, linking x1
+   // or x5 is a call, and a JALR through x1 or x5 that doesn't link that
+   // same register is a return.
+   void track_call(const DecodeOut &inst, uint64_t target, int64_t sp) {
+      bool link = inst.rd == 1 || inst.rd == 5;
+      bool through = inst.kind == I_JALR && (inst.rs1 == 1 || inst.rs1 == 5);
+      if (through && (!link || inst.rd != inst.rs1) && !mCallStack.empty()) {
+         mCallStack.pop_back();
+      }
+      if (link && mCallStack.size() < MAX_PROFILE_DEPTH) {
+         mCallStack.push_back(make_pair(target, sp));
+      }
+   }
+
+   // Called when the instruction count reaches mInstLimit, with the PC and
+   // registers as they are. Gives the profiler its sample if that is what
+   // is due, and returns true if the run can go on.
+   bool profile_sample(int64_t pc, const int64_t *regs) {
+      if (!mProfiler || mInstret < mNextSample) {
+         return false;
+      }
+      // A call whose sp is below ours has returned some other way
+      // (longjmp, an exception, or a return we didn't see)
+      while (!mCallStack.empty() && mCallStack.back().second < regs[2]) {
+         mCallStack.pop_back();
+      }
+      vector<uint64_t> stack(1, mProfileRoot);
+      for (auto &call : mCallStack) {
+         stack.push_back(call.first);
+      }
+      stack.push_back(pc);
+      mProfiler->add(stack);
+      mNextSample = mInstret + mSampleEvery;
+      mInstLimit = min(mUserLimit, mNextSample);
+      return mInstret < mUserLimit;
+   }
+
+   // Go back to the last snapshot(). Decoded code is only dropped if the
+   // program wrote to a page it came from (or satp changed), so a guest
+   // that doesn't modify its code keeps its translated blocks. Returns
+   // false if there is no snapshot.
+   bool restore() {
+      bool code;
+      if (!mMem.restore(code)) {
+         return false;
+      }
+      if (code) {
+         forget_decodes();
+      }
+      mPC = mSnapshot.pc;
+      for (int i = 0; i < NUM_REGS; i++) {
+         mRegs[i] = mSnapshot.regs[i];
+      }
+      if (mMem.set_satp(mSnapshot.satp)) {
+         forget_decodes();
+      }
+      mHalted = mSnapshot.halted;
+      mFaulted = mSnapshot.faulted;
+      mExitCode = mSnapshot.exit_code;
+      mInputPos = mSnapshot.input_pos;
+      mInstret = mSnapshot.instret;
+      mProcess->heap = mSnapshot.heap;
+      mProcess->free_ranges = mSnapshot.free_ranges;
+      mProcess->exited.store(false);
+      mReservation = ~0UL;
+      mCallStack.clear();
+      // Restoring isn't logged, so the next checkpoint is a full one
+      mCheckpoint.clear();
+      return true;
+   }
+
+   // Save the machine to path as a checkpoint file (see CheckpointHeader),
+   // along with end_pc, for load_checkpoint() to go on from. The first
+   // checkpoint holds every page that isn't all zeros. After that, memory
+   // logs the pages written (the same way as for a snapshot), and the next
+   // checkpoint only holds those and names the one before as its parent,
+   // so a long run costs as much disk as it writes. Mapping more memory
+   // makes the next one full again. The file is written under a temporary
+   // name first, so a crash never leaves half a checkpoint at path. Only
+   // for a machine with one hart, and not while it runs. Returns false
+   // after saying why if the file can't be written.
+   bool save_checkpoint(const string &path, int64_t end_pc) {
+      // What the program wrote before the checkpoint isn't written again
+      // after a resume
+      flush_console();
+      CheckpointHeader header = {};
+      memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+      header.version = CHECKPOINT_VERSION;
+      string parent = mCheckpoint.substr(mCheckpoint.rfind('/') + 1);
+      bool full = mCheckpoint.empty() || !mMem.logging() || parent.size() >= sizeof(header.parent);
+      if (!full) {
+         strcpy(header.parent, parent.c_str());
+      }
+      vector<CheckpointRegion> regions = mMem.regions();
+      vector<uint64_t> pages = mMem.checkpoint_pages(full);
+      header.num_regions = regions.size();
+      header.num_pages = pages.size();
+      uint64_t index_end = sizeof(header) + regions.size() * sizeof(CheckpointRegion) +
+                           pages.size() * sizeof(uint64_t);
+      header.pages_offset = (index_end + GUEST_PAGE_OFFSET) & ~GUEST_PAGE_OFFSET;
+      header.pc = mPC;
+      for (int i = 0; i < NUM_REGS; i++) {
+         header.regs[i] = mRegs[i];
+      }
+      header.satp = mMem.satp();
+      header.instret = mInstret;
+      header.exit_code = mExitCode;
+      header.end_pc = end_pc;
+      header.halted = mHalted;
+      header.faulted = mFaulted;
+      header.heap = mProcess->heap;
+
+      string temp = path + ".tmp";
+      int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      bool written = fd >= 0 &&
+         pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+         pwrite(fd, regions.data(), regions.size() * sizeof(CheckpointRegion), sizeof(header)) ==
+            static_cast<ssize_t>(regions.size() * sizeof(CheckpointRegion)) &&
+         pwrite(fd, pages.data(), pages.size() * sizeof(uint64_t),
+                sizeof(header) + regions.size() * sizeof(CheckpointRegion)) ==
+            static_cast<ssize_t>(pages.size() * sizeof(uint64_t));
+      for (uint64_t i = 0; written && i < pages.size(); i++) {
+         written = pwrite(fd, mMem.page_data(pages[i]), GUEST_PAGE_SIZE,
+                          header.pages_offset + i * GUEST_PAGE_SIZE) == GUEST_PAGE_SIZE;
+      }
+      if (fd >= 0 && close(fd) != 0) {
+         written = false;
+      }
+      if (!written || rename(temp.c_str(), path.c_str()) != 0) {
+         log() << "[CHECKPOINT] Could not write " << path << '\n';
+         unlink(temp.c_str());
+         return false;
+      }
+      mCheckpoint = path;
+      mMem.start_log();
+      return true;
+   }
+
+   // Go on from the checkpoint in path, and every checkpoint it adds to,
+   // setting end_pc to what it was saved with. The machine has to be new,
+   // with no memory (Machine(0)). Memory is laid out as it was, and each
+   // page is mapped from the newest file that holds it rather than read, so
+   // only the pages the program uses are ever loaded. Checkpoints saved
+   // after this add to path. Returns false after saying why if a file in
+   // the chain can't be read or isn't a checkpoint, leaving the machine
+   // unusable.
+   bool load_checkpoint(const string &path, int64_t &end_pc) {
+      // The chain, newest first
+      vector<int> files;
+      vector<CheckpointHeader> headers;
+      string name = path;
+      bool loaded = true;
+      while (loaded) {
+         CheckpointHeader header;
+         int fd = open(name.c_str(), O_RDONLY);
+         loaded = fd >= 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                  memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+                  header.version == CHECKPOINT_VERSION &&
+                  headers.size() < MAX_CHECKPOINT_CHAIN;
+         if (!loaded) {
+            log() << "[CHECKPOINT] " << name << " is not a checkpoint that can be loaded\n";
+            if (fd >= 0) {
+               close(fd);
+            }
+            break;
+         }
+         files.push_back(fd);
+         headers.push_back(header);
+         header.parent[sizeof(header.parent) - 1] = 0;
+         if (!header.parent[0]) {
+            break;
+         }
+         name = name.substr(0, name.rfind('/') + 1) + header.parent;
+      }
+
+      // Memory as the newest one has it, then the pages, oldest file first
+      if (loaded) {
+         vector<CheckpointRegion> regions(headers[0].num_regions);
+         loaded = pread(files[0], regions.data(), regions.size() * sizeof(CheckpointRegion),
+                        sizeof(CheckpointHeader)) ==
+                  static_cast<ssize_t>(regions.size() * sizeof(CheckpointRegion));
+         for (const CheckpointRegion &region : regions) {
+            mMem.map(region.base, region.size, region.perms);
+         }
+      }
+      for (size_t file = files.size(); loaded && file-- > 0; ) {
+         const CheckpointHeader &header = headers[file];
+         vector<uint64_t> pages(header.num_pages);
+         loaded = pread(files[file], pages.data(), pages.size() * sizeof(uint64_t),
+                        sizeof(header) + header.num_regions * sizeof(CheckpointRegion)) ==
+                  static_cast<ssize_t>(pages.size() * sizeof(uint64_t));
+         // Each run of pages that follow each other is one mapping
+         for (uint64_t first = 0, last; loaded && first < pages.size(); first = last) {
+            for (last = first + 1;
+                 last < pages.size() && pages[last] == pages[last - 1] + GUEST_PAGE_SIZE; last++) {
+            }
+            loaded = mMem.map_checkpoint(pages[first], files[file],
+                                         header.pages_offset + first * GUEST_PAGE_SIZE, last - first);
+         }
+         if (!loaded) {
+            log() << "[CHECKPOINT] Could not map the pages of a checkpoint in the chain of " << path << '\n';
+         }
+      }
+      for (int fd : files) {
+         close(fd);
+      }
+      if (!loaded) {
+         return false;
+      }
+
+      const CheckpointHeader &header = headers[0];
+      mPC = header.pc;
+      for (int i = 1; i < NUM_REGS; i++) {
+         mRegs[i] = header.regs[i];
+      }
+      mMem.set_satp(header.satp);
+      mInstret = header.instret;
+      mExitCode = header.exit_code;
+      mHalted = header.halted;
+      mFaulted = header.faulted;
+      mProcess->heap = header.heap;
+      end_pc = header.end_pc;
+      mCheckpoint = path;
+      mMem.start_log();
+      return true;
+   }
+
+   // How many pages the program wrote since the last snapshot() or restore()
+   size_t dirty_pages() const {
+      return mMem.dirty_pages();
+   }
+
+   // Instructions retired so far. The stages count each one, and run_fast()
+   // a block at a time (run_jit() only counts the ones it interprets).
+   uint64_t instructions() const {
+      return mInstret;
+   }
+   // What those instructions were. The stages and run_fast() count them
+   // all; run_jit() only counts the ones it interprets.
+   const MachineStats &stats() {
+      for (auto &entry : mBlocks) {
+         fold_stats(entry.second);
+      }
+      for (Block *blk : mDeadBlocks) {
+         fold_stats(blk);
+      }
+      return mStats;
+   }
+   // Make run_fast() return at the first block boundary once instructions()
+   // reaches limit. The PC is left on the next instruction to run.
+   void set_instruction_limit(uint64_t limit) {
+      mUserLimit = limit;
+      mInstLimit = min(mUserLimit, mNextSample);
+   }
+
+   // Send every instruction the stages retire from now on through the
+   // timing model pipeline (nullptr to stop). run_fast() and run_jit()
+   // don't.
+   void set_pipeline(PipelineModel *pipeline) {
+      mPipeline = pipeline;
+   }
+   // The same for the out-of-order timing model core
+   void set_out_of_order(OutOfOrderModel *core) {
+      mOutOfOrder = core;
+   }
+
+   // Pass every fetch and data access of the stages through caches from
+   // now on (nullptr to stop). run_fast() and run_jit() don't.
+   void set_caches(CacheModel *caches) {
+      mCaches = caches;
+   }
+
+   // Tell branches how every branch and jump goes from now on (nullptr to
+   // stop). The stages and run_fast() do; run_jit() doesn't.
+   void set_branch_model(BranchModel *branches) {
+      mBranches = branches;
+   }
+
+   // Give profiler a sample of the call stack every every instructions
+   // from now on, or stop with nullptr. The stack is kept the way a return
+   // address stack would keep it (see track_call()), so it only has calls
+   // made after this. The stages and run_fast() take the samples, at the
+   // start of a block for run_fast(); run_jit() takes none.
+   void set_profiler(Profiler *profiler, uint64_t every) {
+      mProfiler = profiler;
+      mSampleEvery = every;
+      mNextSample = profiler ? mInstret + every : ~0UL;
+      mInstLimit = min(mUserLimit, mNextSample);
+      mCallStack.clear();
+      mProfileRoot = mPC;
+   }
+
+   // Map size bytes of the program file fd into guest memory at base (see
+   // GuestMemory::map_file). Returns false if that fails.
+   bool map_image(int64_t base, int fd, uint64_t size) {
+      return mMem.map_file(base, fd, 0, size, PERM_R | PERM_W | PERM_X);
+   }
+
+   // Load the RISC-V ELF64 executable fd. Each PT_LOAD segment is mapped
+   // at its address with its own permissions, and the part past the file
+   // data (.bss) reads as zeros. The PC starts at the entry point, sp at
+   // the top of a stack_size stack below STACK_TOP, and gp at
+   // __global_pointer$ if the symbol table has it. The heap starts after
+   // the last segment, and the mmap() area ends a guard page below the
+   // stack (see GuestHeap). Returns false (after saying why) if the file
+   // can't be loaded.
+   bool load_elf(int fd, uint64_t stack_size) {
+      Elf64_Ehdr header;
+      if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+          memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+          header.e_ident[EI_CLASS] != ELFCLASS64 ||
+          header.e_ident[EI_DATA] != ELFDATA2LSB ||
+          header.e_machine != EM_RISCV) {
+         log() << "[ELF] Not a 64-bit little endian RISC-V ELF file\n";
+         return false;
+      }
+      if (header.e_type != ET_EXEC) {
+         log() << "[ELF] Only static executables (ET_EXEC) can be loaded\n";
+         return false;
+      }
+
+      uint64_t program_end = 0;
+      for (int i = 0; i < header.e_phnum; i++) {
+         Elf64_Phdr segment;
+         if (pread(fd, &segment, sizeof(segment), header.e_phoff + i * header.e_phentsize) != sizeof(segment)) {
+            log() << "[ELF] Truncated program header\n";
+            return false;
+         }
+         if (segment.p_type != PT_LOAD || segment.p_memsz == 0) {
+            continue;
+         }
+         if ((segment.p_vaddr - segment.p_offset) & GUEST_PAGE_OFFSET) {
+            log() << "[ELF] Segment " << i << " is not page aligned in the file\n";
+            return false;
+         }
+         uint8_t perms = ((segment.p_flags & PF_R) ? PERM_R : 0) |
+                         ((segment.p_flags & PF_W) ? PERM_W : 0) |
+                         ((segment.p_flags & PF_X) ? PERM_X : 0);
+         uint64_t start = segment.p_vaddr & ~GUEST_PAGE_OFFSET;
+         uint64_t file_end = segment.p_vaddr + segment.p_filesz;
+         uint64_t mem_end = segment.p_vaddr + segment.p_memsz;
+         uint64_t file_pages_end = (file_end + GUEST_PAGE_OFFSET) & ~GUEST_PAGE_OFFSET;
+         uint64_t mem_pages_end = (mem_end + GUEST_PAGE_OFFSET) & ~GUEST_PAGE_OFFSET;
+         program_end = max(program_end, mem_pages_end);
+
+         if (segment.p_filesz > 0) {
+            uint64_t offset = segment.p_offset - (segment.p_vaddr - start);
+            if (!mMem.map_file(start, fd, offset, file_end - start, perms)) {
+               // The host's pages are bigger than ours: copy the data instead
+               vector<char> data(segment.p_filesz);
+               if (pread(fd, data.data(), data.size(), segment.p_offset) != (ssize_t)data.size()) {
+                  log() << "[ELF] Truncated segment " << i << '\n';
+                  return false;
+               }
+               mMem.map(start, file_pages_end - start, perms);
+               mMem.load(segment.p_vaddr, data.data(), data.size());
+            }
+            if (mem_end > file_end) {
+               // The rest of the last file page is .bss, not whatever
+               // follows the segment in the file
+               mMem.load(file_end, nullptr, min(mem_end, file_pages_end) - file_end);
+            }
+         }
+         else {
+            file_pages_end = start;
+         }
+         if (mem_pages_end > file_pages_end) {
+            mMem.map(file_pages_end, mem_pages_end - file_pages_end, perms);
+         }
+      }
+
+      mMem.map(STACK_TOP - stack_size, stack_size, PERM_R | PERM_W);
+      GuestHeap &heap = mProcess->heap;
+      heap.mmap_end = STACK_TOP - stack_size - GUEST_PAGE_SIZE;
+      heap.mmap_start = heap.mmap_end - ELF_MMAP_SIZE;
+      heap.mmap_next = heap.mmap_end;
+      mMem.map(heap.mmap_start, ELF_MMAP_SIZE, PERM_R | PERM_W);
+      if (program_end < heap.mmap_start) {
+         heap.brk_start = heap.brk = heap.brk_top = program_end;
+         heap.brk_end = min(program_end + ELF_HEAP_SIZE, heap.mmap_start);
+         mMem.map(heap.brk_start, heap.brk_end - heap.brk_start, PERM_R | PERM_W);
+      }
+      set_xreg(2, STACK_TOP);
+      set_xreg(3, elf_symbol(fd, header, "__global_pointer$"));
+      set_pc(header.e_entry);
+      return true;
+   }
+
+   // The value of the symbol called name in the ELF symbol table, or 0
+   static uint64_t elf_symbol(int fd, const Elf64_Ehdr &header, const char *name) {
+      uint64_t value = 0;
+      for_each_elf_symbol(fd, header, [&](const Elf64_Sym &symbol, const char *symbol_name) {
+         if (strcmp(symbol_name, name) == 0) {
+            value = symbol.st_value;
+            return false;
+         }
+         return true;
+      });
+      return value;
+   }
+
+   // Call f(symbol, name) for each symbol in the ELF symbol tables of fd,
+   // until it returns false
+   template<typename F>
+   static void for_each_elf_symbol(int fd, const Elf64_Ehdr &header, F f) {
+      for (int i = 0; i < header.e_shnum; i++) {
+         Elf64_Shdr symtab;
+         Elf64_Shdr strtab;
+         if (pread(fd, &symtab, sizeof(symtab), header.e_shoff + i * header.e_shentsize) != sizeof(symtab) ||
+             symtab.sh_type != SHT_SYMTAB || symtab.sh_link >= header.e_shnum ||
+             pread(fd, &strtab, sizeof(strtab), header.e_shoff + symtab.sh_link * header.e_shentsize) != sizeof(strtab)) {
+            continue;
+         }
+         vector<Elf64_Sym> symbols(symtab.sh_size / sizeof(Elf64_Sym));
+         vector<char> names(strtab.sh_size + 1);
+         if (pread(fd, symbols.data(), symbols.size() * sizeof(Elf64_Sym), symtab.sh_offset) < 0 ||
+             pread(fd, names.data(), strtab.sh_size, strtab.sh_offset) < 0) {
+            continue;
+         }
+         for (const Elf64_Sym &symbol : symbols) {
+            if (symbol.st_name < strtab.sh_size && !f(symbol, &names[symbol.st_name])) {
+               return;
+            }
+         }
+      }
+   }
+
+   // The functions in the symbol table of the ELF executable at path, by
+   // address, for Profiler::write(). Empty if path isn't one or has none.
+   static map<uint64_t, GuestFunction> elf_functions(const char *path) {
+      map<uint64_t, GuestFunction> functions;
+      int fd = open(path, O_RDONLY);
+      Elf64_Ehdr header;
+      if (fd >= 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+          memcmp(header.e_ident, ELFMAG, SELFMAG) == 0) {
+         for_each_elf_symbol(fd, header, [&](const Elf64_Sym &symbol, const char *name) {
+            if (ELF64_ST_TYPE(symbol.st_info) == STT_FUNC && symbol.st_value) {
+               functions[symbol.st_value] = GuestFunction{ symbol.st_size, name };
+            }
+            return true;
+         });
+      }
+      if (fd >= 0) {
+         close(fd);
+      }
+      return functions;
+   }
+
+   // Pages of guest memory that have been written to
+   uint64_t allocated_pages() const {
+      return mMem.allocated_pages();
+   }
+
+   // How many times run_fast() or run_jit() ran each kind of fused pair
+   uint64_t fusion_count(FusionKinds kind) const {
+      return mFusionCounts[kind];
+   }
+
+   // Run one instruction through all five stages. If it faults it is
+   // reported, the machine halts, and the PC stays on it.
+   void step() {
+      try {
+         fetch();
+         decode();
+         execute();
+         memory();
+         writeback();
+      }
+      catch (const GuestFault &fault) {
+         report_fault(fault, mPC);
+      }
+   }
+
+   // Say where the guest went wrong and stop the machine
+   void report_fault(const GuestFault &fault, int64_t pc) {
+      flush_console();
+      log() << "[MEMORY] " << ACCESS_NAMES[fault.access]
+           << (fault.page ? " page fault" : " fault") << " at address 0x"
+           << hex << fault.address << " (PC 0x" << pc << ")" << dec << '\n';
+      mRecorder.dump(log());
+      mHalted = true;
+      mFaulted = true;
+   }
+
+   int64_t get_pc() const {
+      return mPC;
+   }
+   void set_pc(int64_t to) {
+      mPC = to;
+   }
+
+    //truncates the value for us
+   int64_t get_xreg(int which) const {
+      which &= 0x1f; // Make sure the register number is 0 - 31
+      return mRegs[which];
+   }
+   void set_xreg(int which, int64_t value) {
+      which &= 0x1f;
+      mRegs[which] = value;
+   }
+    
+   void fetch() {
+      tRecorder = &mRecorder;
+      //read 4 bytes at a time
+    mFO.instruction = mMem.read<uint32_t>(mPC, ACCESS_EXEC);
+    if (mCaches) {
+        mCaches->fetch(mPC);
+    }
+   }
+   FetchOut &debug_fetch_out() { 
+      return mFO; 
+   }
+
+    void decode() {
+    // Instructions we have seen before come straight out of the predecode cache.
+    int slot = (mPC >> 2) & (DECODE_CACHE_SIZE - 1);
+    if (mDecodeTags[slot] == mPC) {
+        mDO = mDecodeCache[slot];
+        return;
+    }
+
+    // Only aligned PCs are cached so that invalidate_decode() can find them.
+    if (!decode_instruction()) {
+        report_invalid();
+    }
+    else if ((mPC & 3) == 0) {
+        cache_decode(slot, mPC);
+    }
+    }
 
+    DecodeOut &debug_decode_out() { 
+      return mDO; 
    }
 
-   else if (mDO.op == OP_IMM || mDO.op == OP_IMM_32) {
-       if (mDO.op == OP_IMM_32){
-            op_left = sign_extend(op_left, 31);
-            op_right = sign_extend(op_right, 31);
-       }
-       switch (mDO.funct3) {
-         case 0b000: 
-         //ADDI
-            cmd = ALU_ADD;
-            break;
-         
-         case 0b100:
-         //XORI
-            cmd = ALU_XOR;
-            break;
-
-         case 0b110:
-         //ORI
-            cmd = ALU_OR;
-            break;
-        
-         case 0b111:
-         //ANDI
-            cmd = ALU_AND;
-            break; 
-        
-         case 0b001:
-         //SLLI
-            cmd = ALU_SLL;
-         break;
-         
-         case 0b101:
-         //SRLI
-         if (mDO.funct7 == 0){
-            cmd = ALU_SRL;
-         }
-         //SRAI
-         else if (mDO.funct7 == 32){
-            cmd = ALU_SRA;
-         }
-         
-         break;
-      }
-   }
-   else if (mDO.op == JALR) {
-       // JALR has an offset and a register value that need to be added together.
-       cmd = ALU_ADD;
+    // telling the ALU what to do for each instruction
+   void execute() {
+   // Most instructions will follow left/right
+   // but some won't, so we need these:
+   int64_t op_left = get_xreg(mDO.rs1);
+   int64_t op_right = mDO.imm;
+   
+   if (mDO.op == BRANCH || mDO.op == OP || mDO.op == OP_32) {
+      // These compare or combine two registers
+      op_right = get_xreg(mDO.rs2);
    }
    else if (mDO.op == SYSTEM){
-       // JAL and ECALL effectively do nothing, but ALU has to do something
+       // ECALL effectively does nothing, but ALU has to do something
         op_left = 0;
         op_right = 0; 
-       cmd = ALU_ADD;
    }
    else if (mDO.op == JAL || mDO.op == AUIPC){
        //AUIPC adds program counter to imm
         op_left = mPC; 
-       cmd = ALU_ADD;
    }
    else if (mDO.op == LUI){
        //LUI sets result to upper imm by adding 0 to it in the ALU
         op_left = 0; 
-       cmd = ALU_ADD;
    }
    
-   mEO = alu(cmd, op_left, op_right);
+   // Shifts only use the low 6 bits (5 bits for the 32-bit versions)
+   bool word = (mDO.op == OP_32 || mDO.op == OP_IMM_32);
+   if (mDO.cmd == ALU_SLL || mDO.cmd == ALU_SRL || mDO.cmd == ALU_SRA) {
+       op_right &= word ? 0x1f : 0x3f;
+   }
+   if (word) {
+        op_left = (mDO.cmd == ALU_SRL) ? (op_left & 0xffffffff) : sign_extend(op_left, 31);
+        if (mDO.op == OP_32) {
+            op_right = sign_extend(op_right, 31);
+        }
    }
 
+   mEO = alu(mDO.cmd, op_left, op_right);
+   mAluLeft = op_left;
+   mAluRight = op_right;
+   if (word) {
+       // The 32-bit instructions sign extend their 32-bit result
+       mEO.result = sign_extend(mEO.result, 31);
+   }
+   else if (mDO.op == JALR) {
+       mEO.result &= ~1L;
+   }
+   else if (mDO.op == STORE || mDO.op == AMO) {
+       mEO.store_val = get_xreg(mDO.rs2);
+   }
+   else if (mDO.op == BRANCH) {
+       mEO.taken = branch_taken(mDO.funct3, op_left, op_right);
+   }
+   }
+
+// The flags are worked out here, only when someone wants to look at them
 ExecuteOut &debug_execute_out() { 
+      alu_flags(mEO, mDO.cmd, mAluLeft, mAluRight);
       return mEO; 
    }
 
@@ -553,34 +6644,35 @@ void memory() {
             // SB
             case 0b000: 
                 //debug statement
-                //cout << "sb " << mDO.right_val << " at " << mEO.result << '\n';
-                memory_write<uint8_t>(mEO.result, mDO.offset);
+                //cout << "sb " << mEO.store_val << " at " << mEO.result << '\n';
+                memory_write<uint8_t>(mEO.result, mEO.store_val);
                 
             break;
             //SH
             case 0b001:  
                 //debug statement
-                //cout << "sh " << mDO.right_val << " at " << mEO.result << '\n';
-                memory_write<uint16_t>(mEO.result, mDO.offset);
+                //cout << "sh " << mEO.store_val << " at " << mEO.result << '\n';
+                memory_write<uint16_t>(mEO.result, mEO.store_val);
                 
             break;
             //SW
             case 0b010:
                 //debug statement
-                //cout << "sw " << mDO.right_val << " at " << mEO.result << '\n';
-                memory_write<uint32_t>(mEO.result, mDO.offset);
+                //cout << "sw " << mEO.store_val << " at " << mEO.result << '\n';
+                memory_write<uint32_t>(mEO.result, mEO.store_val);
                 
             break;
             //SD
             case 0b011:
                 //debug statement
-                //cout << "sd " << mDO.right_val << " at " << mEO.result << '\n';
-                memory_write<uint64_t>(mEO.result, mDO.offset);
+                //cout << "sd " << mEO.store_val << " at " << mEO.result << '\n';
+                memory_write<uint64_t>(mEO.result, mEO.store_val);
                 
             break;
 
             default:
-                cerr << "[MEMORY: STORE]: Invalid funct3: " << mDO.funct3 << '\n';
+                log() << "[MEMORY: STORE]: Invalid funct3: " << mDO.funct3 << '\n';
+                mRecorder.dump(log());
             break;
         }
     }
@@ -623,14 +6715,30 @@ void memory() {
             break;
         
             default:
-                cerr << "[MEMORY: LOAD]: Invalid funct3: " << mDO.funct3 << '\n';
+                log() << "[MEMORY: LOAD]: Invalid funct3: " << mDO.funct3 << '\n';
+                mRecorder.dump(log());
             break;
         }
     }
+    else if (mDO.op == AMO) {
+        // The .W forms work on 32 bits and sign extend what they read
+        if (mDO.funct3 == 0b010) {
+            mMO.value = amo<int32_t>(mDO, mEO.result, mEO.store_val);
+        }
+        else {
+            mMO.value = amo<int64_t>(mDO, mEO.result, mEO.store_val);
+        }
+    }
     else {
         // If this is not a LOAD or STORE, then this stage just copies
         // the ALU result.
         mMO.value = mEO.result;
+        return;
+    }
+    if (mCaches) {
+        // Accesses are 1 << (funct3 & 3) bytes
+        int kind = mDO.op == LOAD ? mDO.funct3 : mDO.op == STORE ? 8 + mDO.funct3 : 12;
+        mCaches->data(mPC, mEO.result, 1 << (mDO.funct3 & 3), mDO.op != LOAD, kind);
     }
 }
 
@@ -640,150 +6748,1082 @@ MemoryOut &debug_memory_out() {
 
 
 void writeback() {
+int64_t pc = mPC;
 
 if (mDO.op == JAL || mDO.op == JALR){
+    if (mProfiler) {
+        track_call(mDO, mEO.result, get_xreg(2));
+    }
+    if (mBranches) {
+        mBranches->jump(mPC, mDO, mEO.result);
+    }
     set_xreg(mDO.rd, (mPC+4)); //If JAL or JALR, the rd is set to PC + 4
     mPC = mEO.result; //the actual PC is set to the result from execute (rs2+offset)
 }
 
 else if (mDO.op == BRANCH){
-    
-    switch (mDO.funct3){
-        //BEQ
-        case 0b000:
-            //True
-            if (mEO.z == 1){
-            mPC = mPC + mDO.offset; 
-            }
-            //false
-            else {
-            mPC = mPC + 4;
-            }
-        break;
+    // execute() already compared rs1 and rs2
+    if (mBranches) {
+        mBranches->branch(mPC, mPC + mDO.imm, mEO.taken);
+    }
+    if (mEO.taken){
+        mPC = mPC + mDO.imm;
+    }
+    else {
+        mPC = mPC + 4;
+    }
+}
+
+else if (mDO.kind == I_SFENCE_VMA){
+    sfence_vma(mDO, get_xreg(mDO.rs1), get_xreg(mDO.rs2));
+    mPC = mPC + 4;
+}
+
+else if (mDO.op == MISC_MEM){
+    fence(mDO);
+    mPC = mPC + 4;
+}
+
+else if (mDO.op == SYSTEM && mDO.kind != I_ECALL){
+    // CSR instructions
+    set_xreg(mDO.rd, csr_access(mDO, get_xreg(mDO.rs1)));
+    mPC = mPC + 4;
+}
+
+else if (mDO.op == SYSTEM){
+    int64_t a0 = get_xreg(10);
+    ecall(mRegs, a0);
+    set_xreg(10, a0);
+        mPC = mPC + 4;
+}
+
+else {
+    mPC = mPC + 4; 
+    set_xreg(mDO.rd, mMO.value);  //If not JAL, JALR, BRANCH, or SYSTEM, set PC to PC+4 and set rd to value from execute or memory stage
+}
 
-        //BNE
-        case 0b001:
-            //False
-            if (mEO.z == 1){
-            mPC = mPC + 4; 
+
+set_xreg(0, 0); //zeroing out the zero register
+mInstret++;
+if (mInstret >= mInstLimit) {
+    profile_sample(mPC, mRegs);
+}
+mStats.kinds[mDO.kind]++;
+if (mDO.op == BRANCH && mEO.taken) {
+    mStats.taken[mDO.kind - I_BEQ]++;
+}
+if (mDO.op == LOAD || mDO.op == STORE || mDO.op == AMO) {
+    mRecorder.record_access(pc, mFO.instruction, mDO.rd, mRegs[mDO.rd], mEO.result);
+}
+else {
+    mRecorder.record(pc, mFO.instruction, mDO.rd, mRegs[mDO.rd]);
+}
+if (mPipeline || mOutOfOrder) {
+    PipeSlot slot;
+    slot.pc = pc;
+    slot.fo = mFO;
+    slot.dec = mDO;
+    slot.eo = mEO;
+    slot.mo = mMO;
+    slot.redirect = mPC != pc + 4;
+    if (mPipeline) {
+        mPipeline->fetch(slot);
+    }
+    if (mOutOfOrder) {
+        mOutOfOrder->fetch(slot);
+    }
+}
+}
+
+// Fast execution mode. Rather than calling the five stages in turn, the
+// program is translated into Blocks, and every instruction jumps (computed
+// goto) straight to the handler for its concrete kind. A block's exit jumps
+// directly into the next block once that link is known. The registers stay in
+// a local array for the whole run. Runs until the PC reaches end_pc. The stage
+// methods above are the reference for what each handler does.
+void run_fast(int64_t end_pc) {
+    tRecorder = &mRecorder;
+#if defined(__x86_64__)
+    if (mUseJit) {
+        run_jit(end_pc);
+        return;
+    }
+#endif
+    if (mBlocksForJit) {
+        free_blocks();
+        mBlocksForJit = false;
+    }
+    if (halted()) {
+        return;
+    }
+    static void *const handlers[NUM_HANDLERS] = {
+        &&do_LUI, &&do_AUIPC, &&do_JAL, &&do_JALR,
+        &&do_BEQ, &&do_BNE, &&do_BLT, &&do_BGE, &&do_BLTU, &&do_BGEU,
+        &&do_LB, &&do_LH, &&do_LW, &&do_LD, &&do_LBU, &&do_LHU, &&do_LWU,
+        &&do_SB, &&do_SH, &&do_SW, &&do_SD,
+        &&do_ADDI, &&do_XORI, &&do_ORI, &&do_ANDI, &&do_SLLI, &&do_SRLI, &&do_SRAI,
+        &&do_ADDIW, &&do_SLLIW, &&do_SRLIW, &&do_SRAIW,
+        &&do_ADD, &&do_SUB, &&do_SLL, &&do_XOR, &&do_SRL, &&do_SRA, &&do_OR, &&do_AND,
+        &&do_MUL, &&do_DIV, &&do_REM,
+        &&do_ADDW, &&do_SUBW, &&do_SLLW, &&do_SRLW, &&do_SRAW,
+        &&do_MULW, &&do_DIVW, &&do_REMW,
+        &&do_ECALL,
+        &&do_CSRRW, &&do_CSRRS, &&do_CSRRC, &&do_CSRRWI, &&do_CSRRSI, &&do_CSRRCI,
+        &&do_SFENCE_VMA,
+        &&do_FENCE, &&do_FENCE_I,
+        &&do_LR_W, &&do_SC_W, &&do_AMOSWAP_W, &&do_AMOADD_W, &&do_AMOXOR_W, &&do_AMOAND_W,
+        &&do_AMOOR_W, &&do_AMOMIN_W, &&do_AMOMAX_W, &&do_AMOMINU_W, &&do_AMOMAXU_W,
+        &&do_LR_D, &&do_SC_D, &&do_AMOSWAP_D, &&do_AMOADD_D, &&do_AMOXOR_D, &&do_AMOAND_D,
+        &&do_AMOOR_D, &&do_AMOMIN_D, &&do_AMOMAX_D, &&do_AMOMINU_D, &&do_AMOMAXU_D,
+        &&do_INVALID,
+        &&do_FALLTHROUGH,
+        &&do_FUSED_CONST, &&do_FUSED_LOAD_GLOBAL, &&do_FUSED_CALL,
+        &&do_SUB_BEQ, &&do_SUB_BNE, &&do_SUB_BLT, &&do_SUB_BGE, &&do_SUB_BLTU, &&do_SUB_BGEU,
+        &&do_ADDI_BEQ, &&do_ADDI_BNE, &&do_ADDI_BLT, &&do_ADDI_BGE, &&do_ADDI_BLTU, &&do_ADDI_BGEU
+    };
+    int64_t x[NUM_REGS];
+    for (int i = 0; i < NUM_REGS; i++) {
+        x[i] = mRegs[i];
+    }
+    int64_t pc = mPC;
+    Block *blk;
+    const BlockInst *ip;
+    const atomic<bool> &group_exited = mProcess->exited;
+
+// Every block is counted as retired when it is entered. Leaving one early
+// takes back the instructions from pc on.
+#define COUNT_BLOCK() \
+    mInstret += (blk->next_pc - blk->pc) >> 2; \
+    blk->runs++; \
+    mRecorder.record_block(blk->pc, (blk->next_pc - blk->pc) >> 2)
+#define UNCOUNT_FROM(pc) \
+    mInstret -= (blk->next_pc - (pc)) >> 2; \
+    uncount_stats(blk, pc)
+// Start running the block at pc
+#define ENTER_BLOCK() \
+    if (pc == end_pc || (mInstret >= mInstLimit && !profile_sample(pc, x))) goto done; \
+    if (group_exited.load(memory_order_relaxed)) goto done; \
+    if (blocks_dropped()) tidy_blocks(); \
+    blk = get_block(pc, end_pc, handlers); \
+    COUNT_BLOCK(); \
+    ip = blk->insts.data(); \
+    goto *ip->handler
+// Leave the block through one of its links, filling the link in the first time
+#define CHAIN(link, target) { \
+    if ((mInstret >= mInstLimit && !profile_sample((target), x)) || \
+        group_exited.load(memory_order_relaxed)) { \
+        pc = (target); \
+        goto done; \
+    } \
+    if (!(link)) { \
+        pc = (target); \
+        if (pc == end_pc) goto done; \
+        (link) = get_block(pc, end_pc, handlers); \
+        (link)->callers.push_back(blk); \
+    } \
+    blk = (link); \
+    COUNT_BLOCK(); \
+    ip = blk->insts.data(); \
+    goto *ip->handler; }
+#define NEXT() \
+    ip++; \
+    goto *ip->handler
+// Write rd (x0 stays zero) and go on to the next instruction in the block
+#define FAST_RD(value) \
+    x[ip->dec.rd] = (value); \
+    x[0] = 0; \
+    NEXT()
+// A store may have written over code we translated. If so, leave the block
+// right after it so the rest gets translated again (if it was this block).
+#define FAST_STORE(type) \
+    memory_write<type>(RS1 + IMM, RS2); \
+    if (blocks_dropped()) { \
+        pc = blk->pc + 4 * (ip - blk->insts.data() + 1); \
+        UNCOUNT_FROM(pc); \
+        ENTER_BLOCK(); \
+    } \
+    NEXT()
+#define BRANCH_IF(cond) \
+    if (mBranches) { \
+        mBranches->branch(blk->next_pc - 4, IMM, (cond)); \
+    } \
+    if (cond) { \
+        blk->taken_runs++; \
+        CHAIN(blk->taken, IMM) \
+    } \
+    CHAIN(blk->fallthrough, blk->next_pc)
+#define IMM ip->dec.imm
+#define RS1 x[ip->dec.rs1]
+#define RS2 x[ip->dec.rs2]
+#define URS1 static_cast<uint64_t>(x[ip->dec.rs1])
+#define URS2 static_cast<uint64_t>(x[ip->dec.rs2])
+#define W(value) static_cast<int64_t>(static_cast<int32_t>(value))
+
+    // A GuestFault from any handler (or from translating the next block)
+    // stops the run on the instruction that caused it
+    try {
+    ENTER_BLOCK();
+
+// AUIPC is translated as a LUI of the finished address
+do_LUI:
+do_AUIPC:
+    FAST_RD(IMM);
+do_JAL:
+    if (mProfiler) {
+        track_call(ip->dec, IMM, x[2]);
+    }
+    if (mBranches) {
+        mBranches->jump(blk->next_pc - 4, ip->dec, IMM);
+    }
+    x[ip->dec.rd] = blk->next_pc;
+    x[0] = 0;
+    CHAIN(blk->taken, IMM);
+do_JALR: {
+    // A JALR can go somewhere new each time, so its link only remembers the
+    // last target and has to be checked
+    int64_t target = (RS1 + IMM) & ~1L;
+    if (mProfiler) {
+        track_call(ip->dec, target, x[2]);
+    }
+    if (mBranches) {
+        mBranches->jump(blk->next_pc - 4, ip->dec, target);
+    }
+    x[ip->dec.rd] = blk->next_pc;
+    x[0] = 0;
+    if (blk->taken_pc != target) {
+        drop_link(blk, blk->taken);
+        blk->taken_pc = target;
+    }
+    CHAIN(blk->taken, target);
+}
+
+// Branch offsets were turned into target PCs by translate_block()
+do_BEQ: BRANCH_IF(RS1 == RS2);
+do_BNE: BRANCH_IF(RS1 != RS2);
+do_BLT: BRANCH_IF(RS1 < RS2);
+do_BGE: BRANCH_IF(RS1 >= RS2);
+do_BLTU: BRANCH_IF(URS1 < URS2);
+do_BGEU: BRANCH_IF(URS1 >= URS2);
+
+do_LB:  FAST_RD(memory_read<int8_t>(RS1 + IMM));
+do_LH:  FAST_RD(memory_read<int16_t>(RS1 + IMM));
+do_LW:  FAST_RD(memory_read<int32_t>(RS1 + IMM));
+do_LD:  FAST_RD(memory_read<int64_t>(RS1 + IMM));
+do_LBU: FAST_RD(memory_read<uint8_t>(RS1 + IMM));
+do_LHU: FAST_RD(memory_read<uint16_t>(RS1 + IMM));
+do_LWU: FAST_RD(memory_read<uint32_t>(RS1 + IMM));
+
+do_SB: FAST_STORE(uint8_t);
+do_SH: FAST_STORE(uint16_t);
+do_SW: FAST_STORE(uint32_t);
+do_SD: FAST_STORE(uint64_t);
+
+// The shift immediates were already cut down to the shift amount by decode
+do_ADDI:  FAST_RD(RS1 + IMM);
+do_XORI:  FAST_RD(RS1 ^ IMM);
+do_ORI:   FAST_RD(RS1 | IMM);
+do_ANDI:  FAST_RD(RS1 & IMM);
+do_SLLI:  FAST_RD(URS1 << IMM);
+do_SRLI:  FAST_RD(URS1 >> IMM);
+do_SRAI:  FAST_RD(RS1 >> IMM);
+do_ADDIW: FAST_RD(W(URS1 + IMM));
+do_SLLIW: FAST_RD(W(URS1 << (IMM & 0x1f)));
+do_SRLIW: FAST_RD(W(static_cast<uint32_t>(RS1) >> (IMM & 0x1f)));
+do_SRAIW: FAST_RD(W(RS1) >> (IMM & 0x1f));
+
+do_ADD:  FAST_RD(URS1 + URS2);
+do_SUB:  FAST_RD(URS1 - URS2);
+do_SLL:  FAST_RD(URS1 << (RS2 & 0x3f));
+do_XOR:  FAST_RD(RS1 ^ RS2);
+do_SRL:  FAST_RD(URS1 >> (RS2 & 0x3f));
+do_SRA:  FAST_RD(RS1 >> (RS2 & 0x3f));
+do_OR:   FAST_RD(RS1 | RS2);
+do_AND:  FAST_RD(RS1 & RS2);
+do_MUL:  FAST_RD(URS1 * URS2);
+do_DIV:  FAST_RD(div64(RS1, RS2));
+do_REM:  FAST_RD(rem64(RS1, RS2));
+do_ADDW: FAST_RD(W(URS1 + URS2));
+do_SUBW: FAST_RD(W(URS1 - URS2));
+do_SLLW: FAST_RD(W(URS1 << (RS2 & 0x1f)));
+do_SRLW: FAST_RD(W(static_cast<uint32_t>(RS1) >> (RS2 & 0x1f)));
+do_SRAW: FAST_RD(W(RS1) >> (RS2 & 0x1f));
+do_MULW: FAST_RD(W(URS1 * URS2));
+do_DIVW: FAST_RD(W(div64(W(RS1), W(RS2))));
+do_REMW: FAST_RD(W(rem64(W(RS1), W(RS2))));
+
+do_ECALL:
+    ecall(x, x[10]);
+    if (mHalted) {
+        pc = blk->next_pc;
+        goto done;
+    }
+    CHAIN(blk->fallthrough, blk->next_pc);
+
+// These may change what the next PC maps to, so they don't chain:
+// ENTER_BLOCK() drops the stale blocks first.
+do_CSRRW:
+do_CSRRS:
+do_CSRRC:
+do_CSRRWI:
+do_CSRRSI:
+do_CSRRCI:
+    x[ip->dec.rd] = csr_access(ip->dec, RS1);
+    x[0] = 0;
+    pc = blk->next_pc;
+    ENTER_BLOCK();
+do_SFENCE_VMA:
+    sfence_vma(ip->dec, RS1, RS2);
+    pc = blk->next_pc;
+    ENTER_BLOCK();
+do_FENCE_I:
+    fence(ip->dec);
+    pc = blk->next_pc;
+    ENTER_BLOCK();
+
+do_FENCE:
+    fence(ip->dec);
+    NEXT();
+
+// LR, SC and the AMOs can write over code we translated, like a store
+do_LR_W: do_SC_W: do_AMOSWAP_W: do_AMOADD_W: do_AMOXOR_W: do_AMOAND_W:
+do_AMOOR_W: do_AMOMIN_W: do_AMOMAX_W: do_AMOMINU_W: do_AMOMAXU_W:
+    x[ip->dec.rd] = amo<int32_t>(ip->dec, RS1, RS2);
+    goto amo_done;
+do_LR_D: do_SC_D: do_AMOSWAP_D: do_AMOADD_D: do_AMOXOR_D: do_AMOAND_D:
+do_AMOOR_D: do_AMOMIN_D: do_AMOMAX_D: do_AMOMINU_D: do_AMOMAXU_D:
+    x[ip->dec.rd] = amo<int64_t>(ip->dec, RS1, RS2);
+amo_done:
+    x[0] = 0;
+    if (blocks_dropped()) {
+        pc = blk->pc + 4 * (ip - blk->insts.data() + 1);
+        UNCOUNT_FROM(pc);
+        ENTER_BLOCK();
+    }
+    NEXT();
+
+do_INVALID:
+    // Reported now it runs, after the rest of the block, so the dump shows
+    // how the guest got here. It ends its block.
+    mFO.instruction = mMem.read<uint32_t>(blk->next_pc - 4, ACCESS_EXEC);
+    report_invalid();
+do_FALLTHROUGH:
+    CHAIN(blk->fallthrough, blk->next_pc);
+
+// Fused pairs (see fuse_block). ip[0] is the first instruction of the pair
+// and ip[1] the second.
+do_FUSED_CONST:
+    mFusionCounts[ip->fusion]++;
+    ip++;
+    FAST_RD(ip[-1].dec.imm);
+do_FUSED_LOAD_GLOBAL:
+    mFusionCounts[FUSE_LOAD_GLOBAL]++;
+    x[ip->dec.rd] = IMM;
+    x[0] = 0;
+    ip++;
+    FAST_RD(memory_read<int64_t>(ip[-1].dec.imm + IMM));
+do_FUSED_CALL:
+    mFusionCounts[FUSE_CALL]++;
+    if (mProfiler) {
+        track_call(ip[1].dec, blk->taken_pc, x[2]);
+    }
+    if (mBranches) {
+        mBranches->jump(blk->next_pc - 4, ip[1].dec, blk->taken_pc);
+    }
+    x[ip->dec.rd] = IMM;
+    x[ip[1].dec.rd] = blk->next_pc;
+    x[0] = 0;
+    CHAIN(blk->taken, blk->taken_pc);
+
+// The ALU half writes its register first, then the branch reads its operands
+#define FUSED_BRANCH(fusion, value, cond) \
+    mFusionCounts[fusion]++; \
+    x[ip->dec.rd] = (value); \
+    x[0] = 0; \
+    ip++; \
+    BRANCH_IF(cond)
+do_SUB_BEQ:  FUSED_BRANCH(FUSE_SUB_BRANCH, URS1 - URS2, RS1 == RS2);
+do_SUB_BNE:  FUSED_BRANCH(FUSE_SUB_BRANCH, URS1 - URS2, RS1 != RS2);
+do_SUB_BLT:  FUSED_BRANCH(FUSE_SUB_BRANCH, URS1 - URS2, RS1 < RS2);
+do_SUB_BGE:  FUSED_BRANCH(FUSE_SUB_BRANCH, URS1 - URS2, RS1 >= RS2);
+do_SUB_BLTU: FUSED_BRANCH(FUSE_SUB_BRANCH, URS1 - URS2, URS1 < URS2);
+do_SUB_BGEU: FUSED_BRANCH(FUSE_SUB_BRANCH, URS1 - URS2, URS1 >= URS2);
+do_ADDI_BEQ: FUSED_BRANCH(FUSE_ADDI_BRANCH, RS1 + IMM, RS1 == RS2);
+do_ADDI_BNE: FUSED_BRANCH(FUSE_ADDI_BRANCH, RS1 + IMM, RS1 != RS2);
+do_ADDI_BLT: FUSED_BRANCH(FUSE_ADDI_BRANCH, RS1 + IMM, RS1 < RS2);
+do_ADDI_BGE: FUSED_BRANCH(FUSE_ADDI_BRANCH, RS1 + IMM, RS1 >= RS2);
+do_ADDI_BLTU: FUSED_BRANCH(FUSE_ADDI_BRANCH, RS1 + IMM, URS1 < URS2);
+do_ADDI_BGEU: FUSED_BRANCH(FUSE_ADDI_BRANCH, RS1 + IMM, URS1 >= URS2);
+#undef FUSED_BRANCH
+    }
+    catch (const GuestFault &fault) {
+        // A fetch fault comes from translating the next block, which wasn't
+        // counted yet
+        if (fault.access == ACCESS_EXEC) {
+            pc = fault.address;
         }
-            //True
         else {
-            mPC = mPC + mDO.offset;
+            pc = blk->pc + 4 * (ip - blk->insts.data());
+            UNCOUNT_FROM(pc);
         }
-        break;
+        report_fault(fault, pc);
+    }
+
+#undef COUNT_BLOCK
+#undef UNCOUNT_FROM
+#undef ENTER_BLOCK
+#undef CHAIN
+#undef NEXT
+#undef FAST_RD
+#undef FAST_STORE
+#undef BRANCH_IF
+#undef IMM
+#undef RS1
+#undef RS2
+#undef URS1
+#undef URS2
+#undef W
 
-        //BLT
-        case 0b100:
-            //True
-            if (mEO.n == 1){
-                mPC = mPC + mDO.offset;
+done:
+    for (int i = 0; i < NUM_REGS; i++) {
+        mRegs[i] = x[i];
+    }
+    mPC = pc;
+}
+#if defined(__x86_64__)
+// JIT mode: run_fast() with every block compiled to x86-64 by jit_compile().
+// Compiled blocks run straight into each other once their exits are chained,
+// and only come back here for a JALR, for the first trip through an exit,
+// and for instructions the interpreter has to run.
+void run_jit(int64_t end_pc) {
+    if (!mBlocksForJit) {
+        free_blocks();
+        mBlocksForJit = true;
+    }
+    int64_t pc = mPC;
+    if (mMem.window()) {
+        static const bool handler_installed = install_jit_fault_handler();
+        (void)handler_installed;
+    }
+    tRunningJit = &mJit;
+    // Translating a block can fault; step() reports its own faults
+    try {
+        while (pc != end_pc && !halted()) {
+            if (blocks_dropped()) {
+                tidy_blocks();
             }
-            //False
-            else {
-                mPC = mPC + 4;
+            Block *blk = get_block(pc, end_pc, nullptr);
+            if (!blk->native) {
+                if (!mJit.has_room(blk->insts.size())) {
+                    free_blocks();
+                    blk = get_block(pc, end_pc, nullptr);
+                }
+                jit_compile(blk);
             }
-        break;
-
-        //BGE
-        case 0b101:
-            //False
-            if (mEO.n == 1){
-            mPC = mPC + 4; 
+            void *memory = jit_window() ? static_cast<void *>(mMem.window()) : mMem.page_cache();
+            JitExit out = reinterpret_cast<JitCode>(blk->native)(mRegs, memory, &mRecorder,
+                                                                 &mProcess->exited);
+            pc = out.pc;
+            if (pc & 1) {
+                // An instruction the compiled code left for the interpreter
+                mPC = pc & ~1L;
+                step();
+                pc = mPC;
             }
-            //True
-            else {
-            mPC = mPC + mDO.offset;
+            else if (out.patch && pc != end_pc && !mBlocksStale) {
+                // First time through this exit: compile the next block now and
+                // jump straight to it from now on.
+                Block *next = get_block(pc, end_pc, nullptr);
+                if (!next->native && mJit.has_room(next->insts.size())) {
+                    jit_compile(next);
+                }
+                if (next->native) {
+                    mJit.chain(out.patch, next->native);
+                    next->stubs.push_back(out.patch);
+                }
             }
-        break;
-
-        default:
-                cerr << "[Writeback: Branch]: Invalid funct3: " << mDO.funct3 << '\n';
-        break;
+        }
     }
+    catch (const GuestFault &fault) {
+        report_fault(fault, pc);
+    }
+    tRunningJit = nullptr;
+    mPC = pc;
 }
+#endif
 
-else if (mDO.op == SYSTEM){
- 
-    if (get_xreg(17) == 0){
-        exit(0);
+}; 
+
+
+// Open the program in path and load it into a new machine. It is either a
+// RISC-V ELF64 executable, which gets a stack of ram_size bytes (default
+// ELF_STACK_SIZE) and sets up the rest of its memory itself, or a flat
+// binary. A flat program is mapped rather than read at address 0, so only
+// the pages it uses are ever loaded, and gets ram_size bytes of RAM (default
+// MEM_SIZE, and always enough for the program). end_pc is set to where the
+// program stops: the end of a flat binary, or -1 for ELF, which runs until it
+// exits. Returns nullptr if the program can't be loaded, after saying why on
+// err (or on log, where the machine's own messages go).
+unique_ptr<Machine> load_program(const char *path, uint64_t ram_size, bool ram_window,
+                                 PageArena *arena, ostream &err, ostream &log, int64_t &end_pc) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        err << "File could not be opened.";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    int64_t size = info.st_size;
+
+    char magic[SELFMAG];
+    bool elf = pread(fd, magic, SELFMAG, 0) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+    end_pc = elf ? -1 : size;
+
+    // A flat program is all instructions
+    if (!elf && size % 4 != 0) {
+        err << "Incorrect File Length";
+        close(fd);
+        return nullptr;
     }
-    else if (get_xreg(17) == 1){
-        set_xreg(10, getchar());
+
+    unique_ptr<Machine> mach(new Machine(elf ? 0 : max<uint64_t>(ram_size ? ram_size : MEM_SIZE, size),
+                                         ram_window, arena));
+    mach->set_log(&log);
+    bool loaded = true;
+    if (elf) {
+        loaded = mach->load_elf(fd, ram_size ? ram_size : ELF_STACK_SIZE);
     }
-    else if (get_xreg(17) == 2){
-        putchar(static_cast<char>(get_xreg(10)));
+    else if (size > 0 && !mach->map_image(0, fd, size)) {
+        err << "File could not be mapped.";
+        loaded = false;
     }
-    
-        mPC = mPC + 4;
+    // The mappings stay after the file is closed
+    close(fd);
+    return loaded ? move(mach) : nullptr;
 }
 
-else {
-    mPC = mPC + 4; 
-    set_xreg(mDO.rd, mMO.value);  //If not JAL, JALR, BRANCH, or SYSTEM, set PC to PC+4 and set rd to value from execute or memory stage
-}
+// One program of a batch run (see run_batch())
+struct BatchJob {
+    string program;
+    string input;         // What it reads from the console
+    uint64_t max_insts;   // Instruction limit, 0 for none
+    uint64_t ram_size;    // As for --ram, 0 for the default
+};
 
+// How a batch job went
+struct BatchResult {
+    string status;        // "exit", "fault", "limit" or "error" (not loaded)
+    int64_t exit_code;
+    uint64_t instructions;
+    double seconds;       // Wall time, loading included
+    string output;        // What it wrote to the console
+    string log;           // The machine's messages
+};
 
-set_xreg(0, 0); //zeroing out the zero register
+// Read a batch manifest. Each line is one job,
+//   program [input [max_instructions [ram_MiB]]]
+// where input is a file the program reads its console input from, and "-"
+// (or leaving it out) gives it none. Blank lines and lines starting with #
+// are skipped. Returns false after saying why if the manifest or an input
+// file can't be read.
+bool read_manifest(const char *path, uint64_t ram_size, vector<BatchJob> &jobs) {
+    ifstream manifest(path);
+    if (!manifest) {
+        cout << "Manifest could not be opened.";
+        return false;
+    }
+    string line;
+    while (getline(manifest, line)) {
+        istringstream fields(line);
+        BatchJob job = { "", "", 0, ram_size };
+        string input = "-";
+        uint64_t ram_mib = 0;
+        if (!(fields >> job.program) || job.program[0] == '#') {
+            continue;
+        }
+        fields >> input >> job.max_insts >> ram_mib;
+        if (ram_mib) {
+            job.ram_size = ram_mib << 20;
+        }
+        if (input != "-") {
+            ifstream file(input, ios::binary);
+            if (!file) {
+                cout << "Input file " << input << " could not be opened.";
+                return false;
+            }
+            job.input.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        }
+        jobs.push_back(job);
+    }
+    return true;
 }
 
-}; 
+// Run one batch job on a machine of its own, with its pages from arena
+void run_batch_job(const BatchJob &job, PageArena &arena, BatchResult &result) {
+    auto start = chrono::steady_clock::now();
+    ostringstream log;
+    int64_t end_pc;
+    unique_ptr<Machine> mach = load_program(job.program.c_str(), job.ram_size, false, &arena,
+                                            log, log, end_pc);
+    result.exit_code = 0;
+    result.instructions = 0;
+    if (!mach) {
+        result.status = "error";
+    }
+    else {
+        mach->set_console(&job.input, &result.output);
+        if (job.max_insts) {
+            mach->set_instruction_limit(job.max_insts);
+        }
+        mach->run_fast(end_pc);
+        result.exit_code = mach->exit_code();
+        result.instructions = mach->instructions();
+        if (mach->faulted()) {
+            result.status = "fault";
+        }
+        else if (mach->halted() || mach->get_pc() == end_pc) {
+            result.status = "exit";
+        }
+        else {
+            result.status = "limit";
+        }
+        // Its pages go back to the arena here, before the clock stops
+        mach.reset();
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.log = log.str();
+}
 
+// Run every job in the manifest on a pool of num_threads worker threads,
+// each job on a machine of its own with the threaded-code core. Every
+// worker keeps a PageArena for the guest memory of the jobs it runs. When
+// they are all done, prints a line for each job, in manifest order, with
+// the status, exit code, instructions retired and wall time, followed by
+// what it wrote to the console. Its messages go to stderr.
+void run_batch(const vector<BatchJob> &jobs, int num_threads) {
+    vector<BatchResult> results(jobs.size());
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (int i = 0; i < num_threads; i++) {
+        workers.push_back(thread([&]() {
+            PageArena arena;
+            for (size_t job = next++; job < jobs.size(); job = next++) {
+                run_batch_job(jobs[job], arena, results[job]);
+            }
+        }));
+    }
+    // Only the workers run machines, so a signal should stop one of them
+    sigset_t old = block_stop_signals();
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const BatchResult &result = results[i];
+        cout << "[BATCH] " << i + 1 << ' ' << jobs[i].program << ": " << result.status;
+        if (result.status == "exit") {
+            cout << ' ' << result.exit_code;
+        }
+        cout << ", " << result.instructions << " instructions, "
+             << fixed << setprecision(6) << result.seconds << " s\n" << result.output;
+        if (!result.output.empty() && result.output.back() != '\n') {
+            cout << '\n';
+        }
+        if (!result.log.empty()) {
+            cerr << result.log;
+            if (result.log.back() != '\n') {
+                cerr << '\n';
+            }
+        }
+    }
+}
 
 int main (int argc, char *argv[]) {
 
-    // If a filename isn't entered then print error and exit
-    if (argc != 2){
-        cout << "Error: No File Name Provided";
-        return 0;
+    // Options come before the file name:
+    //   --fast   use the threaded-code core (Machine::run_fast) instead of
+    //            calling the five stages for every instruction
+    //   --jit    like --fast, but compile the blocks to x86-64 first
+    //   --fusion-stats  print how often each fused pair of instructions ran
+    //   --stats  print what the program retired when it ends (see
+    //            MachineStats::print()). --jit runs as --fast for this.
+    //   --pipeline  time the run on a five-stage in-order pipeline (see
+    //            PipelineModel) and print cycles, CPI and stalls. The
+    //            stages run it, so --fast and --jit are ignored.
+    //   --ooo[=KEY=N,...]  time the run on an out-of-order core as well
+    //            (see OutOfOrderModel, and parse_ooo_config() for the keys)
+    //            and print its IPC and where rename slots were lost. The
+    //            stages run it, so --fast and --jit are ignored.
+    //   --branch-stats  run the branch predictors of BranchModel on every
+    //            branch and jump, and print how each did when the program
+    //            ends. --jit runs as --fast for this.
+    //   --cache   pass every fetch, load and store of the stages through
+    //            a CacheModel and print its hits and misses. --l1i=CONFIG,
+    //            --l1d=CONFIG and --l2=CONFIG (see parse_cache_config())
+    //            and --memory-latency=N shape it, and turn it on too. The
+    //            stages run it, so --fast and --jit are ignored.
+    //   --profile=FILE  sample the guest call stack every --profile-every=N
+    //            instructions (default 10000) and write the samples to FILE
+    //            as folded stacks for a flame graph. --jit runs as --fast.
+    //   --ram-window  keep guest memory in one reserved host region so that
+    //                 --jit loads and stores need no page cache lookup
+    //   --ram=MiB  give the machine this much RAM (the stack starts at the
+    //              top). Only the pages the program touches use host memory.
+    //              For an ELF program this is the size of its stack.
+    //   --harts=N  run N harts on N host threads, all sharing memory and
+    //              starting at the same PC with their hart ID in a0
+    //   --batch=manifest  run every program in the manifest instead (see
+    //              read_manifest()), each on a machine of its own, and
+    //              report how each went
+    //   --threads=N  how many programs --batch runs at once (default: one
+    //              per host CPU)
+    //   --repeat=N  run the program N times, each time from a snapshot
+    //              taken once it is loaded (one hart only)
+    //   --checkpoint=PREFIX  save the machine to PREFIX.1, PREFIX.2, ...
+    //              every --checkpoint-every=N instructions (default 100
+    //              million). Each one after the first only holds the pages
+    //              written since the one before. (One hart, no --jit.)
+    //   --resume=FILE  go on from the checkpoint FILE instead of loading a
+    //              program
+    // The file is either a RISC-V ELF64 executable or a flat binary that is
+    // loaded at address 0 and runs until the PC reaches its end.
+    bool fast = false;
+    bool jit = false;
+    bool fusion_stats = false;
+    bool stats = false;
+    bool pipeline = false;
+    bool out_of_order = false;
+    OutOfOrderConfig ooo_config = DEFAULT_OOO_CONFIG;
+    bool branch_stats = false;
+    bool caches = false;
+    CacheConfig l1i_config = { 32 << 10, 8, 64, REPLACE_LRU, WRITE_BACK, 1 };
+    CacheConfig l1d_config = { 32 << 10, 8, 64, REPLACE_LRU, WRITE_BACK, 1 };
+    CacheConfig l2_config = { 1 << 20, 16, 64, REPLACE_LRU, WRITE_BACK, 12 };
+    int memory_latency = 100;
+    const char *profile = nullptr;
+    uint64_t profile_every = 10000;
+    bool ram_window = false;
+    uint64_t ram_size = 0;
+    int num_harts = 1;
+    int repeat = 1;
+    const char *checkpoint = nullptr;
+    uint64_t checkpoint_every = 100000000;
+    const char *resume = nullptr;
+    const char *manifest = nullptr;
+    int num_threads = thread::hardware_concurrency();
+    int arg = 1;
+    while (arg < argc && string(argv[arg]).compare(0, 2, "--") == 0) {
+        string option = argv[arg];
+        if (option == "--fast") {
+            fast = true;
+        }
+        else if (option == "--jit") {
+            fast = true;
+            jit = true;
+        }
+        else if (option == "--fusion-stats") {
+            fusion_stats = true;
+        }
+        else if (option == "--stats") {
+            stats = true;
+        }
+        else if (option == "--pipeline") {
+            pipeline = true;
+        }
+        else if (option == "--ooo" || option.compare(0, 6, "--ooo=") == 0) {
+            if (option.size() > 5 && !parse_ooo_config(option.substr(6), ooo_config)) {
+                cout << "Bad out-of-order configuration: " << option;
+                return 0;
+            }
+            out_of_order = true;
+        }
+        else if (option == "--branch-stats") {
+            branch_stats = true;
+        }
+        else if (option == "--cache") {
+            caches = true;
+        }
+        else if (option.compare(0, 6, "--l1i=") == 0 || option.compare(0, 6, "--l1d=") == 0 ||
+                 option.compare(0, 5, "--l2=") == 0) {
+            CacheConfig &config = option[4] == 'i' ? l1i_config : option[4] == 'd' ? l1d_config : l2_config;
+            if (!parse_cache_config(option.substr(option.find('=') + 1), config)) {
+                cout << "Bad cache configuration: " << option;
+                return 0;
+            }
+            caches = true;
+        }
+        else if (option.compare(0, 17, "--memory-latency=") == 0) {
+            memory_latency = atoi(option.c_str() + 17);
+            caches = true;
+        }
+        else if (option.compare(0, 10, "--profile=") == 0) {
+            profile = argv[arg] + 10;
+        }
+        else if (option.compare(0, 16, "--profile-every=") == 0) {
+            profile_every = strtoull(option.c_str() + 16, nullptr, 10);
+        }
+        else if (option == "--ram-window") {
+            ram_window = true;
+        }
+        else if (option.compare(0, 6, "--ram=") == 0) {
+            ram_size = strtoull(option.c_str() + 6, nullptr, 10) << 20;
+        }
+        else if (option.compare(0, 8, "--harts=") == 0) {
+            num_harts = atoi(option.c_str() + 8);
+            if (num_harts < 1 || num_harts > MAX_HARTS) {
+                cout << "--harts must be 1 to " << MAX_HARTS;
+                return 0;
+            }
+        }
+        else if (option.compare(0, 8, "--batch=") == 0) {
+            manifest = argv[arg] + 8;
+        }
+        else if (option.compare(0, 10, "--threads=") == 0) {
+            num_threads = atoi(option.c_str() + 10);
+        }
+        else if (option.compare(0, 9, "--repeat=") == 0) {
+            repeat = atoi(option.c_str() + 9);
+        }
+        else if (option.compare(0, 13, "--checkpoint=") == 0) {
+            checkpoint = argv[arg] + 13;
+        }
+        else if (option.compare(0, 19, "--checkpoint-every=") == 0) {
+            checkpoint_every = strtoull(option.c_str() + 19, nullptr, 10);
+        }
+        else if (option.compare(0, 9, "--resume=") == 0) {
+            resume = argv[arg] + 9;
+        }
+        else {
+            cout << "Unknown option: " << option;
+            return 0;
+        }
+        arg++;
     }
 
-    // Open binary file and return error and exit if unable to open
-    ifstream fin (argv[1], ios::binary);
-    if (!fin.is_open()) {
-        cout << "File could not be opened.";
+    install_recorder_signal_handlers();
+
+    if (repeat < 1 || (repeat > 1 && num_harts > 1)) {
+        cout << "--repeat must be at least 1, and needs a single hart";
+        return 0;
+    }
+    if ((checkpoint || resume || pipeline || out_of_order || caches) && num_harts > 1) {
+        cout << "--checkpoint, --resume, --pipeline, --ooo and --cache need a single hart";
+        return 0;
+    }
+    // The timing and cache models see what the stages do
+    if ((pipeline || out_of_order || caches) && fast) {
+        cerr << (pipeline ? "--pipeline" : out_of_order ? "--ooo" : "--cache") << " runs the five stages, not "
+             << (jit ? "--jit" : "--fast") << '\n';
+        fast = false;
+        jit = false;
+    }
+    if (profile_every == 0) {
+        cout << "--profile-every must be at least 1";
+        return 0;
+    }
+    if (checkpoint && (repeat > 1 || checkpoint_every == 0)) {
+        cout << "--checkpoint can't be used with --repeat, and --checkpoint-every must be at least 1";
         return 0;
     }
 
-    // Calculate file size
-    fin.seekg(0, ios::end);
-    int size = fin.tellg();
+    if (manifest) {
+        vector<BatchJob> jobs;
+        if (read_manifest(manifest, ram_size, jobs)) {
+            run_batch(jobs, max(num_threads, 1));
+        }
+        return 0;
+    }
 
-    // Return pointer to beginning
-    fin.seekg(0, ios::beg);
+    // If a filename isn't entered then print error and exit
+    if (arg != argc - (resume ? 0 : 1)){
+        cout << "Error: No File Name Provided";
+        return 0;
+    }
 
-    // If the size isn't a multiple of 4 then print error and exit
-    if (size % 4 != 0) {
-        cout << "Incorrect File Length";
+    // Load the program or the checkpoint, or print why not and exit
+    int64_t end_pc;
+    unique_ptr<Machine> boot;
+    if (resume) {
+        boot.reset(new Machine(0, ram_window));
+        if (!boot->load_checkpoint(resume, end_pc)) {
+            return 0;
+        }
+    }
+    else {
+        boot = load_program(argv[arg], ram_size, ram_window, nullptr, cout, cerr, end_pc);
+    }
+    if (!boot) {
         return 0;
     }
+    Machine &mach = *boot;
+    // Compiled code doesn't count instructions, so it can't stop for a
+    // checkpoint
+    if (jit && (checkpoint || stats || profile || branch_stats)) {
+        cerr << (checkpoint ? "--checkpoint" : stats ? "--stats" : profile ? "--profile" : "--branch-stats")
+             << " needs the interpreter, using --fast\n";
+    }
+    else if (jit && !mach.set_jit(true)) {
+        cerr << "The JIT is not available on this host, using --fast\n";
+    }
+
+    // The other harts start where mach does, each on a thread of its own.
+    // Each has a profiler and branch predictors of its own too.
+    vector<Profiler> profilers(num_harts);
+    if (profile) {
+        mach.set_profiler(&profilers[0], profile_every);
+    }
+    vector<BranchModel> branch_models(branch_stats ? num_harts : 0);
+    if (branch_stats) {
+        mach.set_branch_model(&branch_models[0]);
+    }
+    vector<unique_ptr<Machine>> harts;
+    for (int i = 1; i < num_harts; i++) {
+        harts.push_back(unique_ptr<Machine>(new Machine(mach, i)));
+        harts.back()->set_jit(mach.get_jit());
+        if (profile) {
+            harts.back()->set_profiler(&profilers[i], profile_every);
+        }
+        if (branch_stats) {
+            harts.back()->set_branch_model(&branch_models[i]);
+        }
+    }
+    vector<thread> threads;
+    for (auto &hart : harts) {
+        Machine *other = hart.get();
+        threads.push_back(thread([other, fast, end_pc]() {
+            if (fast) {
+                other->run_fast(end_pc);
+            }
+            while (!fast && other->get_pc() != end_pc && !other->halted()) {
+                other->step();
+            }
+            other->flush_console();
+        }));
+    }
 
-    // New array char pointer 262KB
-    char *arr = new char[262*1024];
+    PipelineModel timing;
+    if (pipeline) {
+        mach.set_pipeline(&timing);
+    }
+    OutOfOrderModel core(ooo_config);
+    if (out_of_order) {
+        mach.set_out_of_order(&core);
+    }
+    CacheModel cache_model(l1i_config, l1d_config, l2_config, memory_latency);
+    if (caches) {
+        mach.set_caches(&cache_model);
+    }
 
-    // Read from file and assign to array
-    fin.read (arr, size);
+    // Every run after the first starts from the machine as it was loaded
+    if (repeat > 1) {
+        mach.snapshot();
+    }
+    int checkpoints = 0;
+    for (int run = 0; run < repeat; run++) {
+        if (run > 0) {
+            mach.restore();
+        }
+        // With --checkpoint the machine stops every checkpoint_every
+        // instructions to save one, then goes on
+        uint64_t limit = checkpoint ? mach.instructions() + checkpoint_every : ~0UL;
+        mach.set_instruction_limit(limit);
+        for (;;) {
+            if (fast) {
+                mach.run_fast(end_pc);
+            }
+            //Loop through instructions
+            //Run fetch, decode, and execute then move the program counter to the next 4 bytes
+            while (!fast && mach.get_pc() != end_pc && !mach.halted() && mach.instructions() < limit){
+                try {
+                    mach.fetch();
+                    //cout << mach.debug_fetch_out() << '\n';
+                    mach.decode();
+                   // cout << mach.debug_decode_out() << '\n';
+                    mach.execute();
+                    //cout << mach.debug_execute_out() << '\n';
+                    mach.memory();
+                    //cout << mach.debug_memory_out() << '\n';
+                    mach.writeback();
+                    //cout << "PC: " << mach.get_pc() << '\n';
+                    //mach.set_pc(mach.get_pc() + 4);
+                }
+                catch (const GuestFault &fault) {
+                    // An address the program may not touch stops it
+                    mach.report_fault(fault, mach.get_pc());
+                }
+            }
+            if (!checkpoint || mach.get_pc() == end_pc || mach.halted() ||
+                !mach.save_checkpoint(checkpoint + ("." + to_string(++checkpoints)), end_pc)) {
+                break;
+            }
+            limit += checkpoint_every;
+            mach.set_instruction_limit(limit);
+        }
+    }
 
-    // Close file
-    fin.close();
+    mach.flush_console();
+    for (thread &other : threads) {
+        other.join();
+    }
 
-    Machine mach (arr, MEM_SIZE);
-    //Loop through instructions
-    //Run fetch, decode, and execute then move the program counter to the next 4 bytes
-    while (mach.get_pc() != size){
-        mach.fetch();
-        //cout << mach.debug_fetch_out() << '\n';
-        mach.decode();
-       // cout << mach.debug_decode_out() << '\n';
-        mach.execute();
-        //cout << mach.debug_execute_out() << '\n';
-        mach.memory();
-        //cout << mach.debug_memory_out() << '\n';
-        mach.writeback();
-        //cout << "PC: " << mach.get_pc() << '\n';
-        //mach.set_pc(mach.get_pc() + 4);
+    if (fusion_stats) {
+        for (int i = FUSE_NONE + 1; i < NUM_FUSIONS; i++) {
+            uint64_t count = mach.fusion_count(static_cast<FusionKinds>(i));
+            for (auto &hart : harts) {
+                count += hart->fusion_count(static_cast<FusionKinds>(i));
+            }
+            cerr << setw(12) << left << FUSION_NAMES[i] << ' ' << count << '\n';
+        }
+    }
+    if (stats) {
+        MachineStats total = mach.stats();
+        for (auto &hart : harts) {
+            total += hart->stats();
+        }
+        total.print(cerr);
+    }
+    if (pipeline) {
+        timing.drain();
+        timing.print(cerr);
+    }
+    if (out_of_order) {
+        core.drain();
+        core.print(cerr);
+    }
+    if (caches) {
+        cache_model.print(cerr);
+    }
+    if (branch_stats) {
+        for (int i = 0; i < num_harts; i++) {
+            Machine &hart = i ? *harts[i - 1] : mach;
+            if (num_harts > 1) {
+                cerr << "Hart " << i << ":\n";
+            }
+            branch_models[i].print(cerr, hart.instructions());
+        }
+    }
+    if (profile) {
+        for (int i = 1; i < num_harts; i++) {
+            profilers[0].merge(profilers[i]);
+        }
+        map<uint64_t, GuestFunction> functions;
+        if (!resume) {
+            functions = Machine::elf_functions(argv[arg]);
+        }
+        if (!profilers[0].write(profile, functions)) {
+            cerr << "[PROFILE] Could not write " << profile << '\n';
+        }
+        else {
+            cerr << "[PROFILE] " << profilers[0].samples() << " samples written to " << profile << '\n';
+        }
     }
 
+    // A program that exits with ECALL passes its status on, as it would on
+    // Linux. The one from exit_group wins over any hart's own exit.
+    if (mach.halted() && !mach.faulted()) {
+        return static_cast<uint8_t>(mach.exit_code());
+    }
 
 return 0; 
 }
\ No newline at end of file
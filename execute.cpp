@@ -14,6 +14,10 @@
 #include <cstdio>
 #include <cmath>
 #include <iomanip>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
 struct FetchOut {
@@ -541,18 +545,15 @@ int main (int argc, char *argv[]) {
     }
 
     // Open binary file and return error and exit if unable to open
-    ifstream fin (argv[1], ios::binary);
-    if (!fin.is_open()) {
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
         cout << "File could not be opened.";
         return 0;
     }
 
     // Calculate file size
-    fin.seekg(0, ios::end);
-    int size = fin.tellg();
-
-    // Return pointer to beginning
-    fin.seekg(0, ios::beg);
+    int size = st.st_size < INT32_MAX ? st.st_size : INT32_MAX;
 
     // If the size isn't a multiple of 4 then print error and exit
     if (size % 4 != 0) {
@@ -560,14 +561,24 @@ int main (int argc, char *argv[]) {
         return 0;
     }
 
-    // New array char pointer 262KB
-    char *arr = new char[262*1024];
+    // If the file won't fit in memory then print error and exit
+    if (size > MEM_SIZE) {
+        cout << "File Too Large";
+        return 0;
+    }
 
-    // Read from file and assign to array
-    fin.read (arr, size);
+    // Reserve 262KB of zeroed memory, then map the file privately over the
+    // start of it, so nothing is copied and stores never reach the file
+    char *arr = static_cast<char *>(mmap(nullptr, 262*1024, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (arr == MAP_FAILED || (size > 0 &&
+        mmap(arr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        cout << "File could not be mapped.";
+        return 0;
+    }
 
     // Close file
-    fin.close();
+    close(fd);
 
     Machine mach (arr, MEM_SIZE);
     //Loop through instructions
@@ -583,5 +594,6 @@ int main (int argc, char *argv[]) {
     }
 
 
+munmap(arr, 262*1024);
 return 0; 
 }
\ No newline at end of file
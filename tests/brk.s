@@ -0,0 +1,35 @@
+# An ELF program that grows and shrinks the heap with brk and checks that
+# memory it gets back is zero again.
+    .text
+    .globl _start
+_start:
+    li a0, 0
+    li a7, 214
+    ecall
+    mv s0, a0
+    li t0, 8192
+    add a0, s0, t0
+    ecall
+    li t1, 55
+    sd t1, 100(s0)
+    li t0, 4200
+    add t0, s0, t0
+    sd t1, 0(t0)
+    mv a0, s0
+    ecall
+    li t0, 8192
+    add a0, s0, t0
+    ecall
+    ld t2, 100(s0)
+    bnez t2, bad
+    li t0, 4200
+    add t0, s0, t0
+    ld t2, 0(t0)
+    bnez t2, bad
+    li a0, 0
+    li a7, 93
+    ecall
+bad:
+    li a0, 1
+    li a7, 93
+    ecall
@@ -0,0 +1,19 @@
+# Every hart stores to its own dword on the page its code is on, over and
+# over, then checks that the last store stuck. Run with --harts=4: under
+# --ram-window each store faults into the interpreter, on all harts at once.
+.text
+_start:
+    slli t0, a0, 3
+    la t1, data
+    add t1, t1, t0
+    li t2, 20000
+1:  sd t2, 0(t1)
+    addi t2, t2, -1
+    bnez t2, 1b
+    ld t3, 0(t1)
+    addi a0, t3, -1
+    li a7, 0
+    ecall
+    .balign 8
+data:
+    .dword 0, 0, 0, 0
@@ -0,0 +1,53 @@
+# An ELF program: checks gp and sp, prints from .data, checks that .bss is
+# zero and writable, then stores into .text, which has to fault.
+.section .text
+.globl _start
+_start:
+  li a7, 2
+  la t1, __global_pointer$
+  bne t1, gp, fail
+  andi t0, sp, 15
+  bnez t0, fail
+  la s0, msg
+1:
+  lbu a0, 0(s0)
+  beqz a0, 2f
+  ecall
+  addi s0, s0, 1
+  j 1b
+2:
+  la s1, buf
+  ld t0, 0(s1)
+  li t3, 4088
+  add t3, t3, s1
+  ld t1, 0(t3)
+  or t0, t0, t1
+  bnez t0, fail
+  li t2, 0x55
+  sd t2, 0(t3)
+  sd t2, -8(sp)
+  la s2, counter
+  ld a0, 0(s2)
+  addi a0, a0, 1
+  sd a0, 0(s2)
+  ld a0, 0(s2)
+  ecall
+  li a0, 10
+  ecall
+  # a store into .text must fault
+  la t0, _start
+  sw zero, 0(t0)
+  li a0, 88
+  ecall
+fail:
+  li a0, 33
+  ecall
+  li a7, 0
+  ecall
+.section .data
+counter: .dword 64
+msg: .asciz "ELF ok "
+.section .sdata
+small: .dword 1
+.section .bss
+buf: .space 8192
@@ -0,0 +1,13 @@
+# Run with --harts=3. Hart 0 calls exit_group(7) while the others spin,
+# which has to stop them all.
+.text
+    bnez a0, spin
+    li t0, 100000
+1:  addi t0, t0, -1
+    bnez t0, 1b
+    li a7, 94
+    li a0, 7
+    ecall
+spin:
+    addi t1, t1, 1
+    j spin
@@ -0,0 +1,28 @@
+# Loops through each pair of instructions --fast and --jit fuse: a call
+# and tail call (auipc+jalr), ret, ld of a global (auipc+ld) and sub+branch.
+.text
+_start:
+  li s0, 0
+  li s1, 100
+  li a7, 2
+1:
+  call addone
+  ld t0, data
+  add s0, s0, t0
+  sub t1, s1, s0
+  bgtz t1, 1b
+  tail fin
+addone:
+  addi s0, s0, 1
+  ret
+fin:
+  addi a0, s0, 0
+  andi a0, a0, 63
+  addi a0, a0, 48
+  ecall
+  li a0, 10
+  ecall
+  j end
+data:
+  .dword 3
+end:
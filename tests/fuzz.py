@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+# Differential fuzzer: writes random RV64IM flat binaries and runs each one
+# with the five stages and with --fast and --jit, with and without
+# --ram-window. Every mode has to print the same checksum and exit the same
+# way the five stages do.
+#
+#     tests/fuzz.py path/to/Writeback [count [first_seed]]
+#
+# A program is a counted loop around random ALU instructions, shifts, LUIs,
+# loads and stores (some of them to a table on the code's own page) and
+# forward branches, followed by a checksum of the registers and memory that
+# it prints in hex. It is built straight from instruction encodings, so no
+# assembler is needed. A failing program is kept, as fuzz_SEED.bin in a
+# temporary directory the output names.
+
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+MODES = [[], ['--fast'], ['--jit'], ['--ram-window'], ['--ram-window', '--fast'],
+         ['--ram-window', '--jit']]
+
+# t0-t2, a0-a6 and s2-s5: what the random instructions use
+REGS = [5, 6, 7, 10, 11, 12, 13, 14, 15, 16, 18, 19, 20, 21]
+ZERO, S1, S6, S7, S8, T6, A4, A7 = 0, 9, 22, 23, 24, 31, 14, 17
+# funct7, funct3 of the register-register instructions, by opcode
+OP = [(0, 0), (0x20, 0), (0, 1), (0, 5), (0x20, 5), (0, 4), (0, 6), (0, 7),
+      (1, 0), (1, 4), (1, 6)]
+OP_32 = [(0, 0), (0x20, 0), (0, 1), (0, 5), (0x20, 5), (1, 0), (1, 4), (1, 6)]
+OP_IMM = [0, 4, 6, 7]     # addi, xori, ori, andi
+LOADS = [0, 1, 2, 3, 4, 5, 6]
+STORES = [0, 1, 2, 3]
+BRANCHES = [0, 1, 4, 5, 6, 7]
+VALUES = [0, 1, -1, 2**63 - 1, -2**63, 2**31, -2**31, 0x7fffffff, 12345, -77]
+
+TABLE = 8                 # The table of initial values, on the code page
+DATA = 0x20000            # What s1 points at
+
+
+def r_type(opcode, f7, f3, rd, rs1, rs2):
+    return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opcode
+
+
+def i_type(opcode, f3, rd, rs1, imm):
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opcode
+
+
+def s_type(f3, rs1, rs2, imm):
+    return (((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | \
+           ((imm & 0x1f) << 7) | 0x23
+
+
+def b_type(f3, rs1, rs2, offset):
+    return (((offset >> 12) & 1) << 31) | (((offset >> 5) & 0x3f) << 25) | (rs2 << 20) | \
+           (rs1 << 15) | (f3 << 12) | (((offset >> 1) & 0xf) << 8) | \
+           (((offset >> 11) & 1) << 7) | 0x63
+
+
+def j_type(rd, offset):
+    return (((offset >> 20) & 1) << 31) | (((offset >> 1) & 0x3ff) << 21) | \
+           (((offset >> 11) & 1) << 20) | (((offset >> 12) & 0xff) << 12) | (rd << 7) | 0x6f
+
+
+def addi(rd, rs1, imm):
+    return i_type(0x13, 0, rd, rs1, imm)
+
+
+class Program:
+    def __init__(self, seed):
+        self.rng = random.Random(seed)
+        self.words = []   # Instructions, or callables that make one once
+                          # every address is known
+
+    def here(self):
+        return len(self.words) * 4
+
+    def emit(self, word):
+        self.words.append(word)
+
+    def random_body(self, count):
+        rng = self.rng
+        for _ in range(count):
+            k = rng.random()
+            rd = rng.choice(REGS)
+            rs1 = rng.choice(REGS + [ZERO])
+            rs2 = rng.choice(REGS + [ZERO])
+            if k < 0.25:
+                f7, f3 = rng.choice(OP)
+                self.emit(r_type(0x33, f7, f3, rd, rs1, rs2))
+            elif k < 0.35:
+                f7, f3 = rng.choice(OP_32)
+                self.emit(r_type(0x3b, f7, f3, rd, rs1, rs2))
+            elif k < 0.45:
+                self.emit(i_type(0x13, rng.choice(OP_IMM), rd, rs1, rng.randint(-2048, 2047)))
+            elif k < 0.48:
+                self.emit(i_type(0x1b, 0, rd, rs1, rng.randint(-2048, 2047)))   # addiw
+            elif k < 0.55:
+                f3, top = rng.choice([(1, 0), (5, 0), (5, 0x400)])
+                self.emit(i_type(0x13, f3, rd, rs1, top | rng.randint(0, 63)))
+            elif k < 0.58:
+                f3, top = rng.choice([(1, 0), (5, 0), (5, 0x400)])
+                self.emit(i_type(0x1b, f3, rd, rs1, top | rng.randint(0, 31)))
+            elif k < 0.64:
+                self.emit((rng.randint(0, 0xfffff) << 12) | (rd << 7) | 0x37)       # lui
+            elif k < 0.72:
+                self.emit(i_type(0x03, rng.choice(LOADS), rd, S1, rng.randint(-256, 248)))
+            elif k < 0.80:
+                self.emit(s_type(rng.choice(STORES), S1, rs2, rng.randint(-256, 248)))
+            elif k < 0.83:
+                # Data on the code page: the code has to notice nothing changed
+                offset = TABLE + 8 * rng.randrange(len(REGS))
+                if rng.random() < 0.5:
+                    self.emit(s_type(3, ZERO, rs2, offset))
+                else:
+                    self.emit(i_type(0x03, 3, rd, ZERO, offset))
+            elif k < 0.92:
+                # A forward branch over a few more instructions
+                at = len(self.words)
+                self.emit(None)
+                self.random_body(rng.randint(0, 3))
+                f3 = rng.choice(BRANCHES)
+                self.words[at] = b_type(f3, rs1, rs2, (len(self.words) - at) * 4)
+            else:
+                self.emit(r_type(0x33, rng.choice([0, 0x20]), 0, rd, rs1, rs2))
+
+    def build(self):
+        rng = self.rng
+        # jal over the table of initial register values
+        self.emit(j_type(ZERO, TABLE + 8 * len(REGS)))
+        self.emit(0)
+        for _ in REGS:
+            value = rng.choice(VALUES + [rng.randint(-2**63, 2**63 - 1)]) & (2**64 - 1)
+            self.emit(value & 0xffffffff)
+            self.emit(value >> 32)
+        for i, reg in enumerate(REGS):
+            self.emit(i_type(0x03, 3, reg, ZERO, TABLE + 8 * i))
+        self.emit((DATA >> 12 << 12) | (S1 << 7) | 0x37)
+        # A counted loop around the random part
+        self.emit(addi(S6, ZERO, rng.randint(1, 50)))
+        loop = self.here()
+        self.random_body(rng.randint(10, 60))
+        self.emit(addi(S6, S6, -1))
+        self.emit(b_type(1, S6, ZERO, loop - self.here()))
+        # Checksum the registers, the data and the table
+        self.emit(addi(S7, ZERO, 7))
+        for reg in REGS:
+            self.emit(addi(S8, ZERO, 31))
+            self.emit(r_type(0x33, 1, 0, S7, S7, S8))
+            self.emit(r_type(0x33, 0, 4, S7, S7, reg))
+        for offset in range(-256, 256, 8):
+            self.emit(i_type(0x03, 3, S8, S1, offset))
+            self.emit(r_type(0x33, 0, 0, S7, S7, S8))
+        for i in range(len(REGS)):
+            self.emit(i_type(0x03, 3, S8, ZERO, TABLE + 8 * i))
+            self.emit(r_type(0x33, 0, 0, S7, S7, S8))
+        # Print it in hex, with ecall a7 = 2
+        self.emit(addi(T6, ZERO, 60))
+        self.emit(addi(A7, ZERO, 2))
+        digit = self.here()
+        self.emit(r_type(0x33, 0, 5, 10, S7, T6))     # srl a0, s7, t6
+        self.emit(i_type(0x13, 7, 10, 10, 15))        # andi a0, a0, 15
+        self.emit(addi(A4, ZERO, 10))
+        self.emit(b_type(4, 10, A4, 8))               # blt a0, a4, +8
+        self.emit(addi(10, 10, 39))
+        self.emit(addi(10, 10, 48))
+        self.emit(0x73)                               # ecall
+        self.emit(addi(T6, T6, -4))
+        self.emit(b_type(5, T6, ZERO, digit - self.here()))
+        self.emit(addi(10, ZERO, 10))
+        self.emit(0x73)
+        return b''.join(word.to_bytes(4, 'little') for word in self.words)
+
+
+def run(emulator, mode, path):
+    try:
+        done = subprocess.run([emulator] + mode + [path], stdin=subprocess.DEVNULL,
+                              stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, timeout=60)
+        return done.stdout, done.returncode
+    except subprocess.TimeoutExpired:
+        return None, 'timeout'
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('usage: fuzz.py path/to/Writeback [count [first_seed]]')
+    emulator = sys.argv[1]
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else 50
+    first = int(sys.argv[3]) if len(sys.argv) > 3 else 1
+    directory = tempfile.mkdtemp(prefix='fuzz.')
+    failed = False
+    for seed in range(first, first + count):
+        path = os.path.join(directory, 'fuzz_%d.bin' % seed)
+        with open(path, 'wb') as out:
+            out.write(Program(seed).build())
+        expected = run(emulator, MODES[0], path)
+        bad = [mode for mode in MODES[1:] if run(emulator, mode, path) != expected]
+        for mode in bad:
+            print('FAIL %s %s' % (path, ' '.join(mode)))
+        if bad:
+            failed = True
+        else:
+            os.remove(path)
+    if not failed:
+        os.rmdir(directory)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,87 @@
+# Run with --harts=4. Every hart adds to shared counters with amoadd and
+# an lr/sc loop, then hart 0 waits for the others and checks the totals and
+# each AMO on its own.
+    csrr s0, mhartid
+    bne s0, a0, bad
+    li s1, 20000
+    li t0, 0x3000
+1:  li t1, 1
+    amoadd.w zero, t1, (t0)
+    addi s1, s1, -1
+    bnez s1, 1b
+    li s1, 20000
+    li t0, 0x3008
+2:  lr.d t2, (t0)
+    addi t2, t2, 1
+    sc.d.rl t3, t2, (t0)
+    bnez t3, 2b
+    addi s1, s1, -1
+    bnez s1, 2b
+    fence
+    li t0, 0x3010
+    li t1, 1
+    amoadd.d zero, t1, (t0)
+    bnez s0, exit
+3:  ld t2, 0(t0)
+    li t3, 4
+    bne t2, t3, 3b
+    li a7, 2
+    li t0, 0x3000
+    lw t1, 0(t0)
+    li t2, 80000
+    li a0, 'Y'
+    beq t1, t2, 4f
+    li a0, 'N'
+4:  ecall
+    ld t1, 8(t0)
+    li a0, 'Y'
+    beq t1, t2, 5f
+    li a0, 'N'
+5:  ecall
+    # single hart checks
+    li t0, 0x3100
+    li t1, -5
+    sw t1, 0(t0)
+    li t2, 3
+    amomin.w t3, t2, (t0)
+    lw t4, 0(t0)
+    add a0, t3, t4
+    addi a0, a0, 'A'+10
+    ecall
+    amominu.w t3, t2, (t0)
+    lw a0, 0(t0)
+    addi a0, a0, 'A'
+    ecall
+    amomax.w t3, t1, (t0)
+    lw a0, 0(t0)
+    addi a0, a0, 'A'
+    ecall
+    amoswap.w t3, t1, (t0)
+    amomaxu.w t3, t2, (t0)
+    lw a0, 0(t0)
+    addi a0, a0, 'A'+5
+    ecall
+    addi t5, t0, 8
+    li t1, 0x0f
+    sd t1, 8(t0)
+    li t2, 0x3c
+    amoxor.d t3, t2, (t5)
+    ld t4, 8(t0)
+    add a0, t3, t4
+    ecall
+    amoand.d t3, t2, (t5)
+    amoor.d t3, t1, (t5)
+    ld a0, 8(t0)
+    addi a0, a0, 'A'-0x30
+    ecall
+    sc.w t3, t2, (t0)
+    addi a0, t3, '0'
+    ecall
+exit:
+    li a7, 0
+    ecall
+bad:
+    li a7, 2
+    li a0, '!'
+    ecall
+    j exit
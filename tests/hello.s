@@ -0,0 +1,17 @@
+# Prints "Hello World" one character at a time with ecall a7 = 2.
+.text
+_start:
+  la s0, msg
+  li a7, 2
+1:
+  lbu a0, 0(s0)
+  beqz a0, 2f
+  ecall
+  addi s0, s0, 1
+  j 1b
+2:
+  j end
+msg:
+  .asciz "Hello World\n"
+  .byte 0,0,0
+end:
@@ -0,0 +1,128 @@
+# Runs every RV64IM instruction the machine has on awkward values and
+# prints a checksum of the results.
+.text
+_start:
+  li s1, 7              # checksum
+  li s2, 31
+  li t0, 0x123456789abcdef0
+  li t1, -12345
+  li t2, 77
+# ALU reg ops
+  add a0, t0, t1; jal ra, mix
+  sub a0, t0, t1; jal ra, mix
+  sll a0, t1, t2; jal ra, mix
+  srl a0, t0, t2; jal ra, mix
+  sra a0, t1, t2; jal ra, mix
+  xor a0, t0, t1; jal ra, mix
+  or  a0, t0, t1; jal ra, mix
+  and a0, t0, t1; jal ra, mix
+  mul a0, t0, t1; jal ra, mix
+  div a0, t0, t1; jal ra, mix
+  rem a0, t0, t1; jal ra, mix
+  addw a0, t0, t1; jal ra, mix
+  subw a0, t0, t1; jal ra, mix
+  sllw a0, t1, t2; jal ra, mix
+  srlw a0, t1, t2; jal ra, mix
+  sraw a0, t1, t2; jal ra, mix
+  mulw a0, t0, t1; jal ra, mix
+  divw a0, t0, t1; jal ra, mix
+  remw a0, t0, t1; jal ra, mix
+# imm ops
+  addi a0, t0, -2000; jal ra, mix
+  xori a0, t1, 1234; jal ra, mix
+  ori  a0, t1, -3; jal ra, mix
+  andi a0, t0, 0x7f0; jal ra, mix
+  slli a0, t1, 40; jal ra, mix
+  srli a0, t1, 40; jal ra, mix
+  srai a0, t1, 40; jal ra, mix
+  addiw a0, t0, 2000; jal ra, mix
+  slliw a0, t0, 5; jal ra, mix
+  srliw a0, t1, 3; jal ra, mix
+  sraiw a0, t1, 3; jal ra, mix
+  lui a0, 0xfedcb; jal ra, mix
+  auipc a0, 0x12; jal ra, mix
+# loads/stores
+  li s3, 0x20000
+  sd t0, 0(s3)
+  sw t1, 8(s3)
+  sh t1, 12(s3)
+  sb t1, 14(s3)
+  ld a0, 0(s3); jal ra, mix
+  lw a0, 4(s3); jal ra, mix
+  lwu a0, 4(s3); jal ra, mix
+  lh a0, 2(s3); jal ra, mix
+  lhu a0, 2(s3); jal ra, mix
+  lb a0, 7(s3); jal ra, mix
+  lbu a0, 7(s3); jal ra, mix
+  lw a0, 8(s3); jal ra, mix
+  lh a0, 12(s3); jal ra, mix
+  lbu a0, 14(s3); jal ra, mix
+  sd s1, -8(s3)
+  ld a0, -8(s3); jal ra, mix
+# branches
+  li a1, 0
+  li t3, 5
+  li t4, -5
+  beq t3, t3, 1f
+  addi a1, a1, 1
+1: bne t3, t4, 1f
+  addi a1, a1, 2
+1: blt t4, t3, 1f
+  addi a1, a1, 4
+1: bge t3, t4, 1f
+  addi a1, a1, 8
+1: beq t3, t4, 1f
+  addi a1, a1, 16
+1: bne t3, t3, 1f
+  addi a1, a1, 32
+1: blt t3, t4, 1f
+  addi a1, a1, 64
+1: bge t4, t3, 1f
+  addi a1, a1, 128
+1: bge t3, t3, 1f
+  addi a1, a1, 256
+1: mv a0, a1; jal ra, mix
+# loop: sum of i*i for i < 1000, with inner data dependency
+  li a0, 0
+  li a2, 0
+  li a3, 1000
+2: mul a4, a2, a2
+  add a0, a0, a4
+  addi a2, a2, 1
+  blt a2, a3, 2b
+  jal ra, mix
+# jalr via register
+  la a5, sub1
+  jalr ra, 0(a5)
+  jal ra, mix
+# print checksum
+  mv a0, s1
+  jal ra, print_hex
+  li a7, 0
+  ecall
+
+sub1:
+  li a0, 4242
+  ret
+
+mix:           # s1 = s1 * 31 ^ a0
+  mul s1, s1, s2
+  xor s1, s1, a0
+  ret
+
+print_hex:     # prints a0 as 16 hex digits + newline
+  mv t5, a0
+  li t6, 60
+  li a7, 2
+3: srl a0, t5, t6
+  andi a0, a0, 15
+  li a4, 10
+  blt a0, a4, 4f
+  addi a0, a0, 39
+4: addi a0, a0, 48
+  ecall
+  addi t6, t6, -4
+  bge t6, zero, 3b
+  li a0, 10
+  ecall
+  ret
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Run every test program in every mode and compare what it prints, and its
+# exit status, with NAME.out. The modes have to agree with each other, so a
+# difference between the five stages, --fast and --jit, with or without
+# --ram-window, shows up as a failure of just those modes. Then fuzz.py
+# checks FUZZ_COUNT (default 50) random programs the same way.
+#
+#     tests/run.sh [path/to/Writeback]
+#
+# Without an argument the emulator is built from Writeback.cpp first.
+# Programs run in this directory, with no input. NAME.opts, if there is
+# one, holds options every run of NAME gets (say --harts=4). The .bin and
+# .elf files are built from the .s next to them with
+#
+#     llvm-mc -triple=riscv64 -mattr=+m,+a,-relax,-c -filetype=obj NAME.s -o NAME.o
+#     llvm-objcopy -O binary --only-section=.text NAME.o NAME.bin
+#     ld.lld NAME.o -o NAME.elf
+
+dir=$(cd "$(dirname "$0")" && pwd)
+emulator=$1
+if [ -z "$emulator" ]; then
+    emulator=${TMPDIR:-/tmp}/Writeback-tests.$$
+    trap 'rm -f "$emulator"' EXIT
+    g++ -O2 -pthread -o "$emulator" "$dir/../Writeback.cpp" || exit 1
+fi
+case $emulator in
+    /*) ;;
+    *) emulator=$(pwd)/$emulator ;;
+esac
+cd "$dir" || exit 1
+
+failed=0
+for program in *.bin *.elf; do
+    name=${program%.*}
+    opts=$(cat "$name.opts" 2>/dev/null)
+    for mode in "" "--fast" "--jit" "--ram-window" "--ram-window --fast" "--ram-window --jit"; do
+        got=$(timeout 60 "$emulator" $opts $mode "$program" </dev/null 2>/dev/null; echo "exit=$?")
+        if [ "$got" != "$(cat "$name.out")" ]; then
+            echo "FAIL $program $opts $mode"
+            failed=1
+        fi
+    done
+done
+python3 fuzz.py "$emulator" "${FUZZ_COUNT:-50}" || failed=1
+[ $failed = 0 ] && echo "all passed"
+exit $failed
@@ -0,0 +1,60 @@
+# Rewrites code that has already run, been translated and been linked to,
+# with stores of data next to it in between, and prints what each version
+# of the code did: "01234" and then "ABAB".
+.text
+_start:
+    li a7, 2
+    la s1, digit
+    la s2, versions
+    la s3, data
+    li s0, 4
+1:  call get_digit
+    ecall
+    sd s0, 0(s3)            # data on the same page as the code
+    lw t1, 0(s2)
+    sw t1, 0(s1)            # a new get_digit, which its caller is linked to
+    sd s0, 8(s3)
+    addi s2, s2, 4
+    addi s0, s0, -1
+    bnez s0, 1b
+    call get_digit
+    ecall
+    li a0, 10
+    ecall
+
+    # The store lands on the next instruction of its own block
+    li s0, 2
+    la s1, target
+    la s2, letters
+    lw s4, 0(s2)
+    lw s5, 4(s2)
+2:  li a0, 65
+    ecall
+    sw s4, 0(s1)
+target:
+    li a0, 67
+    ecall
+    sw s5, 0(s1)
+    addi s0, s0, -1
+    bnez s0, 2b
+    li a0, 10
+    ecall
+    li a7, 0
+    li a0, 0
+    ecall
+
+get_digit:
+digit:
+    li a0, 48
+    ret
+versions:
+    li a0, 49
+    li a0, 50
+    li a0, 51
+    li a0, 52
+letters:
+    li a0, 66
+    li a0, 68
+    .balign 8
+data:
+    .dword 0, 0
@@ -0,0 +1,38 @@
+# Turns on Sv39 with a gigapage and a 4 KiB page, reads through both,
+# jumps through the gigapage, reads satp back, and ends on a page fault.
+ li t0, 0x10000
+ li t1, 0x4401
+ sd t1, 0(t0)
+ li t1, 0xf
+ sd t1, 8(t0)
+ li t0, 0x11000
+ sd t1, 0(t0)
+ li t0, 8
+ slli t0, t0, 60
+ ori t0, t0, 0x10
+ csrw satp, t0
+ sfence.vma
+ li t0, 0x40000000
+ li t1, 0x20000
+ add t2, t0, t1
+ li a0, 'P'
+ sb a0, 0(t2)
+ lbu a0, 0(t1)
+ li a7, 2
+ ecall
+ auipc t3, 0
+ addi t3, t3, 16
+ add t3, t3, t0
+ jr t3
+ li a0, 'J'
+ ecall
+ csrr a1, satp
+ srli a1, a1, 60
+ addi a0, a1, 48
+ ecall
+ li t0, 1
+ slli t0, t0, 31
+ lb a0, 0(t0)
+ ecall
+ li a7, 0
+ ecall
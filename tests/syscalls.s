@@ -0,0 +1,136 @@
+# An ELF program that uses the Linux system calls: openat, fstat, read and
+# write of syscalls.txt, lseek, close, mmap and munmap, clock_gettime, and
+# exit_group.
+    .text
+    .globl _start
+_start:
+    # fd = openat(AT_FDCWD, path, O_RDONLY)
+    li a0, -100
+    la a1, path
+    li a2, 0
+    li a7, 56
+    ecall
+    bltz a0, fail1
+    mv s0, a0
+    # fstat(fd, &st): size at +48
+    la a1, st
+    li a7, 80
+    ecall
+    bnez a0, fail2
+    la t0, st
+    ld s1, 48(t0)
+    # heap = brk(0); brk(heap + size)
+    li a0, 0
+    li a7, 214
+    ecall
+    mv s2, a0
+    add a0, s2, s1
+    li a7, 214
+    ecall
+    add t0, s2, s1
+    bne a0, t0, fail3
+    # read(fd, heap, size) in one go
+    mv a0, s0
+    mv a1, s2
+    mv a2, s1
+    li a7, 63
+    ecall
+    bne a0, s1, fail4
+    # write(1, heap, size)
+    li a0, 1
+    mv a1, s2
+    mv a2, s1
+    li a7, 64
+    ecall
+    bne a0, s1, fail5
+    # lseek(fd, 0, SEEK_END) == size
+    mv a0, s0
+    li a1, 0
+    li a2, 2
+    li a7, 62
+    ecall
+    bne a0, s1, fail6
+    # close(fd); close(fd) again is EBADF
+    mv a0, s0
+    li a7, 57
+    ecall
+    bnez a0, fail7
+    mv a0, s0
+    li a7, 57
+    ecall
+    li t0, -9
+    bne a0, t0, fail7
+    # p = mmap(0, 1M, RW, PRIVATE|ANON, -1, 0); dirty it; munmap; map again
+    li a0, 0
+    li a1, 1048576
+    li a2, 3
+    li a3, 0x22
+    li a4, -1
+    li a5, 0
+    li a7, 222
+    ecall
+    bltz a0, fail8
+    mv s3, a0
+    li t0, 77
+    sd t0, 8(s3)
+    mv a0, s3
+    li a1, 1048576
+    li a7, 215
+    ecall
+    li a0, 0
+    li a1, 4096
+    li a2, 3
+    li a3, 0x22
+    li a4, -1
+    li a7, 222
+    ecall
+    ld t0, 8(a0)
+    bnez t0, fail9
+    # clock_gettime(CLOCK_MONOTONIC, &ts) and a write to stderr
+    li a0, 1
+    la a1, st
+    li a7, 113
+    ecall
+    bnez a0, fail10
+    li a0, 2
+    la a1, msg
+    li a2, 4
+    li a7, 64
+    ecall
+    # Legacy putchar then exit_group(0)
+    li a0, 33
+    li a7, 2
+    ecall
+    li a0, 10
+    li a7, 2
+    ecall
+    li a0, 0
+    li a7, 94
+    ecall
+fail1: li a0, 1
+    j out
+fail2: li a0, 2
+    j out
+fail3: li a0, 3
+    j out
+fail4: li a0, 4
+    j out
+fail5: li a0, 5
+    j out
+fail6: li a0, 6
+    j out
+fail7: li a0, 7
+    j out
+fail8: li a0, 8
+    j out
+fail9: li a0, 9
+    j out
+fail10: li a0, 10
+out:
+    li a7, 93
+    ecall
+    .data
+path: .asciz "syscalls.txt"
+msg: .ascii "err\n"
+    .balign 8
+st: .space 128